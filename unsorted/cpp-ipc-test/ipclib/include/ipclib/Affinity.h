@@ -0,0 +1,21 @@
+// Pinning threads to CPUs, e.g. for busy-polling consumers and their producers
+// All functions can throw unless explicitly marked noexcept
+
+#pragma once
+
+#include <thread>
+#include <vector>
+
+namespace ipclib
+{
+
+/// Restricts calling thread to specified CPUs. Throws std::system_error if it fails or isn't supported
+void pin_this_thread(const std::vector<int>& cpus);
+
+/// Same for another thread
+void pin_thread(std::thread& thread, const std::vector<int>& cpus);
+
+/// CPUs which calling thread may run on, in ascending order
+std::vector<int> allowed_cpus();
+
+} // namespace ipclib
@@ -0,0 +1,50 @@
+// Non-blocking ASIO wrapper for Rpc
+
+#pragma once
+
+#include <asio.hpp>
+#include "ipclib/Rpc.h"
+
+namespace ipclib
+{
+
+class AsioQueueInternal;
+class AsioRpcClientInternal;
+
+
+class AsioRpcClient {
+public:
+	/// Sends request and copies reply into response buffer.
+	/// Any number of calls may be in progress, up to slot count of the client.
+	/// Error is std::errc::message_size if buffer is too small; it's filled anyway
+	void async_call(asio::const_buffer request, asio::mutable_buffer response, std::function<void(std::error_code error, size_t size)> handler);
+	
+	AsioRpcClient(asio::io_context& io, RpcClient client);
+	/// Cancels pending calls with std::errc::operation_canceled
+	~AsioRpcClient();
+	
+	AsioRpcClient(const AsioRpcClient&) = delete;
+	AsioRpcClient(AsioRpcClient&&);
+	
+private:
+	std::unique_ptr<AsioRpcClientInternal> p;
+};
+
+
+class AsioRpcServer {
+public:
+	/// Request may be replied to from any thread, at any time
+	void async_receive(std::function<void(std::error_code error, RpcRequest request)> handler);
+	
+	AsioRpcServer(asio::io_context& io, RpcServer server);
+	~AsioRpcServer();
+	
+	AsioRpcServer(const AsioRpcServer&) = delete;
+	AsioRpcServer(AsioRpcServer&&);
+	
+private:
+	RpcServer server;
+	std::unique_ptr<AsioQueueInternal> p;
+};
+
+} // namespace ipclib
@@ -0,0 +1,140 @@
+// Non-blocking ASIO wrapper for SharedMemory locks
+
+#pragma once
+
+#include <asio.hpp>
+#include <list>
+#include "ipclib/SharedMemory.h"
+
+namespace ipclib
+{
+
+class AsioSharedMemoryInternal;
+
+
+// Shm mutex can't be waited for by io_context, so lock is polled: operation tries to take it
+// immediately, then retries on timer with exponentially growing delay (up to a few ms).
+// Not thread-safe: all functions must be called from io_context thread, like with asio sockets.
+// Handlers are invoked through io_context (or their associated executor), never from initiating function.
+
+class AsioSharedMemory {
+public:
+	/// Handler signature is void(asio::error_code, std::optional<SharedMemoryReadLock>);
+	/// on error (operation_aborted) there is no lock. asio::error_code is used instead of
+	/// std::error_code to be recognized by completion tokens like asio::use_future
+	template <typename CompletionToken>
+	auto async_read_lock(CompletionToken&& token);
+	
+	/// Handler signature is void(asio::error_code, std::optional<SharedMemoryWriteLock>)
+	template <typename CompletionToken>
+	auto async_write_lock(CompletionToken&& token);
+	
+	/// Completes all pending operations with operation_aborted
+	void cancel() noexcept;
+	
+	SharedMemory& get() noexcept;
+	
+	AsioSharedMemory(asio::io_context& io, SharedMemory shm);
+	~AsioSharedMemory(); ///< Cancels pending operations
+	
+	AsioSharedMemory(const AsioSharedMemory&) = delete;
+	AsioSharedMemory(AsioSharedMemory&&) noexcept;
+	
+private:
+	std::shared_ptr<AsioSharedMemoryInternal> p; // shared with pending operations
+	
+	template <typename Lock, typename CompletionToken, typename TryLock>
+	auto async_lock(CompletionToken&& token, TryLock try_lock);
+};
+
+
+// Implementation, required by templates
+
+class AsioSharedMemoryInternal {
+public:
+	asio::io_context& io;
+	SharedMemory shm;
+	std::list<asio::steady_timer> timers; // of pending operations
+	uint64_t cancel_count = 0; // operations started before last cancel() must complete with error
+	bool closed = false;
+	
+	static constexpr std::chrono::microseconds min_delay{20};
+	static constexpr std::chrono::microseconds max_delay{5000};
+	
+	AsioSharedMemoryInternal(asio::io_context& io, SharedMemory shm): io(io), shm(std::move(shm)) {}
+};
+
+template <typename Lock, typename Handler, typename TryLock>
+class AsioSharedMemoryOperation {
+public:
+	AsioSharedMemoryOperation(std::shared_ptr<AsioSharedMemoryInternal> p, Handler handler, TryLock try_lock):
+		p(std::move(p)), handler(std::move(handler)), try_lock(std::move(try_lock)), cancel_count(this->p->cancel_count)
+	{}
+	
+	void start() {
+		if (auto lock = try_lock()) {
+			complete({}, std::move(lock));
+			return;
+		}
+		timer = p->timers.emplace(p->timers.end(), p->io);
+		wait();
+	}
+	void operator()(asio::error_code error) {
+		if (error || p->closed || cancel_count != p->cancel_count) {
+			p->timers.erase(timer);
+			complete(asio::error::operation_aborted, {});
+			return;
+		}
+		if (auto lock = try_lock()) {
+			p->timers.erase(timer);
+			complete({}, std::move(lock));
+			return;
+		}
+		delay = std::min(delay * 2, AsioSharedMemoryInternal::max_delay);
+		wait();
+	}
+	
+private:
+	std::shared_ptr<AsioSharedMemoryInternal> p;
+	Handler handler;
+	TryLock try_lock;
+	uint64_t cancel_count;
+	std::list<asio::steady_timer>::iterator timer;
+	std::chrono::microseconds delay = AsioSharedMemoryInternal::min_delay;
+	
+	void wait() {
+		timer->expires_after(delay);
+		auto& t = *timer;
+		t.async_wait(std::move(*this));
+	}
+	void complete(asio::error_code error, std::optional<Lock> lock) {
+		auto executor = asio::get_associated_executor(handler, p->io.get_executor());
+		asio::post(executor, [handler = std::move(handler), error, lock = std::move(lock)]() mutable {
+			handler(error, std::move(lock));
+		});
+	}
+};
+
+template <typename Lock, typename CompletionToken, typename TryLock>
+auto AsioSharedMemory::async_lock(CompletionToken&& token, TryLock try_lock) {
+	return asio::async_initiate<CompletionToken, void(asio::error_code, std::optional<Lock>)>(
+		[p = p, try_lock = std::move(try_lock)](auto handler) {
+			using Operation = AsioSharedMemoryOperation<Lock, decltype(handler), TryLock>;
+			Operation(p, std::move(handler), std::move(try_lock)).start();
+		},
+		token);
+}
+template <typename CompletionToken>
+auto AsioSharedMemory::async_read_lock(CompletionToken&& token) {
+	return async_lock<SharedMemoryReadLock>(std::forward<CompletionToken>(token), [p = p.get()] {
+		return p->shm.try_read_lock();
+	});
+}
+template <typename CompletionToken>
+auto AsioSharedMemory::async_write_lock(CompletionToken&& token) {
+	return async_lock<SharedMemoryWriteLock>(std::forward<CompletionToken>(token), [p = p.get()] {
+		return p->shm.try_write_lock();
+	});
+}
+
+} // namespace ipclib
@@ -0,0 +1,103 @@
+// Persistent interprocess message log with replay
+// All functions can throw unless explicitly marked noexcept
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include "ipclib/Queue.h"
+
+namespace ipclib
+{
+
+class JournalInternal;
+
+
+// Journal is a directory of append-only segment files, each is mapped by all users.
+// Every message gets sequence number, starting from 1; all consumers see all messages,
+// each at its own position. Named consumer position can be committed to disk,
+// so after restart consumer continues from it; any kept message can be replayed with seek().
+//
+// Segment which is full is synced and next one is created; old segments are never removed.
+// Writes are durable only after sync: concurrent sync() calls of all producers are served
+// by one msync (group commit), optionally delayed to gather more messages.
+//
+// Journal may be opened by any number of processes; state is recovered from files
+// when the first one opens it, including after crash.
+
+struct JournalOptions {
+	/// Byte size of segment file, used only if journal is created or recovered by this call.
+	/// Message must fit into it
+	size_t segment_size = 64 * 1024 * 1024;
+
+	/// write_message() returns only when message is durable
+	bool sync_writes = false;
+
+	/// How long sync() waits for other writes before flushing, so they share one msync
+	std::chrono::microseconds commit_delay{0};
+};
+
+
+class JournalProducer {
+public:
+	/// Calls function with memory of specified size inside journal; returns sequence number of message
+	uint64_t write_message(std::function<void(void *mem)> writer, size_t size);
+
+	/// Blocks until all messages up to specified one are on disk
+	void sync(uint64_t seq);
+
+	/// Creates directory if it doesn't exist
+	static JournalProducer open(const std::string& dir, const JournalOptions& options = {});
+
+	~JournalProducer() noexcept;
+
+	JournalProducer(const JournalProducer&) = delete;
+	JournalProducer(JournalProducer&&) noexcept;
+
+private:
+	std::unique_ptr<JournalInternal> p;
+	JournalProducer(std::unique_ptr<JournalInternal> p);
+};
+
+
+class JournalConsumer {
+public:
+	using ReadRet = QueueConsumer::ReadRet;
+
+	/// Calls function with next message. Returns ReadNoProducersLeft if all messages are read
+	/// and the last producer has been destroyed since previous such return or object creation
+	ReadRet read_message(std::function<void(uint64_t seq, const void *mem, size_t size)> reader);
+
+	/// Cancels waiting read with ReadCancelled. Can be safely called from another thread
+	void cancel_read();
+
+	/// Next read returns message with this sequence number, or the oldest kept one
+	void seek(uint64_t seq);
+
+	/// Sequence number of message which will be read next
+	uint64_t position() const noexcept;
+
+	/// Persists position, so consumer with the same name continues from it after reopening
+	void commit();
+
+	/// Last persisted position
+	uint64_t committed() const noexcept;
+
+	/// Starts at committed position of consumer with this name, or at the oldest kept message.
+	/// Creates directory if it doesn't exist. Throws std::length_error if there are too many names
+	static JournalConsumer open(const std::string& dir, const std::string& name, const JournalOptions& options = {});
+
+	/// Cancels waiting reads with ReadDestroyed
+	~JournalConsumer() noexcept;
+
+	JournalConsumer(const JournalConsumer&) = delete;
+	JournalConsumer(JournalConsumer&&) noexcept;
+
+private:
+	std::unique_ptr<JournalInternal> p;
+	JournalConsumer(std::unique_ptr<JournalInternal> p);
+};
+
+} // namespace ipclib
@@ -0,0 +1,41 @@
+// NUMA placement of shared memory
+// All functions can throw unless explicitly marked noexcept
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace ipclib
+{
+
+/// Where pages of segment are allocated. For shm it's a property of the object, so it applies
+/// to pages first touched by any process. Ignored on single-node systems
+struct NumaPolicy {
+	enum Mode {
+		Default, ///< Node of CPU which touches page first
+		Bind, ///< Only specified nodes
+		Interleave, ///< Round-robin over specified nodes, page by page
+		Preferred ///< Specified node if it has free memory
+	};
+	Mode mode = Default;
+	uint64_t nodes = 0; ///< Bit per node index; Preferred requires exactly one
+
+	static NumaPolicy bind(int node); ///< Throws if node index isn't below 64
+	static NumaPolicy interleave(uint64_t nodes) noexcept { return {Interleave, nodes}; }
+};
+
+/// Highest node index + 1, as node numbers may have gaps; masks are sized by it.
+/// 1 if system isn't NUMA or it can't be determined
+int numa_node_count() noexcept;
+
+/// Applies policy to pages of mapping, including ones which aren't allocated yet.
+/// Already allocated pages aren't moved. Address must be page-aligned
+void numa_bind(void *addr, size_t size, const NumaPolicy& policy);
+
+/// Number of pages of range on each node (index is node). Counts only pages which are
+/// mapped by calling process - pages it never touched aren't reported
+std::vector<size_t> numa_pages(const void *addr, size_t size);
+
+} // namespace ipclib
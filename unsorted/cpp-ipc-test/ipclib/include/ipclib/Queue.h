@@ -3,10 +3,14 @@
 
 #pragma once
 
+#include <chrono>
+#include <cstdint>
 #include <functional>
 #include <memory>
 #include <string>
 #include <system_error>
+#include <vector>
+#include "ipclib/Numa.h"
 
 namespace ipclib {
 
@@ -17,12 +21,85 @@ class QueueInternal;
 void remove_queue(const std::string& name) noexcept;
 
 
+// Name starting with "unix:" selects socket transport for processes which can't share memory
+// (e.g. in different containers); the rest of name is path of Unix domain socket.
+// Side which creates queue listens on socket and accepts any number of peers of the other kind,
+// which open it: consumer reads messages of all its producers in turn, producer sends messages
+// to its consumers in turn. Messages over 64 KB are written directly into memfd passed to consumer.
+//
+// Differences from shm queue:
+// - write blocks while consumer doesn't read, and creating producer blocks until some consumer connects
+// - messages already sent to consumer are lost if it's destroyed without reading them
+// - of QueueOptions only ttl is used; busy polling and QueueSet aren't supported
+// - producer which opened socket throws std::system_error once consumer is gone; consumer which
+//   opened socket returns ReadNoProducersLeft on every read once producer is gone
+// - QueueStats has only expired count
+
+
+/// Queue parameters, used only by create(). Opened queue keeps parameters it was created with
+struct QueueOptions {
+    /// Number of per-producer lanes, 0 disables them.
+    /// Each producer takes a free lane (private single-producer ring) on creation and writes to it
+    /// without locking; producers which didn't get one use shared locked buffer as usual.
+    /// Lanes are bounded: writing to a full lane blocks until consumer frees enough space.
+    int lanes = 0;
+    size_t lane_size = 1024 * 1024; ///< Byte size of each lane, message with its 32-byte record header must fit into it
+
+    enum LaneOrder {
+        LaneRoundRobin, ///< Consumer takes messages from lanes in turn
+        LaneTimestamp ///< Consumer takes the oldest message from all lanes
+    };
+    LaneOrder lane_order = LaneRoundRobin;
+
+    /// Idle shrink of shared buffer: once it has grown over shrink_high bytes and queued messages
+    /// take no more than shrink_low, memory above shrink_low is returned to the system.
+    /// Object size stays the same, so other processes don't have to remap. 0 disables
+    size_t shrink_high = 64 * 1024 * 1024;
+    size_t shrink_low = 1024 * 1024;
+
+    /// Default time to live of message, 0 means forever. Expired messages are dropped by consumer
+    std::chrono::nanoseconds ttl{0};
+
+    /// Placement of queue memory, including lanes. Applied by every process which maps it
+    NumaPolicy numa;
+
+    /// Messages of at least this byte size are compressed (LZ4 block format), 0 disables.
+    /// Compression and decompression happen in scratch memory of calling thread, outside of locks.
+    /// Compressed message is taken from the queue before it's decompressed, so it's lost if reader throws
+    size_t compress_threshold = 0;
+};
+
+
+/// Memory statistics, common for all producers and consumers of the queue
+struct QueueStats {
+    size_t object_size; ///< Byte size of shm object
+    size_t allocated; ///< Bytes of shm object actually backed by memory
+    size_t queued; ///< Bytes used by messages in shared buffer (lanes not included)
+    uint64_t shrink_count; ///< Times memory was returned
+    uint64_t shrunk_bytes; ///< Total bytes returned
+    uint64_t expired; ///< Messages dropped by consumers because of TTL
+    std::vector<size_t> numa_pages; ///< Pages on each NUMA node, only ones mapped by calling process
+
+    uint64_t compressed; ///< Messages stored compressed
+    uint64_t compress_skipped; ///< Messages over threshold stored as is, because they didn't get smaller
+    uint64_t compressed_raw_bytes; ///< Size of compressed messages before compression
+    uint64_t compressed_bytes; ///< and after
+    std::chrono::nanoseconds compress_time; ///< CPU time spent by producers, including skipped messages
+    std::chrono::nanoseconds decompress_time; ///< CPU time spent by consumers
+};
+
+
 class QueueProducer {
 public:
     /// Calls function with internally-allocated memory of specified size
     void write_message(std::function<void(void *mem)> writer, size_t size);
 
-    static QueueProducer create(const std::string& name, bool allow_existing = false);
+    /// Same, but message is dropped instead of being read after specified time, regardless of queue TTL
+    void write_message(std::function<void(void *mem)> writer, size_t size, std::chrono::steady_clock::time_point expires);
+
+    QueueStats stats();
+
+    static QueueProducer create(const std::string& name, bool allow_existing = false, const QueueOptions& options = {});
     static QueueProducer open(const std::string& name);
 
     /// Destroys underlying object if no other users remain
@@ -48,13 +125,19 @@ public:
 
     static std::error_code get_error_code(ReadRet ret);
 
-    /// Calls function when new message is received
+    /// Calls function when new message is received; expired messages are dropped without calling it
     ReadRet read_message(std::function<void(const void *mem, size_t size)> reader);
 
     /// Cancels waiting read with ReadCancelled. Can be safely called from another thread
     void cancel_read();
 
-    static QueueConsumer create(const std::string& name, bool allow_existing = false);
+    /// If enabled, read_message() spins on the queue instead of sleeping in kernel, taking whole CPU
+    /// while waiting (see ipclib/Affinity.h to pin it). Cancel is noticed with a small delay
+    void set_busy_poll(bool enabled) noexcept;
+
+    QueueStats stats();
+
+    static QueueConsumer create(const std::string& name, bool allow_existing = false, const QueueOptions& options = {});
     static QueueConsumer open(const std::string& name);
 
     /// Destroys underlying object if no other users remain.
@@ -70,6 +153,35 @@ private:
     uint64_t last_cancel_all;
 
     QueueConsumer(std::unique_ptr<QueueInternal> p);
+    friend class QueueSet;
+};
+
+
+/// Waits for messages on many consumers at once, like epoll. One thread blocks in a single
+/// syscall on wait slots of all consumers, producers wake it the same way as a waiting read.
+/// Consumers must not be read by other threads while set waits, and must be removed
+/// from the set (or the set destroyed) before they are
+class QueueSet {
+public:
+    static constexpr int max_consumers = 128;
+
+    /// Returns index reported by wait(). Throws std::length_error if set is full
+    /// and std::runtime_error if consumer didn't get wait slot (queue has too many consumers)
+    int add(QueueConsumer& consumer);
+
+    /// Index becomes free and may be returned by add() again
+    void remove(int index);
+
+    /// Blocks until some consumers have message or read_message() would return immediately
+    /// for other reason (like cancel_read()), returns their indices; empty on timeout.
+    /// First index rotates between calls, so serving queues in returned order is fair.
+    /// If queue has other consumers or messages expire, read_message() may block anyway.
+    /// Returns empty at once if set has no consumers, instead of sleeping until timeout
+    std::vector<int> wait(std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max());
+
+private:
+    std::vector<QueueConsumer*> consumers; // null if removed
+    int first = 0; // index from which wait() starts
 };
 
 } // namespace ipclib
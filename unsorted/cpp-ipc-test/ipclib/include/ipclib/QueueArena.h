@@ -0,0 +1,106 @@
+// Many small queues inside one SharedMemory segment
+// All functions can throw unless explicitly marked noexcept
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include "ipclib/Queue.h"
+#include "ipclib/SharedMemory.h"
+
+namespace ipclib
+{
+
+class QueueArenaInternal;
+class ArenaQueueInternal;
+
+
+// Directory of named queues (open addressing hash table) and queue buffers are allocated with
+// SharedAllocator created over whole segment, so segment must not be used for anything else.
+// Opening queue is a directory lookup under one mutex - no shm_open, ftruncate or mmap per queue.
+//
+// Unlike Queue, arena queues are bounded rings of fixed capacity: writing to a full queue blocks
+// until consumer frees enough space. Queue is removed from directory and its memory is freed
+// when last producer or consumer is destroyed.
+//
+// Arena object must outlive all producers and consumers opened through it.
+
+class QueueArena {
+public:
+	static constexpr size_t max_name = 64; ///< Including terminating null
+
+	/// Initializes arena over whole segment, destroying its contents.
+	/// Directory size is rounded up to power of two
+	static QueueArena create(SharedMemory& shm, size_t max_queues = 4096);
+
+	/// Attaches to arena created by another process. Throws if there is none
+	static QueueArena attach(SharedMemory& shm);
+
+	/// Number of queues in directory
+	size_t size() noexcept;
+
+	~QueueArena() noexcept;
+
+	QueueArena(const QueueArena&) = delete;
+	QueueArena(QueueArena&&) noexcept;
+
+private:
+	std::unique_ptr<QueueArenaInternal> p;
+	QueueArena(std::unique_ptr<QueueArenaInternal> p);
+
+	friend class ArenaQueueProducer;
+	friend class ArenaQueueConsumer;
+};
+
+
+class ArenaQueueProducer {
+public:
+	/// Calls function with internally-allocated memory of specified size.
+	/// Throws std::length_error if message can't fit into queue even if it's empty
+	void write_message(std::function<void(void *mem)> writer, size_t size);
+
+	/// Capacity is minimal byte size of queue ring, used only if queue doesn't exist yet.
+	/// Ring and its header take allocator block, so capacity grows to fill it (see SharedAllocator::usable_size()).
+	/// Throws std::length_error if directory is full and std::bad_alloc if segment is
+	static ArenaQueueProducer create(QueueArena& arena, const std::string& name, size_t capacity = 64 * 1024, bool allow_existing = false);
+	static ArenaQueueProducer open(QueueArena& arena, const std::string& name);
+
+	/// Removes queue if no other users remain
+	~ArenaQueueProducer() noexcept;
+
+	ArenaQueueProducer(const ArenaQueueProducer&) = delete;
+	ArenaQueueProducer(ArenaQueueProducer&&) noexcept;
+
+private:
+	std::unique_ptr<ArenaQueueInternal> p;
+	ArenaQueueProducer(std::unique_ptr<ArenaQueueInternal> p);
+};
+
+
+class ArenaQueueConsumer {
+public:
+	using ReadRet = QueueConsumer::ReadRet;
+
+	/// Calls function when new message is received
+	ReadRet read_message(std::function<void(const void *mem, size_t size)> reader);
+
+	/// Cancels waiting read with ReadCancelled. Can be safely called from another thread
+	void cancel_read();
+
+	static ArenaQueueConsumer create(QueueArena& arena, const std::string& name, size_t capacity = 64 * 1024, bool allow_existing = false);
+	static ArenaQueueConsumer open(QueueArena& arena, const std::string& name);
+
+	/// Removes queue if no other users remain.
+	/// Cancels waiting reads with ReadDestroyed
+	~ArenaQueueConsumer() noexcept;
+
+	ArenaQueueConsumer(const ArenaQueueConsumer&) = delete;
+	ArenaQueueConsumer(ArenaQueueConsumer&&) noexcept;
+
+private:
+	std::unique_ptr<ArenaQueueInternal> p;
+	ArenaQueueConsumer(std::unique_ptr<ArenaQueueInternal> p);
+};
+
+} // namespace ipclib
@@ -0,0 +1,119 @@
+// Request/reply calls over Queue
+// All functions can throw unless explicitly marked noexcept
+//
+// Requests go to server through single Queue. Each client owns small shm object
+// with preallocated reply slots; server writes reply directly into the slot of the request
+// and wakes only the caller waiting on it. Requests are matched to slots by correlation ID,
+// so client may have many requests in flight (pipelining).
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+#include "ipclib/Queue.h"
+
+namespace ipclib
+{
+
+class RpcClientInternal;
+class RpcReplySlots;
+
+
+struct RpcOptions {
+    int slots = 64; ///< Max number of requests in flight
+    size_t slot_size = 64 * 1024; ///< Max byte size of reply
+};
+
+
+class RpcClient {
+public:
+    using CallId = uint64_t;
+    static constexpr std::chrono::milliseconds no_timeout = std::chrono::milliseconds::max();
+
+    /// Sends request without waiting for reply. Blocks while all reply slots are in use
+    CallId send(std::function<void(void *mem)> writer, size_t size);
+
+    /// Waits for reply and calls function with it. Each call must be received exactly once,
+    /// unless it times out (then reply is discarded when it arrives).
+    /// Returns error sent by server, std::errc::timed_out or std::errc::invalid_argument for unknown call
+    std::error_code receive(CallId call, std::function<void(const void *mem, size_t size)> reader,
+                            std::chrono::milliseconds timeout = no_timeout);
+
+    /// Sends request and waits for reply
+    std::error_code call(const void *request, size_t size, std::function<void(const void *mem, size_t size)> reader,
+                         std::chrono::milliseconds timeout = no_timeout);
+
+    /// Creates reply slots and connects to existing server
+    static RpcClient connect(const std::string& server_name, const RpcOptions& options = {});
+
+    /// Removes reply slots; replies to pending calls are discarded
+    ~RpcClient() noexcept;
+
+    RpcClient(const RpcClient&) = delete;
+    RpcClient(RpcClient&&) noexcept;
+
+private:
+    friend class AsioRpcClientInternal;
+    std::unique_ptr<RpcClientInternal> p;
+    RpcClient(std::unique_ptr<RpcClientInternal> p);
+};
+
+
+/// Received request. Must be replied to exactly once; if destroyed without reply,
+/// caller receives std::errc::operation_canceled
+class RpcRequest {
+public:
+    const void *data() const noexcept;
+    size_t size() const noexcept;
+
+    /// Calls function with memory of caller's reply slot.
+    /// If size exceeds slot size, caller receives std::errc::message_size and this throws
+    void reply(std::function<void(void *mem)> writer, size_t size);
+    void reply(const void *data, size_t size);
+    void reply(std::error_code error);
+
+    RpcRequest() noexcept;
+    ~RpcRequest() noexcept;
+
+    RpcRequest(const RpcRequest&) = delete;
+    RpcRequest(RpcRequest&&) noexcept;
+    RpcRequest& operator=(RpcRequest&&) noexcept;
+
+private:
+    friend class RpcServer;
+    std::vector<uint8_t> request;
+    std::shared_ptr<RpcReplySlots> target; // reply slots of the caller, null if already replied
+    uint64_t call = 0;
+};
+
+
+class RpcServer {
+public:
+    /// Waits for next request. Returns same values as QueueConsumer::read_message
+    QueueConsumer::ReadRet receive(RpcRequest& request);
+
+    /// Cancels waiting receive() with ReadCancelled. Can be safely called from another thread
+    void cancel_receive();
+
+    /// Creates request queue with specified name
+    static RpcServer create(const std::string& name, bool allow_existing = false);
+    /// Opens existing server, so requests can be handled by several threads or processes
+    static RpcServer open(const std::string& name);
+
+    ~RpcServer() noexcept;
+
+    RpcServer(const RpcServer&) = delete;
+    RpcServer(RpcServer&&) noexcept;
+
+private:
+    class Targets;
+    QueueConsumer q;
+    std::unique_ptr<Targets> targets; // opened reply slots of clients
+    RpcServer(QueueConsumer q);
+};
+
+} // namespace ipclib
@@ -0,0 +1,66 @@
+// Lock-free slab allocator inside SharedMemory segment
+// All functions can throw unless explicitly marked noexcept
+
+#pragma once
+
+#include <memory>
+#include "ipclib/SharedMemory.h"
+
+namespace ipclib
+{
+
+class SharedAllocatorInternal;
+
+
+class SharedAllocator {
+public:
+	// Segment is divided into pages. Small blocks (power-of-two size classes up to page size)
+	// are carved from pages one page at a time, bigger ones take several whole pages.
+	// Freed blocks are kept in lock-free per-class free lists and never returned to pages.
+	//
+	// Handles are offsets from the beginning of segment data, so they are valid in every process.
+	// Allocator never resizes segment; it uses size which segment had when allocator was created.
+	
+	using Handle = uint64_t;
+	static constexpr Handle null = 0;
+	
+	/// Initializes allocator over whole segment, destroying its contents
+	static SharedAllocator create(SharedMemory& shm, size_t page_size = 64 * 1024, int magazine_size = 0);
+	
+	/// Attaches to allocator created by another process. Throws if there is none.
+	/// Magazine size is number of cached free blocks per size class, kept by this object;
+	/// it makes allocation and freeing of small blocks lock-free and process-local,
+	/// but such object must not be used by multiple threads at once. 0 disables magazines.
+	static SharedAllocator attach(SharedMemory& shm, int magazine_size = 0);
+	
+	/// Throws std::bad_alloc if there is no space left
+	Handle allocate(size_t size);
+	/// Byte size of block which allocate(size) returns, all of it may be used - size is rounded up
+	/// to power of two. Throws std::bad_alloc if it's too big
+	static size_t usable_size(size_t size);
+	void deallocate(Handle handle) noexcept;
+	
+	/// Returns address of block in this process
+	void *get(Handle handle) const noexcept;
+	
+	template <typename T>
+	T *get(Handle handle) const noexcept {
+		return static_cast<T*>(get(handle));
+	}
+	
+	/// Handle stored in allocator header, so other processes can find data structure after attach()
+	void set_root(Handle handle) noexcept;
+	Handle root() const noexcept;
+	
+	/// Returns cached blocks to shared free lists
+	~SharedAllocator() noexcept;
+	
+	SharedAllocator(const SharedAllocator&) = delete;
+	SharedAllocator(SharedAllocator&&) noexcept;
+	
+private:
+	std::unique_ptr<SharedAllocatorInternal> p;
+	SharedAllocator(std::unique_ptr<SharedAllocatorInternal> p);
+};
+
+} // namespace ipclib
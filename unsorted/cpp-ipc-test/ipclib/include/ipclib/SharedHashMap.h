@@ -0,0 +1,66 @@
+// Concurrent interprocess hash map inside SharedMemory segment
+// All functions can throw unless explicitly marked noexcept
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include "ipclib/SharedMemory.h"
+
+namespace ipclib
+{
+
+class SharedHashMapInternal;
+
+
+// Open addressing table with linear probing; keys are 64-bit integers, values have fixed size
+// (store SharedAllocator handle to keep variable-size data). Table is allocated with SharedAllocator
+// created over whole segment, so segment must not be used for anything else.
+//
+// Lookups are lock-free: each bucket has version counter which is odd while bucket is written,
+// reader copies bucket and retries if version has changed. Updates lock only the bucket where
+// probing for the key starts, and briefly the bucket which is modified.
+//
+// When table becomes 3/4 full, bigger one is allocated and buckets are moved there incrementally:
+// each update moves its own bucket chain and a few others before proceeding, lookups check
+// which table holds the key. Old table is freed once no process can access it, which is
+// tracked with per-object epoch slots - so object must not be used by multiple threads at once.
+
+class SharedHashMap {
+public:
+	using Key = uint64_t;
+
+	/// Initializes map over whole segment, destroying its contents
+	static SharedHashMap create(SharedMemory& shm, size_t value_size, size_t capacity = 1024);
+
+	/// Attaches to map created by another process. Throws if there is none or all epoch slots are taken
+	static SharedHashMap attach(SharedMemory& shm);
+
+	/// Copies value; returns false if key is not found
+	bool find(Key key, void *value);
+
+	/// Inserts or replaces value; returns true if key was inserted. Throws std::bad_alloc if there is no space left
+	bool insert(Key key, const void *value);
+
+	/// Calls function under bucket lock with current value, or zeroed if key is inserted (then 'inserted' is true)
+	void update(Key key, const std::function<void(uint8_t *value, bool inserted)>& function);
+
+	/// Returns false if key is not found
+	bool erase(Key key);
+
+	size_t size() const noexcept; ///< Number of keys
+	size_t capacity() const noexcept; ///< Number of buckets in current table
+	size_t value_size() const noexcept;
+
+	/// Frees epoch slot
+	~SharedHashMap() noexcept;
+
+	SharedHashMap(const SharedHashMap&) = delete;
+	SharedHashMap(SharedHashMap&&) noexcept;
+
+private:
+	std::unique_ptr<SharedHashMapInternal> p;
+	SharedHashMap(std::unique_ptr<SharedHashMapInternal> p);
+};
+
+} // namespace ipclib
@@ -3,8 +3,13 @@
 
 #pragma once
 
+#include <chrono>
+#include <functional>
 #include <memory>
+#include <optional>
 #include <string>
+#include <vector>
+#include "ipclib/Numa.h"
 
 namespace ipclib
 {
@@ -12,6 +17,13 @@ namespace ipclib
 class SharedMemoryInternal;
 class SharedMemoryInternalRead;
 class SharedMemoryInternalWrite;
+struct SharedMemorySnapshotData;
+
+/// Byte range of SharedMemory data
+struct SharedMemoryRange {
+	size_t offset;
+	size_t length;
+};
 
 
 class SharedMemoryReadLock {
@@ -20,6 +32,8 @@ public:
     size_t size() const noexcept;
 	
 	SharedMemoryReadLock(SharedMemoryInternal& p);
+	SharedMemoryReadLock(SharedMemoryInternal& p, SharedMemoryRange range);
+	SharedMemoryReadLock(SharedMemoryInternal& p, const std::vector<SharedMemoryRange>& ranges);
     ~SharedMemoryReadLock() noexcept;
 
     SharedMemoryReadLock(const SharedMemoryReadLock&) = delete;
@@ -27,7 +41,15 @@ public:
 	SharedMemoryReadLock& operator=(SharedMemoryReadLock&&);
 
 private:
-	std::unique_ptr<SharedMemoryInternalRead> p;
+	friend class SharedMemory;
+	struct TryLock {};
+	SharedMemoryReadLock(SharedMemoryInternal& p, TryLock); ///< Not locked if p is null
+	
+	// lock state is stored inline, so taking lock doesn't allocate
+	static constexpr size_t storage_size = 64;
+	static constexpr size_t storage_align = 8;
+	alignas(storage_align) unsigned char storage[storage_size];
+	SharedMemoryInternalRead *p = nullptr; // points to storage, null if moved from
 };
 
 
@@ -36,7 +58,13 @@ public:
     uint8_t *data() const noexcept;
     size_t size() const noexcept;
 	
+	/// Records modified byte range, for SharedMemoryMirror, snapshots and checkpoints.
+	/// If nothing is marked, whole region (or all locked ranges) is considered modified
+	void mark_dirty(size_t offset, size_t length) noexcept;
+	
 	SharedMemoryWriteLock(SharedMemoryInternal& p);
+	SharedMemoryWriteLock(SharedMemoryInternal& p, SharedMemoryRange range);
+	SharedMemoryWriteLock(SharedMemoryInternal& p, const std::vector<SharedMemoryRange>& ranges);
     ~SharedMemoryWriteLock() noexcept;
 
     SharedMemoryWriteLock(const SharedMemoryWriteLock&) = delete;
@@ -44,7 +72,37 @@ public:
 	SharedMemoryWriteLock& operator=(SharedMemoryWriteLock&&);
 
 private:
-	std::unique_ptr<SharedMemoryInternalWrite> p;
+	friend class SharedMemory;
+	struct TryLock {};
+	SharedMemoryWriteLock(SharedMemoryInternal& p, TryLock); ///< Not locked if p is null
+	
+	static constexpr size_t storage_size = 384;
+	static constexpr size_t storage_align = 8;
+	alignas(storage_align) unsigned char storage[storage_size];
+	SharedMemoryInternalWrite *p = nullptr; // points to storage, null if moved from
+};
+
+
+/// Consistent private copy of SharedMemory data, which doesn't need any lock to be read.
+/// Data is split into pages, which are shared with other snapshots taken from the same object
+class SharedMemorySnapshot {
+public:
+	static constexpr size_t page_size = 4096;
+	
+	size_t size() const noexcept;
+	uint64_t version() const noexcept; ///< SharedMemory::version() at the moment snapshot was taken
+	
+	/// Copies bytes out of snapshot. Throws if range is outside of data
+	void read(size_t offset, size_t length, void *out) const;
+	
+	/// Page of data; last one can be incomplete
+	const uint8_t *page(size_t index) const noexcept;
+	size_t page_count() const noexcept;
+	
+private:
+	friend class SharedMemory;
+	std::shared_ptr<const SharedMemorySnapshotData> p;
+	SharedMemorySnapshot(std::shared_ptr<const SharedMemorySnapshotData> p);
 };
 
 
@@ -54,13 +112,18 @@ public:
 	//
 	// Internally shared memory is represented by two objects - shm object and mapped region.
 	// Shm is an actual shared memory, mapped region is a mapping of that memory
-	// to the address space of a process. They may be resized independently.
+	// to the address space of a process.
+	//
+	// Resize increments generation stored in shm; taking a lock remaps region if generation
+	// has changed since last time. Shm is downsized only after every process has remapped
+	// to the new size, so accessing stale mapping is safe (but it may contain outdated size).
 	//
-	// BEWARE: if shm is downsized, access to mapping in any of the processes will
-	// cause segmentation fault!
+	// Read locks are reader-biased: normally they only increment counter in a per-process slot
+	// on its own cache line, without touching the mutex. Write lock revokes the bias and waits
+	// for these counters, so writes are more expensive while readers are active.
 	
-	/// Throws if already exists
-    static SharedMemory create(const std::string& name, bool allow_existing = false);
+	/// Throws if already exists. NUMA policy is kept in shm and applied to it after each resize
+    static SharedMemory create(const std::string& name, bool allow_existing = false, const NumaPolicy& numa = {});
 	
 	/// Throws if doesn't exist
     static SharedMemory open(const std::string& name);
@@ -68,27 +131,113 @@ public:
 	/// Removes shm object; existing mappings will continue to work, but name is freed
 	static void remove(const std::string& name) noexcept;
 	
+	// File-backed mode: region is a shared mapping of regular file instead of shm object,
+	// so data survives reboot. Header with locks is stored in the file too.
+	
+	/// Creates file, or reuses data and size of file created earlier (header is reinitialized).
+	/// Must not be called while other processes have the file open
+	static SharedMemory create_file(const std::string& path);
+	
+	/// Opens file which is currently used by process which called create_file()
+	static SharedMemory open_file(const std::string& path);
+	
+	/// Flushes ranges modified since last checkpoint (by any process) to file, using ranges
+	/// marked by writers; returns number of bytes flushed. Does nothing if not file-backed
+	size_t checkpoint();
+	
 	/// Doesn't remove object - it will exist until reboot or explicit remove
     ~SharedMemory() noexcept;
 	
-	/// Returns size of mapped region
+	/// Returns size of mapped region, which is updated by taking any lock
     size_t size() const noexcept;
 	
-	/// Resizes both shm and mapped region
+	/// Resizes both shm and mapped region under write lock
     void resize(size_t new_size);
 
-	/// Resizes mapped region to shm size
+	/// Takes read lock to remap region if it was resized. Not needed if lock is taken anyway
 	size_t update_size();
 	
-    SharedMemoryReadLock read_lock(); ///< Blocks until available
+	/// Mapped region without any locking, for data which does its own synchronization.
+	/// Pointer stays mapped until this object is destroyed, even if region is remapped after resize
+	uint8_t *data() noexcept;
+	
+	/// Pages of mapped region on each NUMA node, see numa_pages()
+	std::vector<size_t> numa_pages() const;
+	
+	/// Blocks until available. Excludes range writers too: they wait for whole-region readers
+	/// and turn reader bias off while active, so plain readers pay nothing for range locks
+    SharedMemoryReadLock read_lock();
     SharedMemoryWriteLock write_lock(); ///< Blocks until available
+	
+	/// Returns nothing instead of blocking. Failed write attempt disables reader bias
+	/// until some writer succeeds, so it isn't starved by biased readers
+	std::optional<SharedMemoryReadLock> try_read_lock();
+	std::optional<SharedMemoryWriteLock> try_write_lock();
+	
+	// Range locks: data is split into 64 KB blocks, each guarded by one of 64 stripe locks
+	// (block number modulo 64). Range lock holds whole-region lock as sharable, so it excludes
+	// write_lock() and resize(), while writers of disjoint ranges proceed in parallel.
+	// Returned lock still gives access to whole region - only locked ranges may be accessed.
+	// Stripes are taken in ascending order; to avoid deadlock, never hold more than one lock
+	// at once - lock all needed ranges with a single call instead.
+	
+	SharedMemoryReadLock read_lock(size_t offset, size_t length);
+	SharedMemoryWriteLock write_lock(size_t offset, size_t length);
+	SharedMemoryReadLock read_lock(const std::vector<SharedMemoryRange>& ranges);
+	SharedMemoryWriteLock write_lock(const std::vector<SharedMemoryRange>& ranges);
+	
+	// Optimistic (seqlock) reading: writer increments sequence counter when write lock is taken
+	// and released, reader checks that it didn't change while reading. Readers don't write
+	// to shared memory at all, so many of them can poll small data cheaply.
+	// Reader function may see data in the middle of modification and must only copy it out.
+	
+	/// Returns false without calling reader if writer is active, or if it was active while reading
+	bool try_read(const std::function<void(const uint8_t *data, size_t size)>& reader);
+	/// Calls try_read() until it succeeds
+	void read_consistent(const std::function<void(const uint8_t *data, size_t size)>& reader);
+	
+	/// Number of released write locks
+	uint64_t version() const noexcept;
+	
+	/// Blocks until version differs from specified one or timeout expires; returns current version
+	uint64_t wait_for_change(uint64_t last_version, std::chrono::milliseconds timeout = std::chrono::milliseconds::max());
+	
+	/// Copies pages modified since previous snapshot without any lock, then copies again pages
+	/// written meanwhile; read lock is taken only if writers keep interfering. Unmodified pages
+	/// are shared with previous snapshot. Everything is copied on first call or if size has changed;
+	/// if writers didn't mark ranges they have modified, whole locked ranges are copied.
+	/// Object keeps last snapshot, so it holds a copy of data
+	SharedMemorySnapshot snapshot();
 
     SharedMemory(const SharedMemory&) = delete;
     SharedMemory(SharedMemory&&) noexcept;
 
 private:
+	friend class SharedMemoryMirror;
     std::unique_ptr<SharedMemoryInternal> p;
     SharedMemory(std::unique_ptr<SharedMemoryInternal> p);
 };
 
+
+/// Private copy of SharedMemory, updated incrementally using ranges marked by writers
+class SharedMemoryMirror {
+public:
+	/// Copies ranges modified since last refresh (or everything, if too many writes happened
+	/// since then or size has changed) under read lock. Returns number of bytes copied
+	size_t refresh();
+	
+	const uint8_t *data() const noexcept;
+	size_t size() const noexcept;
+	uint64_t version() const noexcept; ///< SharedMemory::version() at last refresh
+	
+	/// Doesn't copy anything until refresh()
+	SharedMemoryMirror(SharedMemory& shm);
+	
+private:
+	SharedMemory& shm;
+	std::vector<uint8_t> copy;
+	uint64_t copy_version = 0;
+	bool valid = false;
+};
+
 } // namespace ipclib
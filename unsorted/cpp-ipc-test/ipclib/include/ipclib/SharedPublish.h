@@ -0,0 +1,72 @@
+// Single-writer/multiple-readers interprocess publishing of whole snapshots
+// All functions can throw unless explicitly marked noexcept
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace ipclib
+{
+
+class PublishInternal;
+
+
+// Writer builds each new version in a back buffer and then atomically makes it current.
+// Reader pins current version in its own slot for the duration of read; writer never
+// reuses buffer which is current or pinned by any reader, so neither side ever waits for the other.
+// Buffers are separate shm objects, created when needed and removed when no longer used.
+//
+// Reader object has single slot, so it must not be used by multiple threads at once.
+// Reader which crashes while reading keeps its buffer pinned until the publisher is removed.
+
+struct PublishOptions {
+	int buffers = 3; ///< Buffers kept allocated when no reader holds old versions
+};
+
+
+class PublishWriter {
+public:
+	/// Calls function with back buffer of specified size, then makes it current. Returns new version
+	uint64_t publish(size_t size, const std::function<void(uint8_t *data)>& writer);
+	
+	/// Throws if already exists
+	static PublishWriter create(const std::string& name, bool allow_existing = false, const PublishOptions& options = {});
+	
+	/// Removes all shm objects; existing readers will continue to work, but name is freed
+	static void remove(const std::string& name) noexcept;
+	
+	~PublishWriter() noexcept;
+	
+	PublishWriter(const PublishWriter&) = delete;
+	PublishWriter(PublishWriter&&) noexcept;
+	
+private:
+	std::unique_ptr<PublishInternal> p;
+	PublishWriter(std::unique_ptr<PublishInternal> p);
+};
+
+
+class PublishReader {
+public:
+	/// Calls function with current version; returns that version, or 0 without calling if nothing is published yet
+	uint64_t read(const std::function<void(const uint8_t *data, size_t size)>& reader);
+	
+	/// Returns current version without pinning it, 0 if nothing is published yet
+	uint64_t version() const noexcept;
+	
+	/// Takes reader slot; throws if doesn't exist or all slots are taken
+	static PublishReader open(const std::string& name);
+	
+	~PublishReader() noexcept;
+	
+	PublishReader(const PublishReader&) = delete;
+	PublishReader(PublishReader&&) noexcept;
+	
+private:
+	std::unique_ptr<PublishInternal> p;
+	PublishReader(std::unique_ptr<PublishInternal> p);
+};
+
+} // namespace ipclib
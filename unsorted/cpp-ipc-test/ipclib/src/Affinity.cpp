@@ -0,0 +1,67 @@
+#include "ipclib/Affinity.h"
+
+#include <system_error>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace ipclib
+{
+
+#ifdef __linux__
+
+static void pin(pthread_t thread, const std::vector<int>& cpus) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu : cpus) {
+		if (cpu < 0 || cpu >= CPU_SETSIZE) {
+			throw std::system_error(EINVAL, std::generic_category(), "pin_thread() invalid CPU index");
+		}
+		CPU_SET(cpu, &set);
+	}
+	if (int error = pthread_setaffinity_np(thread, sizeof(set), &set)) {
+		throw std::system_error(error, std::generic_category(), "pin_thread() pthread_setaffinity_np failed");
+	}
+}
+
+void pin_this_thread(const std::vector<int>& cpus) {
+	pin(pthread_self(), cpus);
+}
+void pin_thread(std::thread& thread, const std::vector<int>& cpus) {
+	pin(thread.native_handle(), cpus);
+}
+std::vector<int> allowed_cpus() {
+	cpu_set_t set;
+	if (int error = pthread_getaffinity_np(pthread_self(), sizeof(set), &set)) {
+		throw std::system_error(error, std::generic_category(), "allowed_cpus() pthread_getaffinity_np failed");
+	}
+	std::vector<int> cpus;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &set)) {
+			cpus.push_back(cpu);
+		}
+	}
+	return cpus;
+}
+
+#else
+
+void pin_this_thread(const std::vector<int>&) {
+	throw std::system_error(std::make_error_code(std::errc::function_not_supported), "pin_this_thread()");
+}
+void pin_thread(std::thread&, const std::vector<int>&) {
+	throw std::system_error(std::make_error_code(std::errc::function_not_supported), "pin_thread()");
+}
+std::vector<int> allowed_cpus() {
+	std::vector<int> cpus;
+	for (unsigned cpu = 0; cpu < std::thread::hardware_concurrency(); cpu++) {
+		cpus.push_back(cpu);
+	}
+	return cpus;
+}
+
+#endif
+
+} // namespace ipclib
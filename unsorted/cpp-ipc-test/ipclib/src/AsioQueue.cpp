@@ -1,66 +1,11 @@
 #include "ipclib/AsioQueue.h"
+#include "AsioQueueInternal.h"
 
 #include <cstdio>
-#include <condition_variable>
-#include <queue>
-#include <thread>
 
 namespace ipclib
 {
 
-class AsioQueueInternal {
-public:
-	AsioQueueInternal(asio::io_context& io): io(io) {
-		io.get_executor().on_work_started();
-		thr = std::thread([this]{
-			auto pred = [&] {return thr_end || !fs.empty();};
-			while (true) {
-				std::unique_lock<std::mutex> lock(mut);
-				cond.wait(lock, pred);
-				if (thr_end) {
-					while (!fs.empty()) {
-						fs.front()(false);
-						fs.pop();
-					}
-					
-					break;
-				}
-				else {
-					auto f = std::move(fs.front());
-					fs.pop();
-					lock.unlock();
-					
-					f(true);
-				}
-			}
-		});
-	}
-	~AsioQueueInternal() {
-		{	std::unique_lock<std::mutex> lock(mut);
-			thr_end = true;
-		}
-		thr.join();
-		io.get_executor().on_work_finished();
-	}
-	void add(std::function<void(bool)> f) {
-		std::unique_lock<std::mutex> lock(mut);
-		fs.emplace(std::move(f));
-		cond.notify_one();
-	}
-	void asio_call(std::function<void()> f) {
-		asio::dispatch(io, std::move(f));
-	}
-	
-private:
-	asio::io_context& io;
-	std::thread thr;
-	bool thr_end = false;
-	std::queue<std::function<void(bool)>> fs;
-	std::mutex mut;
-	std::condition_variable cond;
-};
-
-
 void AsioQueueProducer::async_send(asio::const_buffer buffer, std::function<void(std::error_code error)> writer) {
 	p->add([this, buffer = std::move(buffer), writer = std::move(writer)](bool ok) {
 		std::error_code error;
@@ -0,0 +1,68 @@
+// Worker thread which runs blocking calls and dispatches results to io_context
+
+#pragma once
+
+#include <asio.hpp>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+
+namespace ipclib
+{
+
+class AsioQueueInternal {
+public:
+	AsioQueueInternal(asio::io_context& io): io(io) {
+		io.get_executor().on_work_started();
+		thr = std::thread([this]{
+			auto pred = [&] {return thr_end || !fs.empty();};
+			while (true) {
+				std::unique_lock<std::mutex> lock(mut);
+				cond.wait(lock, pred);
+				if (thr_end) {
+					while (!fs.empty()) {
+						fs.front()(false);
+						fs.pop();
+					}
+					
+					break;
+				}
+				else {
+					auto f = std::move(fs.front());
+					fs.pop();
+					lock.unlock();
+					
+					f(true);
+				}
+			}
+		});
+	}
+	~AsioQueueInternal() {
+		{	std::unique_lock<std::mutex> lock(mut);
+			thr_end = true;
+			cond.notify_one();
+		}
+		thr.join();
+		io.get_executor().on_work_finished();
+	}
+	void add(std::function<void(bool)> f) {
+		std::unique_lock<std::mutex> lock(mut);
+		fs.emplace(std::move(f));
+		cond.notify_one();
+	}
+	void asio_call(std::function<void()> f) {
+		asio::dispatch(io, std::move(f));
+	}
+	
+private:
+	asio::io_context& io;
+	std::thread thr;
+	bool thr_end = false;
+	std::queue<std::function<void(bool)>> fs;
+	std::mutex mut;
+	std::condition_variable cond;
+};
+
+} // namespace ipclib
@@ -0,0 +1,196 @@
+#include "ipclib/AsioRpc.h"
+#include "AsioQueueInternal.h"
+#include "RpcInternal.h"
+
+#include <atomic>
+#include <cstdio>
+#include <deque>
+#include <list>
+
+namespace ipclib
+{
+
+// Single thread sends requests and collects replies for all calls, waiting on all reply slots at once
+class AsioRpcClientInternal {
+public:
+	struct Call {
+		asio::const_buffer request;
+		asio::mutable_buffer response;
+		std::function<void(std::error_code error, size_t size)> handler;
+		uint64_t id = 0;
+	};
+	
+	AsioRpcClientInternal(asio::io_context& io, RpcClient client): io(io), client(std::move(client)) {
+		io.get_executor().on_work_started();
+		thr = std::thread([this]{
+			run();
+		});
+	}
+	~AsioRpcClientInternal() {
+		{	std::unique_lock<std::mutex> lock(mut);
+			thr_end = true;
+		}
+		has_work = true;
+		rpc().notify_any();
+		thr.join();
+		io.get_executor().on_work_finished();
+	}
+	void add(Call call) {
+		{	std::unique_lock<std::mutex> lock(mut);
+			calls.emplace_back(std::move(call));
+		}
+		has_work = true;
+		rpc().notify_any();
+	}
+	
+private:
+	asio::io_context& io;
+	RpcClient client;
+	std::thread thr;
+	bool thr_end = false;
+	std::deque<Call> calls; // not sent yet
+	std::mutex mut;
+	std::atomic<bool> has_work{false}; // checked under reply slot mutex
+	
+	RpcClientInternal& rpc() {
+		return *client.p;
+	}
+	void complete(Call& call, std::error_code error, size_t size) {
+		asio::dispatch(io, [handler = std::move(call.handler), error, size] {
+			handler(error, size);
+		});
+	}
+	void run() {
+		std::deque<Call> unsent;
+		std::list<Call> pending;
+		
+		while (true) {
+			has_work = false;
+			{	std::unique_lock<std::mutex> lock(mut);
+				if (thr_end) {
+					for (auto* cs : {&calls, &unsent}) {
+						for (auto& call : *cs) {
+							complete(call, std::make_error_code(std::errc::operation_canceled), 0);
+						}
+					}
+					for (auto& call : pending) {
+						complete(call, std::make_error_code(std::errc::operation_canceled), 0);
+					}
+					break;
+				}
+				for (auto& call : calls) {
+					unsent.emplace_back(std::move(call));
+				}
+				calls.clear();
+			}
+			
+			// send while there are free slots
+			while (!unsent.empty()) {
+				auto& call = unsent.front();
+				try {
+					call.id = rpc().send([&call](void *mem){
+						std::memcpy(mem, call.request.data(), call.request.size());
+					}, call.request.size(), false);
+				}
+				catch (std::system_error& e) {
+					complete(call, e.code(), 0);
+					unsent.pop_front();
+					continue;
+				}
+				catch (std::exception& e) {
+					fprintf(stderr, "AsioRpcClient::async_call() exception occured: %s\n", e.what());
+					complete(call, std::make_error_code(std::errc::io_error), 0);
+					unsent.pop_front();
+					continue;
+				}
+				if (!call.id) {
+					break; // wait until replies free some slots
+				}
+				pending.emplace_back(std::move(call));
+				unsent.pop_front();
+			}
+			
+			// collect replies
+			for (auto it = pending.begin(); it != pending.end(); ) {
+				size_t size = 0;
+				bool truncated = false;
+				std::error_code error;
+				try {
+					error = rpc().receive(it->id, [&](const void *mem, size_t mem_size){
+						size = std::min(mem_size, it->response.size());
+						truncated = size != mem_size;
+						std::memcpy(it->response.data(), mem, size);
+					}, RpcClient::no_timeout, false);
+				}
+				catch (std::exception& e) {
+					fprintf(stderr, "AsioRpcClient::async_call() exception occured: %s\n", e.what());
+					error = std::make_error_code(std::errc::io_error);
+				}
+				if (error == std::errc::resource_unavailable_try_again) {
+					++it;
+					continue;
+				}
+				if (!error && truncated) {
+					error = std::make_error_code(std::errc::message_size);
+				}
+				complete(*it, error, size);
+				it = pending.erase(it);
+			}
+			
+			rpc().wait_any([this]{
+				return has_work.load();
+			});
+		}
+	}
+};
+
+
+void AsioRpcClient::async_call(asio::const_buffer request, asio::mutable_buffer response, std::function<void(std::error_code error, size_t size)> handler) {
+	p->add({request, response, std::move(handler)});
+}
+AsioRpcClient::AsioRpcClient(asio::io_context& io, RpcClient client): p(std::make_unique<AsioRpcClientInternal>(io, std::move(client))) {}
+AsioRpcClient::~AsioRpcClient() = default;
+AsioRpcClient::AsioRpcClient(AsioRpcClient&&) = default;
+
+
+void AsioRpcServer::async_receive(std::function<void(std::error_code error, RpcRequest request)> handler) {
+	p->add([this, handler = std::move(handler)](bool ok) {
+		std::error_code error;
+		auto request = std::make_shared<RpcRequest>(); // std::function must be copyable
+		if (ok) {
+			try {
+				switch (server.receive(*request)) {
+					case QueueConsumer::ReadOk:
+						break;
+					case QueueConsumer::ReadCancelled:
+					case QueueConsumer::ReadDestroyed:
+						error = std::make_error_code(std::errc::operation_canceled);
+						break;
+					case QueueConsumer::ReadNoProducersLeft:
+						error = std::make_error_code(std::errc::broken_pipe);
+						break;
+				}
+			}
+			catch (std::system_error& e) {
+				error = e.code();
+			}
+			catch (std::exception& e) {
+				fprintf(stderr, "AsioRpcServer::async_receive() exception occured: %s\n", e.what());
+				error = std::make_error_code(std::errc::io_error);
+			}
+		}
+		else {
+			error = std::make_error_code(std::errc::operation_canceled);
+		}
+		p->asio_call([handler = std::move(handler), error, request] {
+			handler(error, std::move(*request));
+		});
+	});
+}
+AsioRpcServer::AsioRpcServer(asio::io_context& io, RpcServer server): server(std::move(server)), p(std::make_unique<AsioQueueInternal>(io)) {}
+AsioRpcServer::~AsioRpcServer() {
+	server.cancel_receive();
+}
+AsioRpcServer::AsioRpcServer(AsioRpcServer&&) = default;
+
+} // namespace ipclib
@@ -0,0 +1,24 @@
+#include "ipclib/AsioSharedMemory.h"
+
+namespace ipclib
+{
+
+void AsioSharedMemory::cancel() noexcept {
+	p->cancel_count++;
+	for (auto& timer : p->timers) {
+		timer.cancel();
+	}
+}
+SharedMemory& AsioSharedMemory::get() noexcept {
+	return p->shm;
+}
+AsioSharedMemory::AsioSharedMemory(asio::io_context& io, SharedMemory shm): p(std::make_shared<AsioSharedMemoryInternal>(io, std::move(shm))) {}
+AsioSharedMemory::~AsioSharedMemory() {
+	if (p) {
+		p->closed = true;
+		cancel();
+	}
+}
+AsioSharedMemory::AsioSharedMemory(AsioSharedMemory&&) noexcept = default;
+
+} // namespace ipclib
@@ -0,0 +1,111 @@
+// Waiting on 32-bit word in shared memory, across processes
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#ifdef __linux__
+#include <cerrno>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <ctime>
+#include <unistd.h>
+#endif
+
+namespace ipclib
+{
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex word must be plain 32-bit integer");
+
+constexpr int futex_wait_any_max = 128;
+
+/// Spin-wait hint for CPU, lets sibling hyperthread run
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+	_mm_pause();
+#elif defined(__aarch64__)
+	asm volatile("yield");
+#endif
+}
+
+/// Blocks while word equals expected value, but no longer than timeout.
+/// May return spuriously, so caller must recheck its condition
+inline void futex_wait(std::atomic<uint32_t>& word, uint32_t expected, std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()) {
+#ifdef __linux__
+	timespec ts;
+	timespec* ts_ptr = nullptr;
+	if (timeout != std::chrono::nanoseconds::max()) {
+		if (timeout.count() <= 0) {
+			return;
+		}
+		ts.tv_sec = static_cast<time_t>(timeout.count() / 1000000000);
+		ts.tv_nsec = static_cast<long>(timeout.count() % 1000000000);
+		ts_ptr = &ts;
+	}
+	// not FUTEX_PRIVATE_FLAG - word is shared between processes
+	syscall(SYS_futex, static_cast<void*>(&word), FUTEX_WAIT, expected, ts_ptr, nullptr, 0);
+#else
+	// no portable equivalent, poll
+	if (word.load() == expected) {
+		std::this_thread::sleep_for(std::min<std::chrono::nanoseconds>(timeout, std::chrono::milliseconds(1)));
+	}
+#endif
+}
+
+/// Blocks while every word equals its expected value, but no longer than timeout.
+/// At most futex_wait_any_max words. May return spuriously, so caller must recheck its condition
+inline void futex_wait_any(std::atomic<uint32_t>* const* words, const uint32_t* expected, int count, std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()) {
+	if (timeout.count() <= 0 || !count) {
+		return;
+	}
+#if defined(__linux__) && defined(SYS_futex_waitv)
+	futex_waitv waiters[futex_wait_any_max] = {};
+	for (int i = 0; i < count; i++) {
+		waiters[i].val = expected[i];
+		waiters[i].uaddr = reinterpret_cast<uintptr_t>(words[i]);
+		waiters[i].flags = FUTEX_32; // not FUTEX_PRIVATE_FLAG - words are shared between processes
+	}
+	timespec ts;
+	timespec* ts_ptr = nullptr;
+	if (timeout != std::chrono::nanoseconds::max()) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		const auto ns = ts.tv_nsec + timeout.count();
+		ts.tv_sec += static_cast<time_t>(ns / 1000000000);
+		ts.tv_nsec = static_cast<long>(ns % 1000000000);
+		ts_ptr = &ts;
+	}
+	if (syscall(SYS_futex_waitv, waiters, count, 0, ts_ptr, CLOCK_MONOTONIC) == 0 || errno != ENOSYS) {
+		return;
+	}
+#endif
+	// kernel is too old (before 5.16), poll
+	for (int i = 0; i < count; i++) {
+		if (words[i]->load() != expected[i]) {
+			return;
+		}
+	}
+	std::this_thread::sleep_for(std::min<std::chrono::nanoseconds>(timeout, std::chrono::milliseconds(1)));
+}
+
+/// Wakes up to count waiters. Returns number of woken ones, or -1 if it's unknown
+inline int futex_wake(std::atomic<uint32_t>& word, int count = INT_MAX) {
+#ifdef __linux__
+	return static_cast<int>(syscall(SYS_futex, static_cast<void*>(&word), FUTEX_WAKE, count, nullptr, nullptr, 0));
+#else
+	(void) word;
+	(void) count;
+	return -1;
+#endif
+}
+
+} // namespace ipclib
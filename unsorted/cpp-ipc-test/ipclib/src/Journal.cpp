@@ -0,0 +1,675 @@
+#include "ipclib/Journal.h"
+#include "Futex.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/interprocess/sync/interprocess_mutex.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
+
+using namespace boost::interprocess;
+
+namespace ipclib
+{
+
+/*
+
+	files in directory:
+	   <first sequence number, 20 digits>.journal - segments, each is SegmentHeader followed by
+	       array of Record + bytes, padded to record_align; unused space is zeroed
+	   offsets - array of Offset, committed positions of named consumers
+	   lock - flock'ed while journal is opened or closed by some process
+	   users - shared flock is held by every opened object
+	   commit - flock'ed by committer, so others can see if it has died
+
+	Sync object lives in shm (named by hash of directory path), it's created and filled
+	from files by the first process which opens journal and removed by the last one.
+	If nobody holds users lock, all previous users are gone (maybe crashed), so shm left
+	by them is refilled too.
+
+	Producers append under mutex. Record is published by storing its sequence number last,
+	so consumers read without locking: if record at their position has expected number,
+	it's complete. Otherwise it's either end of journal (then consumer sleeps on message
+	futex) or end of segment, if current segment has changed - then next one is named
+	by expected number. Segment changes only after all its records are published.
+
+	Group commit: first process which needs sync becomes committer, waits for commit delay,
+	msyncs everything written so far and advances durable_seq; others wait on durable
+	futex meanwhile and return if their message was covered. Full segment is synced
+	before next one is created, so only current one has to be synced by committer.
+
+	Recovery checks records of last segment by checksum and zeroes everything after the
+	last valid one, so stale records can't be mistaken for new ones.
+
+*/
+
+class JournalInternal {
+public:
+	using ReadRet = QueueConsumer::ReadRet;
+
+	static constexpr uint64_t magic = 0x6970636c69626a6c; // "ipclibjl"
+	static constexpr int max_names = 64;
+
+	struct SegmentHeader {
+		uint64_t magic;
+		uint64_t first_seq;
+	};
+	static constexpr size_t segment_header_size = 64; // records start here
+
+	struct Record {
+		std::atomic<uint64_t> seq; // 0 if not written
+		uint32_t size;
+		uint32_t checksum; // of bytes
+	};
+	static constexpr size_t record_align = sizeof(Record);
+	static_assert(std::atomic<uint64_t>::is_always_lock_free, "atomics must be lock-free to be shared between processes");
+
+	struct Offset {
+		char name[56]; // empty if not used
+		uint64_t position;
+	};
+
+	struct Sync {
+		uint64_t magic; // set when filled from files
+		interprocess_mutex mut;
+		uint64_t segment_size;
+
+		// refcount, protected by directory lock
+		int ref_producers = 0;
+		int ref_consumers = 0;
+
+		// writing, protected by mutex
+		uint64_t next_seq; // of next message
+		std::atomic<uint64_t> segment_first; // first sequence number of current segment
+		uint64_t write_offset; // where next record will be written in current segment
+
+		// readers
+		std::atomic<uint32_t> message{0}; // futex, incremented when message is written or reads are cancelled
+		std::atomic<uint32_t> message_waiters{0};
+		std::atomic<uint64_t> cancel_all_counter{0}; // incremented when last producer is destroyed
+
+		// group commit, protected by mutex
+		uint64_t durable_seq; // all messages up to this one are on disk
+		uint64_t durable_offset; // in current segment
+		int32_t committer = 0; // pid or 0; it holds commit lock
+		std::atomic<uint32_t> durable{0}; // futex, incremented when durable_seq changes
+		uint32_t durable_waiters = 0;
+	};
+
+	// mapped segment file
+	struct Segment {
+		uint64_t first = 0; // sequence number, 0 if not mapped
+		file_mapping file;
+		mapped_region region;
+
+		uint8_t *data() const {
+			return static_cast<uint8_t*>(region.get_address());
+		}
+		size_t size() const {
+			return region.get_size();
+		}
+		Record* record_at(size_t offset) const {
+			return static_cast<Record*>(static_cast<void*>(data() + offset));
+		}
+	};
+
+	JournalInternal(const std::string& dir, bool is_producer): dir(dir), is_producer(is_producer) {}
+	~JournalInternal() {
+		if (lock_fd != -1) {
+			::close(lock_fd);
+		}
+		if (users_fd != -1) {
+			::close(users_fd); // releases users lock
+		}
+		if (commit_fd != -1) {
+			::close(commit_fd);
+		}
+	}
+
+	void open(const JournalOptions& options) {
+		this->options = options;
+		if (mkdir(dir.c_str(), 0755) && errno != EEXIST) {
+			throw std::system_error(errno, std::generic_category(), "Journal failed to create " + dir);
+		}
+		lock_fd = open_file(dir + "/lock");
+		users_fd = open_file(dir + "/users");
+		commit_fd = open_file(dir + "/commit");
+		DirectoryLock lock(lock_fd);
+		const bool alone = !flock(users_fd, LOCK_EX | LOCK_NB);
+		flock(users_fd, LOCK_SH);
+
+		shm_name = make_shm_name();
+		shm = shared_memory_object(open_or_create, shm_name.c_str(), read_write);
+		offset_t size = 0;
+		if (shm.get_size(size) && size < offset_t(sizeof(Sync))) {
+			shm.truncate(sizeof(Sync));
+		}
+		sync_region = mapped_region(shm, read_write, 0, sizeof(Sync));
+		sync = static_cast<Sync*>(sync_region.get_address());
+
+		if (sync->magic != magic || alone) {
+			new(sync) Sync();
+			recover();
+			sync->magic = magic;
+		}
+		(is_producer ? sync->ref_producers : sync->ref_consumers) += 1;
+		last_cancel_all = sync->cancel_all_counter;
+	}
+	void close() noexcept {
+		DirectoryLock lock(lock_fd);
+		(is_producer ? sync->ref_producers : sync->ref_consumers) -= 1;
+		if (is_producer && !sync->ref_producers) {
+			sync->cancel_all_counter += 1;
+			wake_consumers();
+		}
+		if (!sync->ref_producers && !sync->ref_consumers) {
+			shared_memory_object::remove(shm_name.c_str()); // next user recovers from files
+		}
+	}
+
+	// producer
+
+	uint64_t write(const std::function<void(void *mem)>& writer, size_t size) {
+		const uint64_t record = sizeof(Record) + (size + record_align - 1) / record_align * record_align;
+		if (segment_header_size + record > sync->segment_size || size > UINT32_MAX) {
+			throw std::length_error("JournalProducer::write() message is bigger than segment");
+		}
+
+		uint64_t seq;
+		{
+			scoped_lock<interprocess_mutex> lock(sync->mut);
+			if (sync->write_offset + record > sync->segment_size) {
+				roll_over();
+			}
+			map_current();
+
+			seq = sync->next_seq;
+			auto r = segment.record_at(sync->write_offset);
+			auto mem = r + 1;
+			writer(mem);
+			r->size = size;
+			r->checksum = checksum(mem, size);
+			r->seq.store(seq); // publish
+
+			sync->next_seq += 1;
+			sync->write_offset += record;
+		}
+		wake_consumers();
+
+		if (options.sync_writes) {
+			this->sync_to(seq);
+		}
+		return seq;
+	}
+	void sync_to(uint64_t seq) {
+		scoped_lock<interprocess_mutex> lock(sync->mut);
+		while (sync->durable_seq < seq) {
+			// lock of committer is released by kernel if it dies, then it's taken here.
+			// Other threads of this object share the lock, so they check committing instead
+			if (sync->committer && (committing || flock(commit_fd, LOCK_EX | LOCK_NB))) {
+				// commit is in progress, it may cover our message
+				sync->durable_waiters += 1;
+				const uint32_t word = sync->durable.load();
+				lock.unlock();
+				futex_wait(sync->durable, word, std::chrono::milliseconds(100)); // timeout to check if committer is alive
+				lock.lock();
+				sync->durable_waiters -= 1;
+				continue;
+			}
+
+			if (!sync->committer) {
+				while (flock(commit_fd, LOCK_EX) && errno == EINTR) {} // free, committer releases it under mutex
+			}
+			sync->committer = getpid();
+			committing = true;
+			if (options.commit_delay.count()) {
+				lock.unlock();
+				std::this_thread::sleep_for(options.commit_delay);
+				lock.lock();
+			}
+
+			// previous segments were synced on roll over
+			const uint64_t target_seq = sync->next_seq - 1;
+			const uint64_t first = sync->segment_first;
+			const size_t begin = sync->durable_offset;
+			const size_t end = sync->write_offset;
+			lock.unlock();
+
+			std::exception_ptr error;
+			try {
+				Segment s;
+				map_segment(s, first, true);
+				flush(s, begin, end);
+			}
+			catch (...) {
+				error = std::current_exception();
+			}
+
+			lock.lock();
+			sync->committer = 0;
+			committing = false;
+			flock(commit_fd, LOCK_UN);
+			if (!error) {
+				if (target_seq > sync->durable_seq) {
+					sync->durable_seq = target_seq;
+					if (sync->segment_first == first) {
+						sync->durable_offset = std::max<uint64_t>(sync->durable_offset, end);
+					}
+				}
+			}
+			sync->durable += 1;
+			if (sync->durable_waiters) {
+				futex_wake(sync->durable);
+			}
+			if (error) {
+				std::rethrow_exception(error);
+			}
+		}
+	}
+
+	// consumer
+
+	void open_name(const std::string& name) {
+		if (name.empty() || name.size() >= sizeof(Offset::name)) {
+			throw std::invalid_argument("JournalConsumer::open() name is empty or too long");
+		}
+		DirectoryLock lock(lock_fd);
+
+		const std::string path = dir + "/offsets";
+		create_file(path, sizeof(Offset) * max_names, false);
+		offsets_file = file_mapping(path.c_str(), read_write);
+		offsets_region = mapped_region(offsets_file, read_write, 0, sizeof(Offset) * max_names);
+		auto offsets = static_cast<Offset*>(offsets_region.get_address());
+
+		for (int i = 0; i < max_names; i++) {
+			if (name == offsets[i].name) {
+				offset = &offsets[i];
+				break;
+			}
+		}
+		if (!offset) {
+			for (int i = 0; i < max_names; i++) {
+				if (!offsets[i].name[0]) {
+					offset = &offsets[i];
+					offset->position = 0;
+					std::memcpy(offset->name, name.c_str(), name.size() + 1);
+					break;
+				}
+			}
+			if (!offset) {
+				throw std::length_error("JournalConsumer::open() too many names");
+			}
+		}
+		seek(offset->position);
+	}
+
+	ReadRet read(const std::function<void(uint64_t seq, const void *mem, size_t size)>& reader) {
+		while (true) {
+			if (auto r = next_record()) {
+				reader(position, r + 1, r->size);
+				position += 1;
+				read_offset += sizeof(Record) + (r->size + record_align - 1) / record_align * record_align;
+				return ReadRet::ReadOk;
+			}
+			sync->message_waiters += 1;
+			const uint32_t word = sync->message.load();
+			if (!next_record()) {
+				if (auto ret = static_cast<ReadRet>(cancel.exchange(ReadRet::ReadOk))) {
+					sync->message_waiters -= 1;
+					return ret;
+				}
+				if (sync->cancel_all_counter != last_cancel_all) {
+					// last producer is gone and everything is read
+					last_cancel_all = sync->cancel_all_counter;
+					sync->message_waiters -= 1;
+					return ReadRet::ReadNoProducersLeft;
+				}
+				futex_wait(sync->message, word);
+			}
+			sync->message_waiters -= 1;
+		}
+	}
+	void cancel_read(ReadRet reason) {
+		int expected = ReadRet::ReadOk; // if not, previous one wasn't consumed yet
+		cancel.compare_exchange_strong(expected, reason);
+		sync->message += 1;
+		futex_wake(sync->message);
+	}
+	void seek(uint64_t seq) {
+		const auto firsts = list_segments();
+		if (firsts.empty()) {
+			throw std::runtime_error("Journal has no segments");
+		}
+		auto it = std::upper_bound(firsts.begin(), firsts.end(), std::max<uint64_t>(seq, 1));
+		if (it != firsts.begin()) {
+			--it;
+		}
+		map_segment(segment, *it, false);
+		position = *it;
+		read_offset = segment_header_size;
+		while (position < seq && next_record()) {
+			auto r = segment.record_at(read_offset);
+			position += 1;
+			read_offset += sizeof(Record) + (r->size + record_align - 1) / record_align * record_align;
+		}
+	}
+	void commit() {
+		offset->position = position;
+		flush_offsets();
+	}
+
+	uint64_t position = 0; // next sequence number to read
+	Offset* offset = nullptr; // committed position of consumer
+
+private:
+	const std::string dir;
+	const bool is_producer;
+	JournalOptions options;
+	int lock_fd = -1;
+	int users_fd = -1;
+	int commit_fd = -1;
+	bool committing = false; // holds commit lock, protected by mutex
+
+	std::string shm_name;
+	shared_memory_object shm;
+	mapped_region sync_region;
+	Sync* sync;
+
+	Segment segment; // current for producer, one being read for consumer
+	size_t read_offset = 0;
+	uint64_t last_cancel_all = 0;
+	std::atomic<int> cancel{ReadRet::ReadOk}; // set by cancel_read(), possibly from another thread
+
+	file_mapping offsets_file;
+	mapped_region offsets_region;
+
+	struct DirectoryLock {
+		int fd;
+		DirectoryLock(int fd): fd(fd) {
+			while (flock(fd, LOCK_EX) && errno == EINTR) {}
+		}
+		~DirectoryLock() {
+			flock(fd, LOCK_UN);
+		}
+	};
+
+	static int open_file(const std::string& path) {
+		const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (fd == -1) {
+			throw std::system_error(errno, std::generic_category(), "Journal failed to open " + path);
+		}
+		return fd;
+	}
+	std::string make_shm_name() const {
+		char path[PATH_MAX];
+		if (!realpath(dir.c_str(), path)) {
+			throw std::system_error(errno, std::generic_category(), "Journal realpath failed for " + dir);
+		}
+		uint64_t hash = 0xcbf29ce484222325; // FNV-1a
+		for (const char *c = path; *c; c++) {
+			hash = (hash ^ uint8_t(*c)) * 0x100000001b3;
+		}
+		char name[64];
+		snprintf(name, sizeof(name), "ipclib_journal_%016" PRIx64, hash);
+		return name;
+	}
+	std::string segment_path(uint64_t first) const {
+		char name[32];
+		snprintf(name, sizeof(name), "/%020" PRIu64 ".journal", first);
+		return dir + name;
+	}
+	// sorted first sequence numbers of all segments
+	std::vector<uint64_t> list_segments() const {
+		std::vector<uint64_t> firsts;
+		DIR* d = opendir(dir.c_str());
+		if (!d) {
+			throw std::system_error(errno, std::generic_category(), "Journal failed to list " + dir);
+		}
+		while (auto e = readdir(d)) {
+			uint64_t first;
+			char tail[16];
+			if (sscanf(e->d_name, "%20" SCNu64 "%15s", &first, tail) == 2 && !std::strcmp(tail, ".journal") && first) {
+				firsts.push_back(first);
+			}
+		}
+		closedir(d);
+		std::sort(firsts.begin(), firsts.end());
+		return firsts;
+	}
+	// returns true if file was created
+	static bool create_file(const std::string& path, size_t size, bool exclusive) {
+		int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | (exclusive ? O_EXCL : 0), 0644);
+		if (fd == -1) {
+			throw std::system_error(errno, std::generic_category(), "Journal failed to create " + path);
+		}
+		struct stat st;
+		const bool created = !fstat(fd, &st) && st.st_size == 0;
+		if (created && ftruncate(fd, size)) {
+			const int error = errno;
+			::close(fd);
+			throw std::system_error(error, std::generic_category(), "Journal ftruncate failed for " + path);
+		}
+		::close(fd);
+		return created;
+	}
+	void map_segment(Segment& s, uint64_t first, bool writable) const {
+		if (s.first == first) {
+			return;
+		}
+		const std::string path = segment_path(first);
+		const auto mode = writable ? read_write : read_only;
+		s.file = file_mapping(path.c_str(), mode);
+		s.region = mapped_region(s.file, mode);
+		s.first = first;
+	}
+	// mutex must be locked
+	void map_current() {
+		map_segment(segment, sync->segment_first, true);
+	}
+	static void flush(const Segment& s, size_t begin, size_t end) {
+		static const size_t page = mapped_region::get_page_size();
+		begin = begin / page * page;
+		if (end > begin && msync(s.data() + begin, end - begin, MS_SYNC)) {
+			throw std::system_error(errno, std::generic_category(), "Journal msync failed");
+		}
+	}
+	void flush_offsets() {
+		static const size_t page = mapped_region::get_page_size();
+		auto base = static_cast<uint8_t*>(offsets_region.get_address());
+		const size_t begin = (reinterpret_cast<uint8_t*>(offset) - base) / page * page;
+		if (msync(base + begin, page, MS_SYNC)) {
+			throw std::system_error(errno, std::generic_category(), "JournalConsumer::commit() msync failed");
+		}
+	}
+
+	// new segment starting from next sequence number; mutex must be locked
+	void roll_over() {
+		map_current();
+		flush(segment, sync->durable_offset, sync->write_offset);
+		sync->durable_seq = sync->next_seq - 1;
+
+		create_segment(sync->next_seq, sync->segment_size);
+		sync->write_offset = segment_header_size;
+		sync->durable_offset = segment_header_size;
+		sync->segment_first.store(sync->next_seq); // after all records of previous one, see layout
+		map_current();
+	}
+	void create_segment(uint64_t first, size_t size) {
+		create_file(segment_path(first), size, true);
+		Segment s;
+		map_segment(s, first, true);
+		auto h = static_cast<SegmentHeader*>(static_cast<void*>(s.data()));
+		h->first_seq = first;
+		h->magic = magic;
+		flush(s, 0, segment_header_size);
+
+		int fd = ::open(dir.c_str(), O_RDONLY | O_CLOEXEC); // so file itself survives crash
+		if (fd != -1) {
+			fsync(fd);
+			::close(fd);
+		}
+	}
+	// fills Sync from files; directory lock must be taken
+	void recover() {
+		auto firsts = list_segments();
+		if (firsts.empty()) {
+			sync->segment_size = std::max<size_t>(options.segment_size / record_align * record_align, 4096);
+			create_segment(1, sync->segment_size);
+			firsts.push_back(1);
+		}
+		const uint64_t first = firsts.back();
+
+		Segment s;
+		map_segment(s, first, true);
+		sync->segment_size = s.size();
+		auto h = static_cast<SegmentHeader*>(static_cast<void*>(s.data()));
+		if (h->magic != magic) { // crashed while creating it
+			h->first_seq = first;
+			h->magic = magic;
+		}
+
+		// find last valid record
+		uint64_t seq = first;
+		size_t offset = segment_header_size;
+		while (offset + sizeof(Record) <= s.size()) {
+			auto r = s.record_at(offset);
+			const uint64_t record = sizeof(Record) + (uint64_t(r->size) + record_align - 1) / record_align * record_align;
+			if (r->seq.load() != seq || offset + record > s.size() || r->checksum != checksum(r + 1, r->size)) {
+				break;
+			}
+			seq += 1;
+			offset += record;
+		}
+
+		// zero everything after it; untouched pages aren't allocated
+		static const size_t page = mapped_region::get_page_size();
+		for (size_t p = offset; p < s.size(); p = (p / page + 1) * page) {
+			const size_t end = std::min(s.size(), (p / page + 1) * page);
+			if (std::any_of(s.data() + p, s.data() + end, [](uint8_t b) { return b != 0; })) {
+				std::memset(s.data() + p, 0, end - p);
+			}
+		}
+		flush(s, 0, s.size());
+
+		sync->next_seq = seq;
+		sync->segment_first = first;
+		sync->write_offset = offset;
+		sync->durable_seq = seq - 1;
+		sync->durable_offset = offset;
+	}
+
+	// returns record at read position or null if there is none yet; moves to next segment if needed
+	Record* next_record() {
+		while (true) {
+			const uint64_t current = sync->segment_first.load(); // before checking record, see layout
+			if (read_offset + sizeof(Record) <= segment.size()) {
+				auto r = segment.record_at(read_offset);
+				if (r->seq.load() == position) {
+					return r;
+				}
+			}
+			if (current == segment.first) {
+				return nullptr;
+			}
+			// segment is complete, next one starts with this message
+			map_segment(segment, position, false);
+			read_offset = segment_header_size;
+		}
+	}
+
+	void wake_consumers() {
+		sync->message += 1;
+		if (sync->message_waiters) {
+			futex_wake(sync->message);
+		}
+	}
+
+	static uint32_t checksum(const void *mem, size_t size) {
+		uint32_t hash = 0x811c9dc5; // FNV-1a
+		auto p = static_cast<const uint8_t*>(mem);
+		for (size_t i = 0; i < size; i++) {
+			hash = (hash ^ p[i]) * 0x01000193;
+		}
+		return hash;
+	}
+};
+
+
+uint64_t JournalProducer::write_message(std::function<void(void *mem)> writer, size_t size) {
+	return p->write(writer, size);
+}
+void JournalProducer::sync(uint64_t seq) {
+	p->sync_to(seq);
+}
+JournalProducer JournalProducer::open(const std::string& dir, const JournalOptions& options) {
+	auto p = std::make_unique<JournalInternal>(dir, true);
+	p->open(options);
+	return JournalProducer(std::move(p));
+}
+JournalProducer::JournalProducer(std::unique_ptr<JournalInternal> p): p(std::move(p)) {
+}
+JournalProducer::~JournalProducer() noexcept {
+	if (p) {
+		p->close();
+	}
+}
+JournalProducer::JournalProducer(JournalProducer&&) noexcept = default;
+
+
+JournalConsumer::ReadRet JournalConsumer::read_message(std::function<void(uint64_t seq, const void *mem, size_t size)> reader) {
+	return p->read(reader);
+}
+void JournalConsumer::cancel_read() {
+	p->cancel_read(ReadRet::ReadCancelled);
+}
+void JournalConsumer::seek(uint64_t seq) {
+	p->seek(seq);
+}
+uint64_t JournalConsumer::position() const noexcept {
+	return p->position;
+}
+void JournalConsumer::commit() {
+	p->commit();
+}
+uint64_t JournalConsumer::committed() const noexcept {
+	return p->offset->position;
+}
+JournalConsumer JournalConsumer::open(const std::string& dir, const std::string& name, const JournalOptions& options) {
+	auto p = std::make_unique<JournalInternal>(dir, false);
+	p->open(options);
+	try {
+		p->open_name(name);
+	}
+	catch (...) {
+		p->close();
+		throw;
+	}
+	return JournalConsumer(std::move(p));
+}
+JournalConsumer::JournalConsumer(std::unique_ptr<JournalInternal> p): p(std::move(p)) {
+}
+JournalConsumer::~JournalConsumer() noexcept {
+	if (p) {
+		p->cancel_read(ReadRet::ReadDestroyed);
+		p->close();
+	}
+}
+JournalConsumer::JournalConsumer(JournalConsumer&&) noexcept = default;
+
+} // namespace ipclib
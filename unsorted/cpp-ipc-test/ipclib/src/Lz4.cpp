@@ -0,0 +1,208 @@
+#include "Lz4.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+namespace ipclib
+{
+
+/*
+
+	Block is a sequence of:
+	   token: high 4 bits - literal count, low 4 bits - match length minus 4;
+	          15 means that count continues in following bytes (each 255 adds and continues)
+	   literals
+	   match offset, 2 bytes little-endian (not present in the last sequence)
+
+	Last match must start at least 12 bytes before end of data and last 5 bytes are always
+	literals, so decoder can copy in chunks without checking every byte.
+
+	Compressor looks up 4-byte sequences in hash table of their last positions;
+	search step grows while nothing is found, so incompressible data is skipped quickly.
+
+*/
+
+namespace
+{
+
+constexpr int hash_bits = 12;
+constexpr size_t min_match = 4;
+constexpr size_t last_literals = 5;
+constexpr size_t match_limit = 12;
+constexpr size_t max_offset = 65535;
+constexpr int skip_trigger = 6; // log2 of misses after which step grows
+
+uint32_t read32(const uint8_t *p) {
+	uint32_t v;
+	std::memcpy(&v, p, sizeof(v));
+	return v;
+}
+uint32_t hash(uint32_t v) {
+	return (v * 2654435761u) >> (32 - hash_bits);
+}
+
+// writes length continuation bytes; returns false if they don't fit
+bool write_length(uint8_t*& op, const uint8_t *end, size_t n) {
+	for (; n >= 255; n -= 255) {
+		if (op == end) {
+			return false;
+		}
+		*op++ = 255;
+	}
+	if (op == end) {
+		return false;
+	}
+	*op++ = uint8_t(n);
+	return true;
+}
+// reads length continuation bytes; returns false on end of input
+bool read_length(const uint8_t*& ip, const uint8_t *end, size_t& n) {
+	uint8_t b;
+	do {
+		if (ip == end) {
+			return false;
+		}
+		b = *ip++;
+		n += b;
+	} while (b == 255);
+	return true;
+}
+
+// writes token with literals and, if match_len isn't 0, match; returns false if it doesn't fit
+bool write_sequence(uint8_t*& op, const uint8_t *end, const uint8_t *literals, size_t literal_count, size_t offset, size_t match_len) {
+	if (op == end) {
+		return false;
+	}
+	uint8_t& token = *op++;
+	token = uint8_t(std::min<size_t>(literal_count, 15) << 4);
+	if (literal_count >= 15 && !write_length(op, end, literal_count - 15)) {
+		return false;
+	}
+	if (size_t(end - op) < literal_count) {
+		return false;
+	}
+	if (literal_count) { // literals may be null if there are none
+		std::memcpy(op, literals, literal_count);
+		op += literal_count;
+	}
+
+	if (!match_len) {
+		return true;
+	}
+	if (end - op < 2) {
+		return false;
+	}
+	*op++ = uint8_t(offset);
+	*op++ = uint8_t(offset >> 8);
+	const size_t n = match_len - min_match;
+	token |= uint8_t(std::min<size_t>(n, 15));
+	return n < 15 || write_length(op, end, n - 15);
+}
+
+} // namespace
+
+
+size_t lz4_compress(const void *src, size_t size, void *dst, size_t capacity) noexcept {
+	const auto begin = static_cast<const uint8_t*>(src);
+	const auto end = begin + size;
+	auto op = static_cast<uint8_t*>(dst);
+	const auto op_end = op + capacity;
+
+	const uint8_t *anchor = begin; // start of pending literals
+	if (size > match_limit) {
+		uint32_t table[1 << hash_bits] = {}; // positions relative to begin
+		const uint8_t *ip = begin + 1;
+		const uint8_t *const search_end = end - match_limit;
+		const uint8_t *const extend_end = end - last_literals;
+		uint32_t misses = 0;
+
+		while (ip < search_end) {
+			const uint32_t seq = read32(ip);
+			uint32_t& entry = table[hash(seq)];
+			const uint8_t *ref = begin + entry;
+			entry = uint32_t(ip - begin);
+			if (size_t(ip - ref) > max_offset || read32(ref) != seq) {
+				ip += 1 + (misses++ >> skip_trigger);
+				continue;
+			}
+			misses = 0;
+
+			while (ip > anchor && ref > begin && ip[-1] == ref[-1]) {
+				--ip;
+				--ref;
+			}
+			size_t len = min_match;
+			while (ip + len < extend_end && ip[len] == ref[len]) {
+				len++;
+			}
+			if (!write_sequence(op, op_end, anchor, ip - anchor, ip - ref, len)) {
+				return 0;
+			}
+			ip += len;
+			anchor = ip;
+			if (ip < search_end) {
+				table[hash(read32(ip - 2))] = uint32_t(ip - 2 - begin);
+			}
+		}
+	}
+	if (!write_sequence(op, op_end, anchor, end - anchor, 0, 0)) {
+		return 0;
+	}
+	return op - static_cast<uint8_t*>(dst);
+}
+
+bool lz4_decompress(const void *src, size_t size, void *dst, size_t raw_size) noexcept {
+	auto ip = static_cast<const uint8_t*>(src);
+	const auto end = ip + size;
+	const auto begin = static_cast<uint8_t*>(dst);
+	auto op = begin;
+	const auto op_end = begin + raw_size;
+
+	while (ip != end) {
+		const uint8_t token = *ip++;
+
+		size_t literal_count = token >> 4;
+		if (literal_count == 15 && !read_length(ip, end, literal_count)) {
+			return false;
+		}
+		if (size_t(end - ip) < literal_count || size_t(op_end - op) < literal_count) {
+			return false;
+		}
+		if (literal_count) {
+			std::memcpy(op, ip, literal_count);
+			op += literal_count;
+			ip += literal_count;
+		}
+		if (ip == end) {
+			break; // last sequence has no match
+		}
+
+		if (end - ip < 2) {
+			return false;
+		}
+		const size_t offset = ip[0] | size_t(ip[1]) << 8;
+		ip += 2;
+		size_t len = token & 15;
+		if (len == 15 && !read_length(ip, end, len)) {
+			return false;
+		}
+		len += min_match;
+		if (!offset || offset > size_t(op - begin) || size_t(op_end - op) < len) {
+			return false;
+		}
+
+		// match may overlap output; then copied part repeats, so copy in growing chunks
+		const uint8_t *ref = op - offset;
+		for (size_t chunk = offset; len > chunk; chunk *= 2) {
+			std::memcpy(op, ref, chunk);
+			op += chunk;
+			len -= chunk;
+		}
+		std::memcpy(op, ref, len);
+		op += len;
+	}
+	return op == op_end;
+}
+
+} // namespace ipclib
@@ -0,0 +1,18 @@
+// Fast compression, LZ4 block format
+
+#pragma once
+
+#include <cstddef>
+
+namespace ipclib
+{
+
+/// Compresses data into buffer of specified capacity. Returns compressed size,
+/// or 0 if it doesn't fit - so capacity smaller than size means "only if it gets smaller"
+size_t lz4_compress(const void *src, size_t size, void *dst, size_t capacity) noexcept;
+
+/// Decompresses data which must be exactly raw_size bytes long; returns false if it's corrupted.
+/// Never reads or writes outside of buffers
+bool lz4_decompress(const void *src, size_t size, void *dst, size_t raw_size) noexcept;
+
+} // namespace ipclib
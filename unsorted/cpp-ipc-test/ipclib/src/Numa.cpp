@@ -0,0 +1,139 @@
+#include "ipclib/Numa.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <stdexcept>
+#include <system_error>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace ipclib
+{
+
+NumaPolicy NumaPolicy::bind(int node) {
+	if (node < 0 || node >= 64) {
+		throw std::invalid_argument("NumaPolicy::bind() node index must be in [0, 64)");
+	}
+	return {Bind, uint64_t(1) << node};
+}
+
+static void check_policy(const NumaPolicy& policy) {
+	if (policy.mode != NumaPolicy::Default && !policy.nodes) {
+		throw std::invalid_argument("numa_bind() no nodes specified");
+	}
+	if (policy.mode == NumaPolicy::Preferred && (policy.nodes & (policy.nodes - 1))) {
+		throw std::invalid_argument("numa_bind() preferred policy requires exactly one node");
+	}
+}
+
+#ifdef __linux__
+
+int numa_node_count() noexcept {
+	static const int count = [] {
+		int count = 0;
+		if (DIR* d = opendir("/sys/devices/system/node")) {
+			while (auto e = readdir(d)) {
+				int node;
+				char tail;
+				if (sscanf(e->d_name, "node%d%c", &node, &tail) == 1) {
+					count = std::max(count, node + 1);
+				}
+			}
+			closedir(d);
+		}
+		return count ? count : 1;
+	}();
+	return count;
+}
+
+void numa_bind(void *addr, size_t size, const NumaPolicy& policy) {
+	check_policy(policy);
+	const int node_count = numa_node_count();
+	if (node_count == 1 || !size) {
+		return;
+	}
+	if (node_count < 64 && policy.mode != NumaPolicy::Default && (policy.nodes >> node_count)) {
+		throw std::invalid_argument("numa_bind() node index is above highest node");
+	}
+	int mode = MPOL_DEFAULT;
+	switch (policy.mode) {
+		case NumaPolicy::Default: mode = MPOL_DEFAULT; break;
+		case NumaPolicy::Bind: mode = MPOL_BIND; break;
+		case NumaPolicy::Interleave: mode = MPOL_INTERLEAVE; break;
+		case NumaPolicy::Preferred: mode = MPOL_PREFERRED; break;
+	}
+
+	const size_t page = sysconf(_SC_PAGESIZE);
+	unsigned long mask = policy.mode == NumaPolicy::Default ? 0 : policy.nodes;
+	const unsigned long max_node = std::min<unsigned long>(node_count, sizeof(mask) * 8) + 1; // kernel reads one bit less
+	if (syscall(SYS_mbind, addr, (size + page - 1) / page * page, mode, mode == MPOL_DEFAULT ? nullptr : &mask, max_node, 0)) {
+		if (errno == ENOSYS) {
+			return; // kernel without NUMA support
+		}
+		throw std::system_error(errno, std::generic_category(), "numa_bind() mbind failed");
+	}
+}
+
+std::vector<size_t> numa_pages(const void *addr, size_t size) {
+	std::vector<size_t> counts(numa_node_count());
+	const size_t page = sysconf(_SC_PAGESIZE);
+	auto base = static_cast<const uint8_t*>(addr);
+	const size_t total = (size + page - 1) / page;
+
+	constexpr size_t chunk = 1024;
+	void *pages[chunk];
+	int status[chunk];
+	for (size_t first = 0; first < total; first += chunk) {
+		const size_t n = std::min(chunk, total - first);
+		for (size_t i = 0; i < n; i++) {
+			pages[i] = const_cast<uint8_t*>(base + (first + i) * page);
+		}
+		// without target nodes, only reports where pages are
+		if (syscall(SYS_move_pages, 0, n, pages, nullptr, status, 0)) {
+			if (errno != ENOSYS) {
+				throw std::system_error(errno, std::generic_category(), "numa_pages() move_pages failed");
+			}
+			// kernel without NUMA support, count resident pages as node 0
+			unsigned char resident[chunk];
+			if (mincore(pages[0], n * page, resident)) {
+				throw std::system_error(errno, std::generic_category(), "numa_pages() mincore failed");
+			}
+			for (size_t i = 0; i < n; i++) {
+				counts[0] += resident[i] & 1;
+			}
+			continue;
+		}
+		for (size_t i = 0; i < n; i++) {
+			if (status[i] >= 0) { // negative errno if page isn't mapped
+				if (size_t(status[i]) >= counts.size()) {
+					counts.resize(status[i] + 1);
+				}
+				counts[status[i]] += 1;
+			}
+		}
+	}
+	return counts;
+}
+
+#else
+
+int numa_node_count() noexcept {
+	return 1;
+}
+void numa_bind(void*, size_t, const NumaPolicy& policy) {
+	check_policy(policy);
+}
+std::vector<size_t> numa_pages(const void*, size_t) {
+	return {0};
+}
+
+#endif
+
+} // namespace ipclib
@@ -0,0 +1,39 @@
+// Liveness of process which owns slot in shared memory
+
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+
+#ifdef __linux__
+#include <sys/stat.h>
+#endif
+#include <signal.h>
+
+namespace ipclib
+{
+
+/// Inode of PID namespace of this process, 0 if unknown. PIDs of processes
+/// sharing memory can be compared only if they are in the same namespace
+inline uint64_t pid_namespace() {
+#ifdef __linux__
+	static const uint64_t ns = [] {
+		struct stat st;
+		return stat("/proc/self/ns/pid", &st) == 0 ? static_cast<uint64_t>(st.st_ino) : uint64_t(0);
+	}();
+	return ns;
+#else
+	return 0;
+#endif
+}
+
+/// Returns false only if process surely doesn't exist. PID from another or unknown
+/// namespace (pid_ns of owner) means nothing here, so such process is considered alive
+inline bool is_process_alive(int32_t pid, uint64_t pid_ns) {
+	if (!pid_ns || pid_ns != pid_namespace()) {
+		return true;
+	}
+	return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+} // namespace ipclib
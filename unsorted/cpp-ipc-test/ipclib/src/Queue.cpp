@@ -1,5 +1,20 @@
 #include "ipclib/Queue.h"
+#include "Futex.h"
+#include "Lz4.h"
+#include "Process.h"
+#include "SocketQueue.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <boost/interprocess/mapped_region.hpp>
 #include <boost/interprocess/shared_memory_object.hpp>
 #include <boost/interprocess/sync/interprocess_condition.hpp>
@@ -15,6 +30,7 @@ namespace ipclib
 
 	memory layout:
 	   Sync object
+	   lane rings, if enabled (lane_count * lane_size bytes)
 	   messages, array of:
 		   Header object
 		   bytes
@@ -27,12 +43,55 @@ namespace ipclib
 	- QueueConsumer destructor
 	- last writer being destroyed
 	
-	Cancel events are sent to all readers and checked by UID;
-	if it doesn't match, reader continues to wait.
+	Each consumer takes a wait slot (assigned in ref, freed in deref) with its own cancel
+	value and futex word. Idle consumer marks its slot as waiting under mutex and sleeps
+	on the word; new message wakes exactly one waiting slot (and unmarks it, so the next
+	message wakes another one), cancel wakes only slot of its target.
+	QueueSet marks slots of all its consumers as waiting and sleeps on all their words at once.
+	
+	Consumers which didn't get a slot wait on shared condition instead; cancel events
+	for them are sent to all such readers and checked by UID - if it doesn't match,
+	reader continues to wait.
 	
 	Event on last writer being destroyed intended for all readers,
 	so it's checked by mismatch between global () event counter
 	and one in the reader object.
+	
+	Shrink:
+	Shared buffer only grows while messages are written. Once its allocated part (committed)
+	is over high watermark and queued messages take no more than low watermark, pages above
+	low watermark are punched out of the object. Object keeps its size, so mappings of
+	other processes stay valid - they just get new zeroed pages if buffer grows again.
+	Gap between watermarks is hysteresis, so small bursts don't cause shrinks.
+	
+	Expiry:
+	Each message has expiry time (explicit or from queue TTL). Consumer drops all expired
+	messages at the front of array or lane at once, without calling reader; array is then
+	shifted only once.
+	
+	Lanes:
+	Each lane is a single-producer ring of LaneRecord + bytes, owned by one producer
+	(assigned in ref, freed in deref). Producer advances tail, consumers advance head;
+	consumers take lane only for the duration of one read, so they don't block each other
+	for long. Record which doesn't fit before the end of ring is preceded by padding record,
+	which is published on its own before waiting for space for the record - so any record
+	up to lane size fits once consumers step over the padding.
+	
+	Consumer which found nothing increments lane_waiters under mutex and rechecks lanes
+	before waiting; producer checks lane_waiters after publishing message and only then
+	takes mutex to notify. So producers with lanes never lock anything while consumer is busy.
+	Lane which another consumer is reading counts as empty for that check; consumer which
+	releases lane with messages left in it wakes a waiter the same way as producer.
+	
+	Compression:
+	Message of at least threshold size is written by user into producer's scratch buffer and
+	compressed from it before taking mutex or lane; header keeps its original size (0 if it's
+	stored as is). Consumer decompresses it into its own scratch buffer before calling reader;
+	message from array is copied out and removed first, so mutex isn't held meanwhile.
+	Message which doesn't get smaller is stored as is.
+	
+	Socket transport:
+	Queue with socket name has no shm object at all, every call is forwarded to SocketQueue.
 
 */
 
@@ -41,30 +100,89 @@ public:
     using ReadRet = QueueConsumer::ReadRet;
 
     template <typename CreateType>
-    void create(const std::string& name) {
+    void create(const std::string& name, const QueueOptions& options) {
+        if (name.size() >= sizeof(Sync::name)) {
+            throw std::invalid_argument("QueueProducer::create() name is too long");
+        }
         shm = shared_memory_object(CreateType{}, name.c_str(), read_write);
         shm.truncate(sync_size); // resize
 
-        resize_mapping(0);
+        map_sync();
+        numa_bind(region.get_address(), region.get_size(), options.numa); // before header is touched
         new(sync) Sync(); // init mutexes and stuff
-        sync->name = name;
+        std::memcpy(sync->name, name.c_str(), name.size() + 1);
+        sync->numa = options.numa;
+
+        if (options.lanes > 0) {
+            sync->lane_count = std::min(options.lanes, max_lanes);
+            sync->lane_size = options.lane_size / record_align * record_align;
+            sync->lane_order = options.lane_order;
+            if (sync->lane_size < sizeof(LaneRecord) + record_align) {
+                throw std::invalid_argument("QueueProducer::create() lane size is too small");
+            }
+            shm.truncate(data_begin());
+        }
+        sync->ttl = options.ttl.count();
+        sync->shrink_high = options.shrink_high;
+        sync->shrink_low = std::min(options.shrink_low, options.shrink_high);
+        sync->compress_threshold = options.compress_threshold;
+        resize_mapping(0);
     }
     void open(const std::string& name) {
 		shm = shared_memory_object(open_only, name.c_str(), read_write);
+        map_sync();
         resize_mapping(0);
     }
 
     // add shm user
     std::pair<uint64_t, uint64_t> ref(bool is_producer) {
+        if (socket) {
+            return {0, 0};
+        }
         scoped_lock<interprocess_mutex> lock(sync->mut);
         (is_producer ? sync->ref_producers : sync->ref_consumers) += 1;
         sync->uid_counter += 1;
+        if (is_producer) {
+            for (int i = 0; i < sync->lane_count; i++) {
+                if (!sync->lanes[i].owner) {
+                    sync->lanes[i].owner = sync->uid_counter;
+                    lane = i;
+                    break;
+                }
+            }
+        }
+        else {
+            for (int i = 0; i < max_wait_slots; i++) {
+                WaitSlot& w = sync->wait_slots[i];
+                if (!w.owner || !is_process_alive(w.pid, w.pid_ns)) {
+                    w.owner = sync->uid_counter;
+                    w.pid = getpid();
+                    w.pid_ns = pid_namespace();
+                    w.cancel = ReadRet::ReadOk;
+                    w.waiting = false;
+                    slot = i;
+                    break;
+                }
+            }
+        }
         return {sync->uid_counter, sync->cancel_all_counter}; // uid value and cancel_all event counter
     }
     // remove shm user
     void deref(bool is_producer) {
+        if (socket) {
+            return;
+        }
         scoped_lock<interprocess_mutex> lock(sync->mut);
         (is_producer ? sync->ref_producers : sync->ref_consumers) -= 1;
+        if (is_producer && lane != -1) {
+            // unread messages stay in the ring; next owner just continues after them
+            sync->lanes[lane].owner = 0;
+            lane = -1;
+        }
+        if (!is_producer && slot != -1) {
+            sync->wait_slots[slot].owner = 0;
+            slot = -1;
+        }
         if (!sync->ref_producers) {
             cancel_all_reads(ReadRet::ReadNoProducersLeft);
         }
@@ -73,7 +191,25 @@ public:
         }
     }
 
-    void write(std::function<void(void *mem)> writer, size_t size) {
+    void write(std::function<void(void *mem)> writer, size_t size, uint64_t expires) {
+        if (socket) {
+            return socket->write(writer, size, expires);
+        }
+        const uint64_t timestamp = now();
+        if (!expires && sync->ttl) {
+            expires = timestamp + sync->ttl;
+        }
+        if (sync->compress_threshold && size >= sync->compress_threshold) {
+            return write_compressed(writer, size, timestamp, expires);
+        }
+        store(writer, size, 0, timestamp, expires);
+    }
+    // writes message as is; raw_size is original size if it's compressed
+    void store(const std::function<void(void *mem)>& writer, size_t size, uint64_t raw_size, uint64_t timestamp, uint64_t expires) {
+        if (lane != -1) {
+            return write_lane(writer, size, raw_size, timestamp, expires);
+        }
+
         scoped_lock<interprocess_mutex> lock(sync->mut);
 
         const offset_t mem_begin = sync->data_offset;
@@ -83,22 +219,38 @@ public:
             throw std::runtime_error("QueueProducer::write() shared_memory_object::get_size() failed");
         }
 
-        if (shm_size < mem_end) {
-            shm.truncate(sync_size + mem_end); // resize
-            resize_mapping(mem_end);
+        if (shm_size < offset_t(data_begin() + mem_end)) {
+            shm.truncate(data_begin() + mem_end); // resize
+        }
+        if (region.get_size() < data_begin() + mem_end) {
+            resize_mapping(mem_end, lock); // other producer may have resized shm already
         }
 
         // write message
-        auto ptr = static_cast<uint8_t*>(region.get_address()) + sync_size + mem_begin;
-        static_cast<Header*>(static_cast<void*>(ptr))->size = size;
+        auto ptr = data() + mem_begin;
+        auto header = static_cast<Header*>(static_cast<void*>(ptr));
+        header->size = size;
+        header->raw_size = raw_size;
+        header->timestamp = timestamp;
+        header->expires = expires;
         writer(ptr + header_size);
 
         sync->data_offset = mem_end;
-        sync->message.notify_one();
+        sync->committed = std::max<size_t>(sync->committed, mem_end);
+        sync->shared_pending += 1;
+        wake_one();
     }
     ReadRet read(uint64_t uid, uint64_t& last_cancel_all, std::function<void(const void *mem, size_t size)> reader) {
+        if (socket) {
+            return socket->read(reader);
+        }
         auto on_cancel = [&]{
-            if (sync->cancel != ReadRet::ReadOk && sync->cancel_uid == uid) {
+            if (slot != -1) {
+                if (auto ret = std::exchange(sync->wait_slots[slot].cancel, ReadRet::ReadOk)) {
+                    return ret;
+                }
+            }
+            else if (sync->cancel != ReadRet::ReadOk && sync->cancel_uid == uid) {
                 // unset cancel value and allow it to be set for other processes
                 sync->cancel_free.notify_one();
                 return std::exchange(sync->cancel, ReadRet::ReadOk);
@@ -110,37 +262,136 @@ public:
             }
             return ReadRet::ReadOk;
         };
-		
+
+        if (busy_poll) {
+            // never sleeps: lanes and shared_pending are checked without locking,
+            // and producers don't have to wake consumer which isn't marked as waiting
+            int pauses = 1;
+            for (uint32_t n = 1;; n++) {
+                if (sync->lane_count ? read_lanes(reader) : poll_array(reader)) {
+                    return ReadRet::ReadOk;
+                }
+                if (n % cancel_poll_interval == 0) {
+                    scoped_lock<interprocess_mutex> lock(sync->mut);
+                    if (auto ret = on_cancel()) {
+                        return ret;
+                    }
+                }
+                for (int i = 0; i < pauses; i++) {
+                    cpu_relax();
+                }
+                pauses = std::min(pauses * 2, max_poll_pauses);
+            }
+        }
+
+        if (sync->lane_count) {
+            while (true) {
+                if (read_lanes(reader)) {
+                    return ReadRet::ReadOk;
+                }
+
+                scoped_lock<interprocess_mutex> lock(sync->mut);
+                if (sync->data_offset && read_front(reader, lock)) {
+                    return ReadRet::ReadOk;
+                }
+                if (auto ret = on_cancel()) {
+                    return ret;
+                }
+
+                // producers check lane_waiters after publishing, so either they see it or we see their message
+                sync->lane_waiters += 1;
+                if (!lanes_readable()) {
+                    wait(lock);
+                }
+                sync->lane_waiters -= 1;
+            }
+        }
+
         scoped_lock<interprocess_mutex> lock(sync->mut);
         while (true) {
-            if (sync->data_offset) {
-                break;
+            if (sync->data_offset && read_front(reader, lock)) {
+                return ReadRet::ReadOk;
             }
             if (auto ret = on_cancel()) {
                 return ret;
             }
-            sync->message.wait(lock);
-            // cancel event for another process could have woken as up, so check conditions again
+            wait(lock);
+            // without slot, cancel event for another process could have woken as up, so check conditions again
         }
-
-        // resize data region if needed
-        if (sync->data_offset > region.get_size()) {
-            resize_mapping(sync->data_offset);
+    }
+    QueueStats stats() {
+        if (socket) {
+            return socket->stats();
         }
+        QueueStats stats;
+        struct stat st;
+        if (fstat(shm.get_mapping_handle().handle, &st)) {
+            throw std::system_error(errno, std::generic_category(), "Queue::stats() fstat() failed");
+        }
+        stats.object_size = st.st_size;
+        stats.allocated = size_t(st.st_blocks) * 512;
 
-        // read message
-        auto ptr = static_cast<uint8_t*>(region.get_address()) + sync_size;
-        size_t size = static_cast<Header*>(static_cast<void*>(ptr))->size;
-        reader(ptr + header_size, size);
+        scoped_lock<interprocess_mutex> lock(sync->mut);
+        stats.queued = sync->data_offset;
+        stats.shrink_count = sync->shrink_count;
+        stats.shrunk_bytes = sync->shrunk_bytes;
+        stats.expired = sync->expired;
+        lock.unlock();
 
-        // left-shift buffer
-        sync->data_offset -= header_size + size;
-        std::memmove(ptr, ptr + header_size + size, sync->data_offset);
+        stats.compressed = sync->compressed;
+        stats.compress_skipped = sync->compress_skipped;
+        stats.compressed_raw_bytes = sync->compressed_raw_bytes;
+        stats.compressed_bytes = sync->compressed_bytes;
+        stats.compress_time = std::chrono::nanoseconds(sync->compress_time);
+        stats.decompress_time = std::chrono::nanoseconds(sync->decompress_time);
 
-        return ReadRet::ReadOk;
+        stats.numa_pages = numa_pages(region.get_address(), region.get_size());
+        return stats;
+    }
+    // QueueSet support. arm() returns true if read wouldn't block, otherwise marks slot as waiting
+    // and returns its futex word; disarm() unmarks it
+    bool is_ready(uint64_t last_cancel_all) {
+        scoped_lock<interprocess_mutex> lock(sync->mut);
+        return ready(last_cancel_all);
+    }
+    bool arm(uint64_t last_cancel_all, std::atomic<uint32_t>*& word, uint32_t& value) {
+        if (slot == -1) {
+            throw std::runtime_error("QueueSet::add() consumer has no wait slot");
+        }
+        scoped_lock<interprocess_mutex> lock(sync->mut);
+        sync->lane_waiters += 1; // before checking lanes, same as in read()
+        if (ready(last_cancel_all)) {
+            sync->lane_waiters -= 1;
+            return true;
+        }
+        WaitSlot& w = sync->wait_slots[slot];
+        word = &w.wake;
+        value = w.wake.load();
+        w.waiting = true;
+        return false;
+    }
+    void disarm() {
+        scoped_lock<interprocess_mutex> lock(sync->mut);
+        sync->lane_waiters -= 1;
+        sync->wait_slots[slot].waiting = false;
     }
+    bool has_slot() const {
+        return slot != -1;
+    }
+
     void cancel_read(uint64_t uid, ReadRet reason) {
+        if (socket) {
+            return socket->cancel_read(reason);
+        }
         scoped_lock<interprocess_mutex> lock(sync->mut);
+        if (slot != -1) {
+            WaitSlot& w = sync->wait_slots[slot];
+            if (w.cancel == ReadRet::ReadOk) { // if not, previous one wasn't consumed yet
+                w.cancel = reason;
+            }
+            wake(w);
+            return;
+        }
         if (sync->cancel != ReadRet::ReadOk) {
             // cancel event for some process already set, not yet used
             sync->cancel_free.wait(lock);
@@ -149,21 +400,57 @@ public:
         sync->cancel_uid = uid;
         sync->message.notify_all(); // have to wake all
     }
+    // mutex must be locked
     void cancel_all_reads(ReadRet reason) {
-        scoped_lock<interprocess_mutex> lock(sync->mut);
         sync->cancel_all_counter += 1;
         sync->cancel_all = reason;
+        for (auto& w : sync->wait_slots) {
+            if (w.owner && w.waiting) {
+                wake(w);
+            }
+        }
         sync->message.notify_all();
     }
 
+    bool busy_poll = false; // see QueueConsumer::set_busy_poll()
+    std::unique_ptr<SocketQueue> socket; // if set, queue has no shm object
+
 private:
+    static constexpr int max_lanes = 64;
+    static constexpr int max_wait_slots = 64;
+    static constexpr int max_poll_pauses = 64; // back-off limit of busy-polling consumer
+    static constexpr uint32_t cancel_poll_interval = 256; // it checks cancel only once in that many polls
+
+    // consumer's wait slot, see layout description. Protected by mutex, except futex
+    struct WaitSlot {
+        alignas(64) std::atomic<uint32_t> wake{0}; // futex, incremented to wake consumer
+        bool waiting = false; // consumer sleeps or is about to; cleared by waker
+        ReadRet cancel = ReadRet::ReadOk;
+        uint64_t owner = 0; // consumer uid or 0 if free
+        int32_t pid = 0; // of owner
+        uint64_t pid_ns = 0; // of owner
+    };
+
+    // single-producer ring, see layout description
+    struct Lane {
+        // producer side
+        alignas(64) std::atomic<uint64_t> tail{0}; // byte counter, never wraps
+        std::atomic<uint32_t> producer_waiting{0};
+        uint64_t owner = 0; // producer uid or 0 if free; protected by mutex
+
+        // consumer side
+        alignas(64) std::atomic<uint64_t> head{0};
+        std::atomic<uint32_t> reading{0}; // set while some consumer reads from the lane
+        interprocess_condition space; // notified when head moves and producer waits for it
+    };
+
     // synchronization block
     struct Sync {
         // data
         interprocess_mutex mut;
-        interprocess_condition message; // also notified on cancel event
+        interprocess_condition message; // for consumers without wait slot; also notified on cancel event
         size_t data_offset = 0; // where next message will be written
-        std::string name;
+        char name[256]; // can't use std::string in shared memory
 
         // refcount
         int ref_producers = 0;
@@ -171,7 +458,11 @@ private:
         uint64_t uid_counter = 0; // even if one object would be created each millisecond,
                                   // this counter won't wrap for 600 millions of years
 
-        // cancel one
+        // wait slots
+        WaitSlot wait_slots[max_wait_slots];
+        int next_wake = 0; // slot to start searching from, so consumers are woken in turn
+
+        // cancel one, for consumers without slot
         ReadRet cancel = ReadRet::ReadOk;
         uint64_t cancel_uid;
         interprocess_condition cancel_free; // so multiple processes can cancel at the same time safely
@@ -179,55 +470,544 @@ private:
         // cancel all
         uint64_t cancel_all_counter = 0; // used to detect new event
         ReadRet cancel_all;
+
+        // expiry
+        uint64_t ttl = 0; // default, nanoseconds; 0 if none
+        std::atomic<uint64_t> expired{0}; // dropped messages
+
+        NumaPolicy numa; // applied by every process after remapping
+
+        // compression
+        size_t compress_threshold = 0; // see QueueOptions
+        std::atomic<uint64_t> compressed{0}; // counters, see QueueStats
+        std::atomic<uint64_t> compress_skipped{0};
+        std::atomic<uint64_t> compressed_raw_bytes{0};
+        std::atomic<uint64_t> compressed_bytes{0};
+        std::atomic<uint64_t> compress_time{0}; // thread CPU time, nanoseconds
+        std::atomic<uint64_t> decompress_time{0};
+
+        // shrink
+        size_t shrink_high = 0; // watermarks, see QueueOptions
+        size_t shrink_low = 0;
+        size_t committed = 0; // end of part of array which may be allocated
+        uint64_t shrink_count = 0;
+        uint64_t shrunk_bytes = 0;
+
+        // lanes
+        int lane_count = 0;
+        size_t lane_size = 0;
+        QueueOptions::LaneOrder lane_order = QueueOptions::LaneRoundRobin;
+        std::atomic<uint32_t> shared_pending{0}; // messages in array, so consumers can skip it without locking
+        std::atomic<uint32_t> lane_waiters{0}; // consumers waiting for message
+        Lane lanes[max_lanes];
     };
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "atomics must be lock-free to be shared between processes");
 
     // message header
     struct Header {
         size_t size; // byte size of message
+        uint64_t raw_size; // size before compression; 0 if message isn't compressed
+        uint64_t timestamp; // steady clock, nanoseconds
+        uint64_t expires; // same; 0 if never
+    };
+    // lane message header
+    struct LaneRecord {
+        uint64_t size; // byte size of message or pad_record
+        uint64_t raw_size; // same as in Header
+        uint64_t timestamp;
+        uint64_t expires;
     };
+    static constexpr uint64_t pad_record = ~uint64_t(0); // rest of the ring is unused
+    static constexpr size_t record_align = sizeof(LaneRecord);
 
     static constexpr int sync_size = sizeof(Sync);
     static constexpr int header_size = sizeof(Header);
 
     shared_memory_object shm;
     mapped_region region;
-    Sync* sync;
+    Sync* sync = nullptr;
+
+    int lane = -1; // index of producer's lane
+    int slot = -1; // index of consumer's wait slot
+    std::mutex lane_mut; // producer object may be used by several threads
+    int next_source = 0; // round-robin position of consumer; lane_count means array
+
+    // mutex must be locked. Returns false if nobody was sleeping on the word
+    bool wake(WaitSlot& w) {
+        w.waiting = false;
+        w.wake.fetch_add(1);
+        return futex_wake(w.wake) != 0;
+    }
+    // wakes one waiting consumer; mutex must be locked
+    void wake_one() {
+        for (int n = 0; n < max_wait_slots; n++) {
+            const int i = (sync->next_wake + n) % max_wait_slots;
+            WaitSlot& w = sync->wait_slots[i];
+            if (w.owner && w.waiting) {
+                // consumer may be just about to sleep, so liveness is checked only then
+                if (!wake(w) && !is_process_alive(w.pid, w.pid_ns)) {
+                    continue; // crashed while waiting, slot will be reused
+                }
+                sync->next_wake = (i + 1) % max_wait_slots;
+                return;
+            }
+        }
+        sync->message.notify_one();
+    }
+    // waits for wake_one() or cancel; mutex must be locked. May return spuriously
+    void wait(scoped_lock<interprocess_mutex>& lock) {
+        if (slot == -1) {
+            sync->message.wait(lock);
+            return;
+        }
+        WaitSlot& w = sync->wait_slots[slot];
+        const uint32_t word = w.wake.load();
+        w.waiting = true;
+        lock.unlock();
+        futex_wait(w.wake, word);
+        lock.lock();
+        w.waiting = false;
+    }
+
+    // mutex must be locked
+    bool ready(uint64_t last_cancel_all) {
+        if (sync->data_offset || (sync->lane_count && lanes_readable())) {
+            return true;
+        }
+        if (slot != -1 ? sync->wait_slots[slot].cancel != ReadRet::ReadOk
+                       : sync->cancel != ReadRet::ReadOk) { // may be for another consumer, then it's spurious
+            return true;
+        }
+        return sync->cancel_all_counter != last_cancel_all;
+    }
+
+    static uint64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    // checks if message is expired; takes time only once and only if needed
+    struct Expiry {
+        uint64_t time = 0;
+        bool operator()(uint64_t expires) {
+            if (!expires) {
+                return false;
+            }
+            if (!time) {
+                time = now();
+            }
+            return expires <= time;
+        }
+    };
+    static uint64_t cpu_time() {
+        timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+    // grows thread's buffer if needed; contents aren't kept
+    static uint8_t* scratch(std::vector<uint8_t>& buffer, size_t size) {
+        if (buffer.size() < size) {
+            buffer.resize(size);
+        }
+        return buffer.data();
+    }
+    // compression happens before any locking; stored message is copied from scratch buffer
+    void write_compressed(const std::function<void(void *mem)>& writer, size_t size, uint64_t timestamp, uint64_t expires) {
+        static thread_local std::vector<uint8_t> raw_buffer, packed_buffer;
+        uint8_t* raw = scratch(raw_buffer, size);
+        writer(raw);
+
+        uint8_t* packed = scratch(packed_buffer, size - 1);
+        const uint64_t begin = cpu_time();
+        const size_t packed_size = lz4_compress(raw, size, packed, size - 1); // only if it gets smaller
+        sync->compress_time += cpu_time() - begin;
+
+        if (!packed_size) {
+            store([&](void *mem) { std::memcpy(mem, raw, size); }, size, 0, timestamp, expires);
+            sync->compress_skipped += 1;
+            return;
+        }
+        store([&](void *mem) { std::memcpy(mem, packed, packed_size); }, packed_size, size, timestamp, expires);
+        sync->compressed += 1;
+        sync->compressed_raw_bytes += size;
+        sync->compressed_bytes += packed_size;
+    }
+    // calls reader with message, decompressing it if needed
+    void deliver(const std::function<void(const void *mem, size_t size)>& reader, const uint8_t* mem, size_t size, uint64_t raw_size) {
+        if (!raw_size) {
+            return reader(mem, size);
+        }
+        static thread_local std::vector<uint8_t> buffer;
+        uint8_t* raw = scratch(buffer, raw_size);
+        const uint64_t begin = cpu_time();
+        if (!lz4_decompress(mem, size, raw, raw_size)) {
+            throw std::runtime_error("QueueConsumer::read() compressed message is corrupted");
+        }
+        sync->decompress_time += cpu_time() - begin;
+        reader(raw, raw_size);
+    }
+
+    static size_t lane_record_size(size_t size) {
+        return sizeof(LaneRecord) + (size + record_align - 1) / record_align * record_align;
+    }
 
+    size_t data_begin() const {
+        return sync_size + sync->lane_count * sync->lane_size;
+    }
+    uint8_t* data() {
+        return static_cast<uint8_t*>(region.get_address()) + data_begin();
+    }
+    LaneRecord* lane_record(int index, uint64_t pos) {
+        auto ring = static_cast<uint8_t*>(region.get_address()) + sync_size + index * sync->lane_size;
+        return static_cast<LaneRecord*>(static_cast<void*>(ring + pos % sync->lane_size));
+    }
+
+    void map_sync() {
+        region = mapped_region(shm, read_write, 0, sync_size);
+        sync = static_cast<Sync*>(region.get_address());
+    }
     void resize_mapping(size_t size) {
-        region = mapped_region(shm, read_write, 0, sync_size + size);
+        region = mapped_region(shm, read_write, 0, data_begin() + size);
         sync = static_cast<Sync*>(region.get_address());
+        if (sync->numa.mode != NumaPolicy::Default) {
+            numa_bind(region.get_address(), region.get_size(), sync->numa);
+        }
+    }
+    // same, but mutex is locked; lock has to follow mutex to its new address
+    void resize_mapping(size_t size, scoped_lock<interprocess_mutex>& lock) {
+        lock.release();
+        resize_mapping(size);
+        scoped_lock<interprocess_mutex> relocked(sync->mut, accept_ownership);
+        lock.swap(relocked);
+    }
+
+    // resizes data region to cover all messages, if needed
+    void map_array(scoped_lock<interprocess_mutex>& lock) {
+        if (data_begin() + sync->data_offset > region.get_size()) {
+            resize_mapping(sync->data_offset, lock);
+        }
+    }
+    // reads first message from array, dropping expired ones before it; returns false if all were expired.
+    // Mutex is unlocked before compressed message is decompressed, so lock may be released on return
+    bool read_front(const std::function<void(const void *mem, size_t size)>& reader, scoped_lock<interprocess_mutex>& lock) {
+        map_array(lock);
+
+        // skip expired
+        auto ptr = data();
+        auto header = [&](size_t offset) { return static_cast<Header*>(static_cast<void*>(ptr + offset)); };
+        Expiry expired;
+        size_t skip = 0;
+        uint32_t dropped = 0;
+        while (skip != sync->data_offset && expired(header(skip)->expires)) {
+            skip += header_size + header(skip)->size;
+            dropped += 1;
+        }
+
+        // read message
+        const bool found = skip != sync->data_offset;
+        static thread_local std::vector<uint8_t> packed_buffer;
+        size_t packed_size = 0;
+        uint64_t raw_size = 0;
+        if (found) {
+            size_t size = header(skip)->size;
+            raw_size = header(skip)->raw_size;
+            if (raw_size) {
+                packed_size = size; // removed now, so it's lost if reader throws
+                std::memcpy(scratch(packed_buffer, size), ptr + skip + header_size, size);
+            }
+            else {
+                reader(ptr + skip + header_size, size);
+            }
+            skip += header_size + size;
+        }
+
+        // left-shift buffer
+        sync->data_offset -= skip;
+        sync->shared_pending -= dropped + found;
+        sync->expired += dropped;
+        std::memmove(ptr, ptr + skip, sync->data_offset);
+
+        if (sync->shrink_high && sync->committed > sync->shrink_high && sync->data_offset <= sync->shrink_low) {
+            shrink();
+        }
+
+        if (raw_size) {
+            lock.unlock();
+            deliver(reader, packed_buffer.data(), packed_size, raw_size);
+        }
+        return found;
+    }
+    // returns memory above low watermark; mutex must be locked
+    void shrink() {
+        static const size_t page = mapped_region::get_page_size();
+        const size_t begin = (data_begin() + sync->shrink_low + page - 1) / page * page;
+        const size_t end = data_begin() + sync->committed;
+        if (end <= begin) {
+            return;
+        }
+#ifdef FALLOC_FL_PUNCH_HOLE
+        if (fallocate(shm.get_mapping_handle().handle, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, begin, end - begin)) {
+            return; // not supported; keep memory, try again next time
+        }
+        sync->committed = begin - data_begin();
+        sync->shrink_count += 1;
+        sync->shrunk_bytes += end - begin;
+#endif
+    }
+
+    void write_lane(const std::function<void(void *mem)>& writer, size_t size, uint64_t raw_size, uint64_t timestamp, uint64_t expires) {
+        std::lock_guard<std::mutex> guard(lane_mut);
+        Lane& l = sync->lanes[lane];
+
+        const uint64_t record = lane_record_size(size);
+        if (record > sync->lane_size) {
+            throw std::length_error("QueueProducer::write() message is bigger than lane");
+        }
+
+        // record must be contiguous, so skip the end of ring if it doesn't fit.
+        // Padding and record together may be bigger than ring, so padding is published first
+        uint64_t tail = l.tail.load(std::memory_order_relaxed);
+        const uint64_t left = sync->lane_size - tail % sync->lane_size;
+        if (left < record) {
+            wait_lane_space(l, tail, left);
+            lane_record(lane, tail)->size = pad_record;
+            tail += left;
+            l.tail.store(tail); // seq_cst, pairs with lane_waiters
+            const uint64_t pad_begin = tail - left;
+            if (l.head.load() == pad_begin && !l.reading.exchange(1, std::memory_order_acquire)) {
+                // everything is read, step over padding as consumer would
+                if (l.head.load(std::memory_order_relaxed) == pad_begin) {
+                    l.head.store(tail, std::memory_order_relaxed);
+                }
+                l.reading.store(0); // seq_cst, pairs with lane_waiters
+            }
+            else if (sync->lane_waiters.load()) {
+                scoped_lock<interprocess_mutex> lock(sync->mut);
+                wake_one(); // so consumer steps over padding
+            }
+        }
+        wait_lane_space(l, tail, record);
+
+        auto rec = lane_record(lane, tail);
+        rec->size = size;
+        rec->raw_size = raw_size;
+        rec->timestamp = timestamp;
+        rec->expires = expires;
+        writer(rec + 1);
+
+        l.tail.store(tail + record); // seq_cst, pairs with lane_waiters
+        if (sync->lane_waiters.load()) {
+            scoped_lock<interprocess_mutex> lock(sync->mut);
+            wake_one();
+        }
+    }
+
+    // blocks until lane has size free bytes after tail
+    void wait_lane_space(Lane& l, uint64_t tail, uint64_t size) {
+        if (sync->lane_size - (tail - l.head.load(std::memory_order_acquire)) >= size) {
+            return;
+        }
+        scoped_lock<interprocess_mutex> lock(sync->mut);
+        l.producer_waiting = 1;
+        while (sync->lane_size - (tail - l.head.load()) < size) {
+            l.space.wait(lock);
+        }
+        l.producer_waiting = 0;
+    }
+
+    // returns oldest unread record in lane without removing it, or nullptr
+    LaneRecord* lane_peek(int index) {
+        Lane& l = sync->lanes[index];
+        uint64_t head = l.head.load(std::memory_order_acquire);
+        const uint64_t tail = l.tail.load(std::memory_order_acquire);
+        if (head == tail) {
+            return nullptr;
+        }
+        auto rec = lane_record(index, head);
+        if (rec->size == pad_record) {
+            head += sync->lane_size - head % sync->lane_size;
+            if (head == tail) {
+                return nullptr; // record after padding isn't written yet
+            }
+            rec = lane_record(index, head);
+        }
+        return rec;
+    }
+    // reads one message from lane, unless it's empty or another consumer is reading it.
+    // Expired messages before it are dropped
+    bool lane_pop(int index, const std::function<void(const void *mem, size_t size)>& reader) {
+        Lane& l = sync->lanes[index];
+        if (l.head.load(std::memory_order_relaxed) == l.tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        if (l.reading.exchange(1, std::memory_order_acquire)) {
+            return false;
+        }
+        struct Release { // reader may throw; message stays in the lane then
+            QueueInternal& q;
+            Lane& l;
+            ~Release() {
+                l.reading.store(0); // seq_cst, pairs with lane_waiters
+                if (q.sync->lane_waiters.load() && l.head.load() != l.tail.load()) {
+                    scoped_lock<interprocess_mutex> lock(q.sync->mut);
+                    q.wake_one(); // consumer which found lane busy may be waiting for it
+                }
+            }
+        } release{*this, l};
+
+        const uint64_t start = l.head.load(std::memory_order_relaxed);
+        uint64_t head = start;
+        const uint64_t tail = l.tail.load(std::memory_order_acquire);
+        Expiry expired;
+        uint32_t dropped = 0;
+        LaneRecord* rec = nullptr;
+        while (head != tail) { // if it's empty, another consumer took it
+            rec = lane_record(index, head);
+            if (rec->size == pad_record) {
+                head += sync->lane_size - head % sync->lane_size;
+                continue;
+            }
+            if (!expired(rec->expires)) {
+                break;
+            }
+            head += lane_record_size(rec->size);
+            dropped += 1;
+        }
+
+        const bool found = head != tail;
+        if (found) {
+            deliver(reader, static_cast<uint8_t*>(static_cast<void*>(rec + 1)), rec->size, rec->raw_size);
+            head += lane_record_size(rec->size);
+        }
+        if (head == start) {
+            return false;
+        }
+        sync->expired += dropped; // or only padding was skipped, it still frees space
+
+        l.head.store(head); // seq_cst, pairs with producer_waiting
+        if (l.producer_waiting.load()) {
+            scoped_lock<interprocess_mutex> lock(sync->mut);
+            l.space.notify_all();
+        }
+        return found;
+    }
+    // reads message from array if there is any, without locking if there isn't
+    bool poll_array(const std::function<void(const void *mem, size_t size)>& reader) {
+        if (!sync->shared_pending.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        scoped_lock<interprocess_mutex> lock(sync->mut);
+        return sync->data_offset && read_front(reader, lock);
+    }
+    // reads one message from lanes or array, if there is any
+    bool read_lanes(const std::function<void(const void *mem, size_t size)>& reader) {
+        const int count = sync->lane_count;
+
+        if (sync->lane_order == QueueOptions::LaneTimestamp) {
+            int oldest = -1;
+            uint64_t oldest_time = ~uint64_t(0);
+            for (int i = 0; i < count; i++) {
+                auto rec = lane_peek(i);
+                if (rec && rec->timestamp < oldest_time) {
+                    oldest = i;
+                    oldest_time = rec->timestamp;
+                }
+            }
+            if (sync->shared_pending.load()) {
+                scoped_lock<interprocess_mutex> lock(sync->mut);
+                map_array(lock);
+                if (sync->data_offset && static_cast<Header*>(static_cast<void*>(data()))->timestamp <= oldest_time
+                    && read_front(reader, lock)) {
+                    return true;
+                }
+            }
+            if (oldest != -1 && lane_pop(oldest, reader)) {
+                return true;
+            }
+            // lost race with another consumer, try lanes in order
+        }
+
+        for (int n = 0; n <= count; n++) {
+            const int i = next_source;
+            next_source = (next_source + 1) % (count + 1);
+
+            if (i != count) {
+                if (lane_pop(i, reader)) {
+                    return true;
+                }
+            }
+            else if (sync->shared_pending.load()) {
+                scoped_lock<interprocess_mutex> lock(sync->mut);
+                if (sync->data_offset && read_front(reader, lock)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+    // true if some lane has message which no other consumer is reading
+    bool lanes_readable() {
+        for (int i = 0; i < sync->lane_count; i++) {
+            Lane& l = sync->lanes[i];
+            if (l.head.load() != l.tail.load() && !l.reading.load()) {
+                return true;
+            }
+        }
+        return false;
     }
 };
 
 
-static std::unique_ptr<QueueInternal> create_queue(const std::string& name, bool allow_existing) {
+static constexpr char socket_prefix[] = "unix:";
+static bool is_socket_name(const std::string& name) {
+    return name.compare(0, sizeof(socket_prefix) - 1, socket_prefix) == 0;
+}
+
+static std::unique_ptr<QueueInternal> create_queue(const std::string& name, bool allow_existing, const QueueOptions& options, bool is_producer) {
     auto p = std::make_unique<QueueInternal>();
-    if (allow_existing) {
-        p->create<open_or_create_t>(name);
+    if (is_socket_name(name)) {
+        p->socket = std::make_unique<SocketQueue>(name.substr(sizeof(socket_prefix) - 1), is_producer, true, allow_existing, options);
+    }
+    else if (allow_existing) {
+        p->create<open_or_create_t>(name, options);
     }
     else {
-        p->create<create_only_t>(name);
+        p->create<create_only_t>(name, options);
     }
     return p;
 }
-static std::unique_ptr<QueueInternal> open_queue(const std::string& name) {
+static std::unique_ptr<QueueInternal> open_queue(const std::string& name, bool is_producer) {
     auto p = std::make_unique<QueueInternal>();
-    p->open(name);
+    if (is_socket_name(name)) {
+        p->socket = std::make_unique<SocketQueue>(name.substr(sizeof(socket_prefix) - 1), is_producer, false, false, QueueOptions{});
+    }
+    else {
+        p->open(name);
+    }
     return p;
 }
 void remove_queue(const std::string& name) noexcept {
+    if (is_socket_name(name)) {
+        unlink(name.c_str() + sizeof(socket_prefix) - 1);
+        return;
+    }
     shared_memory_object::remove(name.c_str());
 }
 
 
 void QueueProducer::write_message(std::function<void(void *mem)> writer, size_t size) {
-    return p->write(std::move(writer), size);
+    return p->write(std::move(writer), size, 0);
+}
+void QueueProducer::write_message(std::function<void(void *mem)> writer, size_t size, std::chrono::steady_clock::time_point expires) {
+    const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(expires.time_since_epoch()).count();
+    return p->write(std::move(writer), size, std::max<int64_t>(ns, 1)); // 0 means no expiry
 }
-QueueProducer QueueProducer::create(const std::string& name, bool allow_existing) {
-    return QueueProducer(create_queue(name, allow_existing));
+QueueStats QueueProducer::stats() {
+    return p->stats();
+}
+QueueProducer QueueProducer::create(const std::string& name, bool allow_existing, const QueueOptions& options) {
+    return QueueProducer(create_queue(name, allow_existing, options, true));
 }
 QueueProducer QueueProducer::open(const std::string& name) {
-    return QueueProducer(open_queue(name));
+    return QueueProducer(open_queue(name, true));
 }
 QueueProducer::QueueProducer(std::unique_ptr<QueueInternal> p): p(std::move(p)) {
     this->p->ref(true);
@@ -249,11 +1029,11 @@ std::error_code QueueConsumer::get_error_code(ReadRet ret) {
     }
     return std::make_error_code(std::errc::state_not_recoverable); // the end is near
 }
-QueueConsumer QueueConsumer::create(const std::string& name, bool allow_existing) {
-    return QueueConsumer(create_queue(name, allow_existing));
+QueueConsumer QueueConsumer::create(const std::string& name, bool allow_existing, const QueueOptions& options) {
+    return QueueConsumer(create_queue(name, allow_existing, options, false));
 }
 QueueConsumer QueueConsumer::open(const std::string& name) {
-    return QueueConsumer(open_queue(name));
+    return QueueConsumer(open_queue(name, false));
 }
 QueueConsumer::ReadRet QueueConsumer::read_message(std::function<void(const void *mem, size_t size)> reader) {
     return p->read(uid, last_cancel_all, std::move(reader));
@@ -261,6 +1041,12 @@ QueueConsumer::ReadRet QueueConsumer::read_message(std::function<void(const void
 void QueueConsumer::cancel_read() {
     p->cancel_read(uid, ReadCancelled);
 }
+void QueueConsumer::set_busy_poll(bool enabled) noexcept {
+    p->busy_poll = enabled;
+}
+QueueStats QueueConsumer::stats() {
+    return p->stats();
+}
 QueueConsumer::QueueConsumer(std::unique_ptr<QueueInternal> p): p(std::move(p)) {
     auto ret = this->p->ref(false);
     uid = ret.first;
@@ -274,4 +1060,71 @@ QueueConsumer::~QueueConsumer() noexcept {
 }
 QueueConsumer::QueueConsumer(QueueConsumer&&) noexcept = default;
 
+
+int QueueSet::add(QueueConsumer& consumer) {
+    if (!consumer.p->has_slot()) {
+        throw std::runtime_error("QueueSet::add() consumer has no wait slot");
+    }
+    auto it = std::find(consumers.begin(), consumers.end(), nullptr);
+    if (it != consumers.end()) {
+        *it = &consumer;
+        return it - consumers.begin();
+    }
+    if (consumers.size() == max_consumers) {
+        throw std::length_error("QueueSet::add() set is full");
+    }
+    consumers.push_back(&consumer);
+    return consumers.size() - 1;
+}
+void QueueSet::remove(int index) {
+    consumers.at(index) = nullptr;
+}
+std::vector<int> QueueSet::wait(std::chrono::nanoseconds timeout) {
+    static_assert(max_consumers <= futex_wait_any_max, "QueueSet waits on all consumers at once");
+    const int count = consumers.size();
+    const auto deadline = timeout == std::chrono::nanoseconds::max() ? std::chrono::steady_clock::time_point::max()
+                                                                      : std::chrono::steady_clock::now() + timeout;
+    first = count ? (first + 1) % count : 0;
+
+    std::vector<int> ready;
+    std::atomic<uint32_t>* words[max_consumers];
+    uint32_t values[max_consumers];
+    bool armed[max_consumers] = {};
+    while (true) {
+        for (int n = 0; n < count; n++) {
+            const int i = (first + n) % count;
+            if (consumers[i] && consumers[i]->p->is_ready(consumers[i]->last_cancel_all)) {
+                ready.push_back(i);
+            }
+        }
+        if (!ready.empty() || std::chrono::steady_clock::now() >= deadline) {
+            return ready;
+        }
+
+        // wake can't be lost: slot's futex word is read under mutex, together with check
+        int waiting = 0;
+        bool skip = false;
+        for (int i = 0; i < count && !skip; i++) {
+            if (consumers[i]) {
+                auto& c = *consumers[i];
+                skip = c.p->arm(c.last_cancel_all, words[waiting], values[waiting]);
+                armed[i] = !skip;
+                waiting += armed[i];
+            }
+        }
+        if (!skip && !waiting) {
+            return ready; // nothing could wake us
+        }
+        if (!skip) {
+            const auto left = deadline - std::chrono::steady_clock::now();
+            futex_wait_any(words, values, waiting, deadline == std::chrono::steady_clock::time_point::max() ? std::chrono::nanoseconds::max() : left);
+        }
+        for (int i = 0; i < count; i++) {
+            if (std::exchange(armed[i], false)) {
+                consumers[i]->p->disarm();
+            }
+        }
+    }
+}
+
 } // namespace ipclib
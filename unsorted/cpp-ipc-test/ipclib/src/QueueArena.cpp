@@ -0,0 +1,396 @@
+#include "ipclib/QueueArena.h"
+#include "ipclib/SharedAllocator.h"
+#include "Futex.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <boost/interprocess/sync/interprocess_mutex.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
+
+using namespace boost::interprocess;
+
+namespace ipclib
+{
+
+/*
+
+	memory layout (all blocks are taken from SharedAllocator):
+	   Header, which is allocator root, followed by array of Entry (directory)
+	   queues, each is QueueBlock followed by ring of Record + bytes
+
+	Name is stored in first entry which isn't full starting from its home one (hash modulo
+	capacity), lookup stops at empty entry. Entries never become empty again, ones of removed
+	queues keep hash and are reused by insert.
+
+	Directory mutex protects directory and refcounts of all queues, so queue can't be removed
+	while it's being opened. Lock order is directory mutex, then queue mutex.
+
+	Ring is the same as lane of Queue, but protected by queue mutex, so any number of producers
+	and consumers can use it. Record which doesn't fit before the end of ring is preceded by
+	padding record, which is written as soon as it fits - writer then waits only for space for
+	the record itself, so any record up to capacity fits into empty ring. Waiters sleep on futex words, which are incremented under mutex: message on
+	write and cancel, space on read. Write wakes one consumer, cancel wakes all of them -
+	cancel flag is kept by consumer object, others just go back to sleep.
+
+*/
+
+class QueueArenaInternal {
+public:
+	static constexpr uint64_t magic = 0x6970636c69627161; // "ipclibqa"
+
+	struct Entry {
+		uint64_t hash; // 0 if empty
+		SharedAllocator::Handle queue; // null if removed
+		char name[QueueArena::max_name];
+	};
+	struct Header {
+		uint64_t magic;
+		interprocess_mutex mut;
+		uint64_t capacity; // power of two
+		uint64_t count; // entries with queue
+		uint64_t used; // entries which aren't empty
+	};
+	static constexpr size_t header_size = (sizeof(Header) + 63) / 64 * 64; // entries start here
+
+	SharedAllocator alloc;
+	Header* h;
+
+	QueueArenaInternal(SharedAllocator alloc): alloc(std::move(alloc)) {}
+
+	void create(size_t max_queues) {
+		uint64_t capacity = 8;
+		while (capacity < max_queues) {
+			capacity *= 2;
+		}
+		const auto handle = alloc.allocate(header_size + capacity * sizeof(Entry));
+		h = new(alloc.get(handle)) Header();
+		h->capacity = capacity;
+		h->count = 0;
+		h->used = 0;
+		std::memset(entries(), 0, capacity * sizeof(Entry));
+
+		h->magic = magic;
+		alloc.set_root(handle);
+	}
+	void attach() {
+		const auto handle = alloc.root();
+		h = handle ? alloc.get<Header>(handle) : nullptr;
+		if (!h || h->magic != magic) {
+			throw std::runtime_error("QueueArena::attach() segment has no arena");
+		}
+	}
+
+	Entry* entries() {
+		return static_cast<Entry*>(static_cast<void*>(reinterpret_cast<uint8_t*>(h) + header_size));
+	}
+
+	static uint64_t hash_name(const std::string& name) {
+		uint64_t hash = 0xcbf29ce484222325; // FNV-1a
+		for (char c : name) {
+			hash = (hash ^ uint8_t(c)) * 0x100000001b3;
+		}
+		return hash ? hash : 1;
+	}
+
+	// returns entry with queue of that name or null, and where it can be inserted otherwise;
+	// mutex must be locked
+	Entry* find(const std::string& name, uint64_t hash, Entry** insert_at) {
+		*insert_at = nullptr;
+		for (uint64_t n = 0; n < h->capacity; n++) {
+			Entry& e = entries()[(hash + n) & (h->capacity - 1)];
+			if (!e.hash) {
+				if (!*insert_at) {
+					*insert_at = &e;
+				}
+				return nullptr;
+			}
+			if (!e.queue) {
+				if (!*insert_at) {
+					*insert_at = &e;
+				}
+			}
+			else if (e.hash == hash && name == e.name) {
+				return &e;
+			}
+		}
+		return nullptr;
+	}
+};
+
+
+class ArenaQueueInternal {
+public:
+	using ReadRet = QueueConsumer::ReadRet;
+
+	struct QueueBlock {
+		interprocess_mutex mut;
+		std::atomic<uint32_t> message{0}; // futex, incremented on write and cancel
+		std::atomic<uint32_t> space{0}; // futex, incremented on read
+		uint32_t message_waiters = 0;
+		uint32_t space_waiters = 0;
+		uint64_t head = 0; // byte counters, never wrap
+		uint64_t tail = 0;
+		uint64_t capacity;
+
+		// protected by directory mutex
+		int ref_producers = 0;
+		int ref_consumers = 0;
+
+		// cancel all
+		uint64_t cancel_all_counter = 0; // used to detect new event
+		ReadRet cancel_all = ReadRet::ReadOk;
+	};
+	static_assert(std::atomic<uint32_t>::is_always_lock_free, "atomics must be lock-free to be shared between processes");
+	static constexpr size_t block_size = (sizeof(QueueBlock) + 63) / 64 * 64; // ring starts here
+
+	// message header
+	struct Record {
+		uint64_t size; // byte size of message or pad_record
+	};
+	static constexpr uint64_t pad_record = ~uint64_t(0); // rest of the ring is unused
+	static constexpr size_t record_align = sizeof(Record);
+
+	ArenaQueueInternal(QueueArenaInternal& arena, bool is_producer): arena(arena), is_producer(is_producer) {}
+
+	void open(const std::string& name, bool create, size_t capacity, bool allow_existing) {
+		if (name.size() >= QueueArena::max_name) {
+			throw std::invalid_argument("ArenaQueue::open() name is too long");
+		}
+		const uint64_t hash = QueueArenaInternal::hash_name(name);
+
+		auto h = arena.h;
+		scoped_lock<interprocess_mutex> lock(h->mut);
+
+		QueueArenaInternal::Entry* insert_at;
+		auto e = arena.find(name, hash, &insert_at);
+		if (e && create && !allow_existing) {
+			throw std::runtime_error("ArenaQueue::create() queue already exists");
+		}
+		if (!e && !create) {
+			throw std::runtime_error("ArenaQueue::open() queue doesn't exist");
+		}
+		if (!e) {
+			if (!insert_at || (!insert_at->hash && h->used == h->capacity - 1)) { // keep one empty entry, so lookup stops
+				throw std::length_error("ArenaQueue::create() directory is full");
+			}
+			capacity = std::max<size_t>(capacity / record_align * record_align, 2 * record_align);
+			capacity = SharedAllocator::usable_size(block_size + capacity) - block_size; // rest of block would be wasted
+			const auto handle = arena.alloc.allocate(block_size + capacity);
+			auto block = new(arena.alloc.get(handle)) QueueBlock();
+			block->capacity = capacity;
+
+			h->used += insert_at->hash ? 0 : 1;
+			h->count += 1;
+			e = insert_at;
+			e->hash = hash;
+			e->queue = handle;
+			std::memcpy(e->name, name.c_str(), name.size() + 1);
+		}
+
+		entry = e;
+		q = arena.alloc.get<QueueBlock>(e->queue);
+		ring = reinterpret_cast<uint8_t*>(q) + block_size;
+		(is_producer ? q->ref_producers : q->ref_consumers) += 1;
+		last_cancel_all = q->cancel_all_counter;
+	}
+	void close() {
+		scoped_lock<interprocess_mutex> lock(arena.h->mut);
+		{
+			scoped_lock<interprocess_mutex> queue_lock(q->mut);
+			(is_producer ? q->ref_producers : q->ref_consumers) -= 1;
+			if (!q->ref_producers) {
+				q->cancel_all_counter += 1;
+				q->cancel_all = ReadRet::ReadNoProducersLeft;
+				wake_all_consumers();
+			}
+		}
+		if (!q->ref_producers && !q->ref_consumers) {
+			arena.alloc.deallocate(entry->queue);
+			entry->queue = SharedAllocator::null;
+			arena.h->count -= 1;
+		}
+	}
+
+	void write(const std::function<void(void *mem)>& writer, size_t size) {
+		const uint64_t record = sizeof(Record) + (size + record_align - 1) / record_align * record_align;
+		if (record > q->capacity) {
+			throw std::length_error("ArenaQueueProducer::write() message is bigger than queue");
+		}
+
+		scoped_lock<interprocess_mutex> lock(q->mut);
+
+		// record must be contiguous, so skip the end of ring if it doesn't fit
+		while (true) {
+			const uint64_t left = q->capacity - q->tail % q->capacity;
+			const uint64_t free = q->capacity - (q->tail - q->head);
+			if (left < record && free >= left) {
+				record_at(q->tail)->size = pad_record;
+				if (q->head == q->tail) {
+					q->head += left; // nothing to read before padding
+				}
+				q->tail += left;
+				continue;
+			}
+			if (left >= record && free >= record) {
+				break;
+			}
+			q->space_waiters += 1;
+			const uint32_t word = q->space.load();
+			lock.unlock();
+			futex_wait(q->space, word);
+			lock.lock();
+			q->space_waiters -= 1;
+		}
+
+		auto r = record_at(q->tail);
+		r->size = size;
+		writer(r + 1);
+		q->tail += record;
+
+		q->message += 1;
+		if (q->message_waiters) {
+			futex_wake(q->message, 1);
+		}
+	}
+	ReadRet read(const std::function<void(const void *mem, size_t size)>& reader) {
+		scoped_lock<interprocess_mutex> lock(q->mut);
+		while (true) {
+			if (q->head != q->tail && record_at(q->head)->size == pad_record) {
+				// writer may still wait for space for the record after it
+				q->head += q->capacity - q->head % q->capacity;
+				wake_producers();
+			}
+			if (q->head != q->tail) {
+				break;
+			}
+			if (auto ret = static_cast<ReadRet>(cancel.exchange(ReadRet::ReadOk))) {
+				return ret;
+			}
+			if (q->cancel_all_counter != last_cancel_all) {
+				// another cancel_all event has happened since last one or object creation
+				last_cancel_all = q->cancel_all_counter;
+				return q->cancel_all;
+			}
+			q->message_waiters += 1;
+			const uint32_t word = q->message.load();
+			lock.unlock();
+			futex_wait(q->message, word);
+			lock.lock();
+			q->message_waiters -= 1;
+		}
+
+		auto r = record_at(q->head);
+		reader(r + 1, r->size);
+		q->head += sizeof(Record) + (r->size + record_align - 1) / record_align * record_align;
+		wake_producers();
+		return ReadRet::ReadOk;
+	}
+	void cancel_read(ReadRet reason) {
+		scoped_lock<interprocess_mutex> lock(q->mut);
+		int expected = ReadRet::ReadOk; // if not, previous one wasn't consumed yet
+		cancel.compare_exchange_strong(expected, reason);
+		wake_all_consumers();
+	}
+
+private:
+	QueueArenaInternal& arena;
+	const bool is_producer;
+	QueueArenaInternal::Entry* entry;
+	QueueBlock* q;
+	uint8_t* ring;
+
+	uint64_t last_cancel_all;
+	std::atomic<int> cancel{ReadRet::ReadOk}; // set by cancel_read(), possibly from another thread
+
+	Record* record_at(uint64_t pos) {
+		return static_cast<Record*>(static_cast<void*>(ring + pos % q->capacity));
+	}
+	// queue mutex must be locked
+	void wake_producers() {
+		q->space += 1;
+		if (q->space_waiters) {
+			futex_wake(q->space);
+		}
+	}
+	// queue mutex must be locked
+	void wake_all_consumers() {
+		q->message += 1;
+		if (q->message_waiters) {
+			futex_wake(q->message);
+		}
+	}
+};
+
+
+QueueArena QueueArena::create(SharedMemory& shm, size_t max_queues) {
+	auto p = std::make_unique<QueueArenaInternal>(SharedAllocator::create(shm));
+	p->create(max_queues);
+	return QueueArena(std::move(p));
+}
+QueueArena QueueArena::attach(SharedMemory& shm) {
+	auto p = std::make_unique<QueueArenaInternal>(SharedAllocator::attach(shm));
+	p->attach();
+	return QueueArena(std::move(p));
+}
+size_t QueueArena::size() noexcept {
+	scoped_lock<interprocess_mutex> lock(p->h->mut);
+	return p->h->count;
+}
+QueueArena::QueueArena(std::unique_ptr<QueueArenaInternal> p): p(std::move(p)) {
+}
+QueueArena::~QueueArena() noexcept = default;
+QueueArena::QueueArena(QueueArena&&) noexcept = default;
+
+
+static std::unique_ptr<ArenaQueueInternal> open_arena_queue(QueueArenaInternal& arena, bool is_producer, const std::string& name, bool create, size_t capacity, bool allow_existing) {
+	auto p = std::make_unique<ArenaQueueInternal>(arena, is_producer);
+	p->open(name, create, capacity, allow_existing);
+	return p;
+}
+
+
+void ArenaQueueProducer::write_message(std::function<void(void *mem)> writer, size_t size) {
+	p->write(writer, size);
+}
+ArenaQueueProducer ArenaQueueProducer::create(QueueArena& arena, const std::string& name, size_t capacity, bool allow_existing) {
+	return ArenaQueueProducer(open_arena_queue(*arena.p, true, name, true, capacity, allow_existing));
+}
+ArenaQueueProducer ArenaQueueProducer::open(QueueArena& arena, const std::string& name) {
+	return ArenaQueueProducer(open_arena_queue(*arena.p, true, name, false, 0, false));
+}
+ArenaQueueProducer::ArenaQueueProducer(std::unique_ptr<ArenaQueueInternal> p): p(std::move(p)) {
+}
+ArenaQueueProducer::~ArenaQueueProducer() noexcept {
+	if (p) {
+		p->close();
+	}
+}
+ArenaQueueProducer::ArenaQueueProducer(ArenaQueueProducer&&) noexcept = default;
+
+
+ArenaQueueConsumer::ReadRet ArenaQueueConsumer::read_message(std::function<void(const void *mem, size_t size)> reader) {
+	return p->read(reader);
+}
+void ArenaQueueConsumer::cancel_read() {
+	p->cancel_read(ReadRet::ReadCancelled);
+}
+ArenaQueueConsumer ArenaQueueConsumer::create(QueueArena& arena, const std::string& name, size_t capacity, bool allow_existing) {
+	return ArenaQueueConsumer(open_arena_queue(*arena.p, false, name, true, capacity, allow_existing));
+}
+ArenaQueueConsumer ArenaQueueConsumer::open(QueueArena& arena, const std::string& name) {
+	return ArenaQueueConsumer(open_arena_queue(*arena.p, false, name, false, 0, false));
+}
+ArenaQueueConsumer::ArenaQueueConsumer(std::unique_ptr<ArenaQueueInternal> p): p(std::move(p)) {
+}
+ArenaQueueConsumer::~ArenaQueueConsumer() noexcept {
+	if (p) {
+		p->cancel_read(ReadRet::ReadDestroyed);
+		p->close();
+	}
+}
+ArenaQueueConsumer::ArenaQueueConsumer(ArenaQueueConsumer&&) noexcept = default;
+
+} // namespace ipclib
@@ -0,0 +1,190 @@
+#include "RpcInternal.h"
+
+#include <map>
+#include <mutex>
+
+using namespace boost::interprocess;
+
+namespace ipclib
+{
+
+// Goodbye reaches only one of servers reading the same queue, and isn't sent by crashed client -
+// so objects removed by clients are also forgotten when new client appears
+class RpcServer::Targets {
+public:
+    // Returns null if object with this name belongs to another client now
+    std::shared_ptr<RpcReplySlots> get(const std::string& name, uint64_t nonce) {
+        std::unique_lock<std::mutex> lock(mut);
+        auto it = targets.find(name);
+        if (it != targets.end() && it->second->sync().nonce == nonce) {
+            return it->second;
+        }
+        if (it != targets.end()) {
+            targets.erase(it);
+        }
+        else {
+            remove_stale();
+        }
+        auto target = std::make_shared<RpcReplySlots>();
+        target->open(name);
+        if (target->sync().nonce != nonce) {
+            return {}; // request is from previous client, which is gone
+        }
+        targets.emplace(name, target);
+        return target;
+    }
+    void remove(const std::string& name) {
+        std::unique_lock<std::mutex> lock(mut);
+        targets.erase(name);
+    }
+
+private:
+    std::mutex mut;
+    std::map<std::string, std::shared_ptr<RpcReplySlots>> targets;
+    
+    // mutex must be locked
+    void remove_stale() {
+        for (auto it = targets.begin(); it != targets.end();) {
+            if (it->second->is_removed()) {
+                it = targets.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+    }
+};
+
+
+RpcClient::CallId RpcClient::send(std::function<void(void *mem)> writer, size_t size) {
+    return p->send(writer, size, true);
+}
+std::error_code RpcClient::receive(CallId call, std::function<void(const void *mem, size_t size)> reader, std::chrono::milliseconds timeout) {
+    return p->receive(call, reader, timeout, true);
+}
+std::error_code RpcClient::call(const void *request, size_t size, std::function<void(const void *mem, size_t size)> reader, std::chrono::milliseconds timeout) {
+    auto id = send([&](void *mem){
+        std::memcpy(mem, request, size);
+    }, size);
+    return receive(id, std::move(reader), timeout);
+}
+RpcClient RpcClient::connect(const std::string& server_name, const RpcOptions& options) {
+    return RpcClient(std::make_unique<RpcClientInternal>(server_name, options));
+}
+RpcClient::~RpcClient() noexcept = default;
+RpcClient::RpcClient(RpcClient&&) noexcept = default;
+RpcClient::RpcClient(std::unique_ptr<RpcClientInternal> p): p(std::move(p)) {}
+
+
+const void *RpcRequest::data() const noexcept {
+    return request.data();
+}
+size_t RpcRequest::size() const noexcept {
+    return request.size();
+}
+void RpcRequest::reply(std::function<void(void *mem)> writer, size_t size) {
+    if (!target) {
+        throw std::logic_error("RpcRequest::reply() already replied");
+    }
+    auto t = std::move(target);
+    if (size > t->sync().slot_size) {
+        t->reply(call, nullptr, 0, std::make_error_code(std::errc::message_size));
+        throw std::length_error("RpcRequest::reply() reply is bigger than slot size");
+    }
+    t->reply(call, &writer, size, {});
+}
+void RpcRequest::reply(const void *data, size_t size) {
+    reply([&](void *mem){
+        std::memcpy(mem, data, size);
+    }, size);
+}
+void RpcRequest::reply(std::error_code error) {
+    if (!target) {
+        throw std::logic_error("RpcRequest::reply() already replied");
+    }
+    std::move(target)->reply(call, nullptr, 0, error);
+}
+RpcRequest::RpcRequest() noexcept = default;
+RpcRequest::~RpcRequest() noexcept {
+    if (target) {
+        try {
+            reply(std::make_error_code(std::errc::operation_canceled));
+        }
+        catch (std::exception&) {}
+    }
+}
+RpcRequest::RpcRequest(RpcRequest&&) noexcept = default;
+RpcRequest& RpcRequest::operator=(RpcRequest&& other) noexcept {
+    if (this != &other) {
+        RpcRequest old(std::move(*this)); // cancels previous request, if it wasn't replied
+        request = std::move(other.request);
+        target = std::move(other.target);
+        call = other.call;
+    }
+    return *this;
+}
+
+
+QueueConsumer::ReadRet RpcServer::receive(RpcRequest& request) {
+    while (true) {
+        RpcReplySlots::RequestHeader header;
+        std::vector<uint8_t> data;
+        bool malformed = false;
+        auto ret = q.read_message([&](const void *mem, size_t size){
+            if (size < sizeof(header)) {
+                malformed = true; // not written by RpcClient
+                return;
+            }
+            // copy, so request isn't handled under queue lock
+            std::memcpy(&header, mem, sizeof(header));
+            auto bytes = static_cast<const uint8_t*>(mem) + sizeof(header);
+            data.assign(bytes, bytes + size - sizeof(header));
+        });
+        if (ret == QueueConsumer::ReadNoProducersLeft) {
+            continue; // all clients disconnected, new ones may come
+        }
+        if (ret != QueueConsumer::ReadOk) {
+            return ret;
+        }
+        if (malformed) {
+            continue; // there is nobody to reply to
+        }
+
+        std::string name(header.reply_name, strnlen(header.reply_name, sizeof(header.reply_name)));
+        if (!header.call) {
+            targets->remove(name);
+            continue;
+        }
+
+        std::shared_ptr<RpcReplySlots> target;
+        try {
+            target = targets->get(name, header.nonce);
+        }
+        catch (interprocess_exception&) {
+            continue; // client is already destroyed
+        }
+        if (!target) {
+            continue;
+        }
+
+        request = RpcRequest();
+        request.request = std::move(data);
+        request.target = std::move(target);
+        request.call = header.call;
+        return QueueConsumer::ReadOk;
+    }
+}
+void RpcServer::cancel_receive() {
+    q.cancel_read();
+}
+RpcServer RpcServer::create(const std::string& name, bool allow_existing) {
+    return RpcServer(QueueConsumer::create(name, allow_existing));
+}
+RpcServer RpcServer::open(const std::string& name) {
+    return RpcServer(QueueConsumer::open(name));
+}
+RpcServer::~RpcServer() noexcept = default;
+RpcServer::RpcServer(RpcServer&&) noexcept = default;
+RpcServer::RpcServer(QueueConsumer q): q(std::move(q)), targets(std::make_unique<Targets>()) {}
+
+} // namespace ipclib
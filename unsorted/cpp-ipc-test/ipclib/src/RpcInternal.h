@@ -0,0 +1,316 @@
+// Reply slots shared by RpcClient and RpcServer
+
+#pragma once
+
+#include "ipclib/Rpc.h"
+
+#include <atomic>
+#include <cstring>
+#include <random>
+#include <sys/stat.h>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/interprocess/detail/os_thread_functions.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/interprocess/sync/interprocess_condition.hpp>
+#include <boost/interprocess/sync/interprocess_mutex.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
+
+namespace ipclib
+{
+
+/*
+
+	memory layout:
+	   Sync object
+	   Slot objects
+	   reply bytes, slot_size for each slot
+	
+	Client takes free slot, sets it pending with new call ID and sends request,
+	which contains call ID and name of this shm object.
+	Server marks slot as being written only if it's still pending for the same call
+	(caller may have timed out and reused it), writes reply without lock and marks it done.
+	
+	Call ID is (sequence number << slot_bits) | slot index.
+	
+	Names are reused (they contain client PID), so request also carries random nonce
+	stored in Sync; server reopens cached object if nonce doesn't match.
+
+*/
+
+class RpcReplySlots {
+public:
+    enum SlotState {
+        SlotFree,
+        SlotPending, // request sent
+        SlotWriting, // server writes reply
+        SlotDone // reply can be read
+    };
+    struct Slot {
+        uint64_t call = 0; // ID of current call
+        SlotState state = SlotFree;
+        size_t size = 0;
+        int error = 0; // std::errc value
+        boost::interprocess::interprocess_condition done;
+    };
+    struct Sync {
+        boost::interprocess::interprocess_mutex mut;
+        boost::interprocess::interprocess_condition any_done; // for waiting on all slots at once
+        boost::interprocess::interprocess_condition slot_free;
+        int slot_count = 0;
+        size_t slot_size = 0;
+        uint64_t call_counter = 0;
+        uint64_t nonce = 0; // random, set on creation
+    };
+
+    static constexpr int slot_bits = 16;
+    static constexpr int max_slots = 1 << slot_bits;
+
+    // message header in request queue
+    struct RequestHeader {
+        uint64_t call; // 0 if client disconnects
+        uint64_t nonce; // Sync::nonce of this object
+        char reply_name[128]; // name of this object
+    };
+
+    std::string name;
+
+    void create(const std::string& name, const RpcOptions& options) {
+        if (options.slots <= 0 || options.slots > max_slots) {
+            throw std::invalid_argument("RpcClient::connect() invalid slot count");
+        }
+        if (name.size() >= sizeof(RequestHeader::reply_name)) {
+            throw std::invalid_argument("RpcClient::connect() server name is too long");
+        }
+        this->name = name;
+        shm = boost::interprocess::shared_memory_object(boost::interprocess::create_only, name.c_str(), boost::interprocess::read_write);
+        shm.truncate(sizeof(Sync) + options.slots * (sizeof(Slot) + options.slot_size));
+        region = boost::interprocess::mapped_region(shm, boost::interprocess::read_write);
+
+        auto s = new(region.get_address()) Sync();
+        s->slot_count = options.slots;
+        s->slot_size = options.slot_size;
+        std::random_device random;
+        s->nonce = (uint64_t(random()) << 32) ^ random();
+        for (int i = 0; i < options.slots; i++) {
+            new(&slot(i)) Slot();
+        }
+    }
+    void open(const std::string& name) {
+        this->name = name;
+        shm = boost::interprocess::shared_memory_object(boost::interprocess::open_only, name.c_str(), boost::interprocess::read_write);
+        region = boost::interprocess::mapped_region(shm, boost::interprocess::read_write);
+    }
+
+    Sync& sync() {
+        return *static_cast<Sync*>(region.get_address());
+    }
+    Slot& slot(int index) {
+        return static_cast<Slot*>(static_cast<void*>(&sync() + 1))[index];
+    }
+    uint8_t* data(int index) {
+        return static_cast<uint8_t*>(static_cast<void*>(&slot(sync().slot_count))) + index * sync().slot_size;
+    }
+    // true if object was removed by client, so it's only kept alive by this mapping
+    bool is_removed() {
+        struct stat st;
+        return fstat(shm.get_mapping_handle().handle, &st) == 0 && st.st_nlink == 0;
+    }
+    static int slot_index(uint64_t call) {
+        return static_cast<int>(call & (max_slots - 1));
+    }
+
+    // server side; writer may be null. Reply is dropped if caller doesn't wait for it anymore
+    void reply(uint64_t call, const std::function<void(void *mem)>* writer, size_t size, std::error_code error) {
+        using namespace boost::interprocess;
+        const int index = slot_index(call);
+        if (index >= sync().slot_count) {
+            return;
+        }
+        Slot& s = slot(index);
+        {
+            scoped_lock<interprocess_mutex> lock(sync().mut);
+            if (s.call != call || s.state != SlotPending) {
+                return;
+            }
+            s.state = SlotWriting;
+        }
+
+        auto finish = [&]{
+            scoped_lock<interprocess_mutex> lock(sync().mut);
+            s.size = error ? 0 : size;
+            s.error = error.value();
+            s.state = SlotDone;
+            s.done.notify_one();
+            sync().any_done.notify_all();
+        };
+
+        if (!error && size > sync().slot_size) {
+            error = std::make_error_code(std::errc::message_size);
+        }
+        if (!error && writer) {
+            try {
+                (*writer)(data(index));
+            }
+            catch (...) {
+                error = std::make_error_code(std::errc::io_error);
+                finish();
+                throw;
+            }
+        }
+        finish();
+    }
+
+private:
+    boost::interprocess::shared_memory_object shm;
+    boost::interprocess::mapped_region region;
+};
+
+
+class RpcClientInternal {
+public:
+    RpcReplySlots slots;
+    QueueProducer q;
+
+    RpcClientInternal(const std::string& server_name, const RpcOptions& options)
+        : q(QueueProducer::open(server_name))
+    {
+        static std::atomic<uint64_t> counter{0};
+        slots.create(server_name + "_rpc_" + std::to_string(boost::interprocess::ipcdetail::get_current_process_id())
+                     + "_" + std::to_string(counter++), options);
+    }
+    ~RpcClientInternal() {
+        try {
+            write_header(0, [](void*){}, 0); // so server can forget about us
+        }
+        catch (std::exception&) {
+            // server is gone anyway
+        }
+        boost::interprocess::shared_memory_object::remove(slots.name.c_str());
+    }
+
+    // returns 0 if all slots are in use and wait is false
+    uint64_t send(const std::function<void(void *mem)>& writer, size_t size, bool wait) {
+        using namespace boost::interprocess;
+        auto& sync = slots.sync();
+        uint64_t call = 0;
+        {
+            scoped_lock<interprocess_mutex> lock(sync.mut);
+            while (true) {
+                for (int i = 0; i < sync.slot_count; i++) {
+                    auto& s = slots.slot(i);
+                    if (s.state == RpcReplySlots::SlotFree) {
+                        call = (++sync.call_counter << RpcReplySlots::slot_bits) | i;
+                        s.call = call;
+                        s.state = RpcReplySlots::SlotPending;
+                        break;
+                    }
+                }
+                if (call || !wait) {
+                    break;
+                }
+                sync.slot_free.wait(lock);
+            }
+        }
+        if (!call) {
+            return 0;
+        }
+
+        try {
+            write_header(call, writer, size);
+        }
+        catch (...) {
+            scoped_lock<interprocess_mutex> lock(sync.mut);
+            free_slot(slots.slot(RpcReplySlots::slot_index(call)));
+            throw;
+        }
+        return call;
+    }
+
+    // returns std::errc::resource_unavailable_try_again if reply isn't ready and wait is false
+    std::error_code receive(uint64_t call, const std::function<void(const void *mem, size_t size)>& reader,
+                            std::chrono::milliseconds timeout, bool wait) {
+        using namespace boost::interprocess;
+        auto& sync = slots.sync();
+        const int index = RpcReplySlots::slot_index(call);
+        if (index >= sync.slot_count) {
+            return std::make_error_code(std::errc::invalid_argument);
+        }
+        auto& s = slots.slot(index);
+
+        scoped_lock<interprocess_mutex> lock(sync.mut);
+        const auto deadline = boost::posix_time::microsec_clock::universal_time()
+            + boost::posix_time::milliseconds(timeout == RpcClient::no_timeout ? 0 : timeout.count());
+        while (s.call == call && s.state != RpcReplySlots::SlotDone) {
+            if (!wait) {
+                return std::make_error_code(std::errc::resource_unavailable_try_again);
+            }
+            if (timeout == RpcClient::no_timeout || s.state == RpcReplySlots::SlotWriting) {
+                s.done.wait(lock); // reply is being written, so it won't take long
+            }
+            else if (!s.done.timed_wait(lock, deadline) && s.state == RpcReplySlots::SlotPending) {
+                free_slot(s);
+                return std::make_error_code(std::errc::timed_out);
+            }
+        }
+        if (s.call != call) {
+            return std::make_error_code(std::errc::invalid_argument); // already received or timed out
+        }
+
+        // server doesn't touch done slot, so it can be read without lock
+        std::error_code error(s.error, std::generic_category());
+        lock.unlock();
+        struct Free {
+            RpcClientInternal& self;
+            RpcReplySlots::Slot& s;
+            ~Free() {
+                scoped_lock<interprocess_mutex> lock(self.slots.sync().mut);
+                self.free_slot(s);
+            }
+        } free{*this, s};
+        if (!error) {
+            reader(slots.data(index), s.size);
+        }
+        return error;
+    }
+
+    // waits until some reply is ready or wake() returns true; wake is checked under slot mutex
+    void wait_any(const std::function<bool()>& wake) {
+        using namespace boost::interprocess;
+        auto& sync = slots.sync();
+        scoped_lock<interprocess_mutex> lock(sync.mut);
+        while (!wake()) {
+            for (int i = 0; i < sync.slot_count; i++) {
+                if (slots.slot(i).state == RpcReplySlots::SlotDone) {
+                    return;
+                }
+            }
+            sync.any_done.wait(lock);
+        }
+    }
+    void notify_any() {
+        using namespace boost::interprocess;
+        scoped_lock<interprocess_mutex> lock(slots.sync().mut);
+        slots.sync().any_done.notify_all();
+    }
+
+private:
+    void write_header(uint64_t call, const std::function<void(void *mem)>& writer, size_t size) {
+        q.write_message([&](void *mem){
+            auto header = static_cast<RpcReplySlots::RequestHeader*>(mem);
+            header->call = call;
+            header->nonce = slots.sync().nonce;
+            std::memset(header->reply_name, 0, sizeof(header->reply_name));
+            std::memcpy(header->reply_name, slots.name.data(), slots.name.size());
+            writer(header + 1);
+        }, sizeof(RpcReplySlots::RequestHeader) + size);
+    }
+    // slot mutex must be locked
+    void free_slot(RpcReplySlots::Slot& s) {
+        s.call = 0;
+        s.state = RpcReplySlots::SlotFree;
+        slots.sync().slot_free.notify_one();
+    }
+};
+
+} // namespace ipclib
@@ -0,0 +1,263 @@
+#include "ipclib/SharedAllocator.h"
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+namespace ipclib
+{
+
+/*
+
+	memory layout:
+	   Header object
+	   page classes, one byte per page (class + 1 of block starting at the page, 0 if unused)
+	   pages
+	
+	Free list heads are tagged offsets: tag in high bits is incremented on each change,
+	so CAS fails if list was modified between reading head and its next pointer (ABA).
+	Next pointer of free block is stored in its first 8 bytes.
+	
+	Pages are taken by bumping next_page; small blocks are carved from single page,
+	which is then pushed to free list as a chain with single CAS.
+
+*/
+
+class SharedAllocatorInternal {
+public:
+	static constexpr uint64_t magic = 0x6970636c69626131; // "ipcliba1"
+	static constexpr int min_shift = 4; // smallest block is 16 bytes
+	static constexpr int num_classes = 36;
+	static constexpr int offset_bits = 36; // offset in 16-byte units, up to 1 TB
+	static constexpr uint64_t offset_mask = (uint64_t(1) << offset_bits) - 1;
+	
+	struct Header {
+		std::atomic<uint64_t> magic{0}; // set last
+		uint64_t page_size;
+		uint64_t page_count;
+		std::atomic<uint64_t> next_page;
+		std::atomic<uint64_t> free_heads[num_classes];
+		std::atomic<uint64_t> root;
+	};
+	static_assert(std::atomic<uint64_t>::is_always_lock_free, "atomics must be lock-free to be shared between processes");
+	
+	SharedAllocatorInternal(SharedMemory& shm, int magazine_size): shm(shm), magazine_size(magazine_size) {
+		if (magazine_size > 0) {
+			magazines.resize(num_classes);
+		}
+	}
+	~SharedAllocatorInternal() {
+		for (int c = 0; c < static_cast<int>(magazines.size()); c++) {
+			flush(c, magazines[c].size());
+		}
+	}
+	
+	void create(size_t page_size) {
+		if (page_size < 64 || (page_size & (page_size - 1))) {
+			throw std::invalid_argument("SharedAllocator::create() page size must be power of two, at least 64");
+		}
+		
+		auto lock = shm.write_lock();
+		const uint64_t page_count = lock.size() / page_size;
+		const uint64_t first_page = (sizeof(Header) + page_count + page_size - 1) / page_size;
+		if (lock.size() > (offset_mask << min_shift)) {
+			throw std::invalid_argument("SharedAllocator::create() segment is too big");
+		}
+		if (first_page >= page_count) {
+			throw std::invalid_argument("SharedAllocator::create() segment is too small");
+		}
+		
+		auto h = new(lock.data()) Header();
+		h->page_size = page_size;
+		h->page_count = page_count;
+		h->next_page = first_page;
+		for (auto& head : h->free_heads) {
+			head = 0;
+		}
+		h->root = 0;
+		std::fill(page_class(), page_class() + page_count, 0);
+		h->magic.store(magic, std::memory_order_release);
+	}
+	void attach() {
+		auto lock = shm.read_lock();
+		if (lock.size() < sizeof(Header) || header().magic.load(std::memory_order_acquire) != magic) {
+			throw std::runtime_error("SharedAllocator::attach() segment has no allocator");
+		}
+	}
+	
+	uint8_t* base() const {
+		return shm.data();
+	}
+	Header& header() const {
+		return *static_cast<Header*>(static_cast<void*>(base()));
+	}
+	
+	static int size_class(size_t size) {
+		int c = 0;
+		while ((uint64_t(1) << (c + min_shift)) < size) {
+			c++;
+		}
+		if (c >= num_classes) {
+			throw std::bad_alloc();
+		}
+		return c;
+	}
+	
+	SharedAllocator::Handle allocate(size_t size) {
+		const int c = size_class(size);
+		if (!magazines.empty()) {
+			auto& m = magazines[c];
+			if (m.empty()) {
+				for (int i = 0; i < magazine_size / 2 + 1; i++) {
+					auto offset = pop(c);
+					if (!offset) {
+						break;
+					}
+					m.push_back(offset);
+				}
+			}
+			if (!m.empty()) {
+				auto offset = m.back();
+				m.pop_back();
+				return offset;
+			}
+		}
+		else if (auto offset = pop(c)) {
+			return offset;
+		}
+		return allocate_pages(c);
+	}
+	void deallocate(SharedAllocator::Handle handle) {
+		if (!handle) {
+			return;
+		}
+		const int c = page_class()[handle / header().page_size] - 1;
+		if (!magazines.empty()) {
+			auto& m = magazines[c];
+			if (static_cast<int>(m.size()) >= magazine_size) {
+				flush(c, m.size() / 2 + 1);
+			}
+			m.push_back(handle);
+			return;
+		}
+		push(c, handle, handle);
+	}
+	
+private:
+	SharedMemory& shm;
+	int magazine_size;
+	std::vector<std::vector<uint64_t>> magazines; // free blocks owned by this object, for each class
+	
+	uint8_t* page_class() const {
+		return base() + sizeof(Header);
+	}
+	std::atomic<uint64_t>& next_of(uint64_t offset) const {
+		return *static_cast<std::atomic<uint64_t>*>(static_cast<void*>(base() + offset));
+	}
+	
+	uint64_t pop(int c) {
+		auto& head = header().free_heads[c];
+		uint64_t old = head.load(std::memory_order_acquire);
+		while (true) {
+			const uint64_t offset = (old & offset_mask) << min_shift;
+			if (!offset) {
+				return 0;
+			}
+			// block may be already taken and overwritten by now, but then CAS fails
+			const uint64_t next = next_of(offset).load(std::memory_order_relaxed);
+			const uint64_t tagged = (((old >> offset_bits) + 1) << offset_bits) | (next >> min_shift);
+			if (head.compare_exchange_weak(old, tagged, std::memory_order_acquire, std::memory_order_acquire)) {
+				return offset;
+			}
+		}
+	}
+	// pushes chain of blocks linked by next pointers
+	void push(int c, uint64_t first, uint64_t last) {
+		auto& head = header().free_heads[c];
+		uint64_t old = head.load(std::memory_order_relaxed);
+		while (true) {
+			next_of(last).store((old & offset_mask) << min_shift, std::memory_order_relaxed);
+			const uint64_t tagged = (((old >> offset_bits) + 1) << offset_bits) | (first >> min_shift);
+			if (head.compare_exchange_weak(old, tagged, std::memory_order_release, std::memory_order_relaxed)) {
+				return;
+			}
+		}
+	}
+	// returns count blocks from magazine to free list
+	void flush(int c, size_t count) {
+		auto& m = magazines[c];
+		if (!count) {
+			return;
+		}
+		const size_t begin = m.size() - count;
+		for (size_t i = begin; i + 1 < m.size(); i++) {
+			next_of(m[i]).store(m[i + 1], std::memory_order_relaxed);
+		}
+		push(c, m[begin], m.back());
+		m.resize(begin);
+	}
+	
+	uint64_t allocate_pages(int c) {
+		auto& h = header();
+		const uint64_t block = uint64_t(1) << (c + min_shift);
+		const uint64_t count = (block + h.page_size - 1) / h.page_size;
+		
+		uint64_t page = h.next_page.load();
+		do {
+			if (page + count > h.page_count) {
+				throw std::bad_alloc();
+			}
+		}
+		while (!h.next_page.compare_exchange_weak(page, page + count));
+		
+		page_class()[page] = static_cast<uint8_t>(c + 1);
+		const uint64_t offset = page * h.page_size;
+		
+		// carve the rest of the page into free blocks
+		const uint64_t blocks = h.page_size / block;
+		if (blocks > 1) {
+			for (uint64_t i = 1; i + 1 < blocks; i++) {
+				next_of(offset + i * block).store(offset + (i + 1) * block, std::memory_order_relaxed);
+			}
+			push(c, offset + block, offset + (blocks - 1) * block);
+		}
+		return offset;
+	}
+};
+
+
+SharedAllocator SharedAllocator::create(SharedMemory& shm, size_t page_size, int magazine_size) {
+	auto p = std::make_unique<SharedAllocatorInternal>(shm, magazine_size);
+	p->create(page_size);
+	return SharedAllocator(std::move(p));
+}
+SharedAllocator SharedAllocator::attach(SharedMemory& shm, int magazine_size) {
+	auto p = std::make_unique<SharedAllocatorInternal>(shm, magazine_size);
+	p->attach();
+	return SharedAllocator(std::move(p));
+}
+SharedAllocator::Handle SharedAllocator::allocate(size_t size) {
+	return p->allocate(size);
+}
+size_t SharedAllocator::usable_size(size_t size) {
+	return size_t(1) << (SharedAllocatorInternal::size_class(size) + SharedAllocatorInternal::min_shift);
+}
+void SharedAllocator::deallocate(Handle handle) noexcept {
+	p->deallocate(handle);
+}
+void *SharedAllocator::get(Handle handle) const noexcept {
+	return p->base() + handle;
+}
+void SharedAllocator::set_root(Handle handle) noexcept {
+	p->header().root.store(handle, std::memory_order_release);
+}
+SharedAllocator::Handle SharedAllocator::root() const noexcept {
+	return p->header().root.load(std::memory_order_acquire);
+}
+SharedAllocator::~SharedAllocator() noexcept = default;
+SharedAllocator::SharedAllocator(SharedAllocator&&) noexcept = default;
+SharedAllocator::SharedAllocator(std::unique_ptr<SharedAllocatorInternal> p): p(std::move(p)) {}
+
+} // namespace ipclib
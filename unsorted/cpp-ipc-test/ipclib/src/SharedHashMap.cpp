@@ -0,0 +1,626 @@
+#include "ipclib/SharedHashMap.h"
+#include "ipclib/SharedAllocator.h"
+#include "Process.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+namespace ipclib
+{
+
+/*
+
+	memory layout (all blocks are taken from SharedAllocator):
+	   Header, which is allocator root
+	   tables, each is Table followed by array of buckets: Bucket followed by value
+
+	Key is stored in first non-full bucket starting from its home one (hash modulo capacity),
+	lookup stops at empty bucket. Buckets never become empty again, erased ones are marked deleted.
+
+	Epoch is odd while table is resized. At even epoch E current table is tables[E / 2 % 2],
+	new one at odd epoch is the other. Table handles are read together with epoch when it's pinned. Updater locks home bucket of the key in old table,
+	moves all keys which have that home to new table and marks home as moved; after that
+	keys of that home are only updated and looked up in new table.
+
+	Each object pins epoch in which it works in its slot. After resize is finished old table
+	is retired, and freed by process which starts or finishes resize and sees no slot
+	with earlier epoch pinned. If there are too many retired tables, resize is postponed.
+
+*/
+
+class SharedHashMapInternal {
+public:
+	static constexpr uint64_t magic = 0x6970636c6962686d; // "ipclibhm"
+	static constexpr int max_users = 64;
+	static constexpr int move_chunk = 8; // home buckets moved by each update, in addition to its own
+	static constexpr int max_retired = 8;
+
+	enum State : uint32_t {
+		Empty,
+		Full,
+		Deleted
+	};
+	enum HomeFlags : uint32_t {
+		HomeLocked = 1, // by updater of keys which start probing here
+		HomeMoved = 2 // all such keys are in new table
+	};
+
+	struct Bucket {
+		std::atomic<uint32_t> version; // odd while bucket is written
+		std::atomic<uint32_t> home; // HomeFlags
+		uint32_t state;
+		uint32_t padding;
+		uint64_t key;
+		// value follows
+	};
+	struct Table {
+		uint64_t capacity; // power of two
+		std::atomic<uint64_t> used; // buckets which aren't empty
+		// when table is old one during resize
+		std::atomic<uint64_t> move_next; // next home bucket to move, modulo capacity
+		std::atomic<uint64_t> moved; // home buckets already moved
+	};
+	static constexpr size_t table_header_size = 64; // buckets start here
+	struct Slot {
+		alignas(64) std::atomic<int32_t> pid; // 0 if free
+		std::atomic<uint64_t> pid_ns; // set after pid is taken, cleared before it's freed
+		std::atomic<uint64_t> pinned; // epoch + 1, 0 if not pinned
+	};
+	struct Header {
+		uint64_t magic;
+		uint64_t value_size;
+		uint64_t bucket_size;
+		std::atomic<uint64_t> epoch;
+		std::atomic<uint64_t> count;
+		std::atomic<SharedAllocator::Handle> tables[2];
+
+		std::atomic<uint32_t> resizing; // set by process which starts resize, cleared when it's finished
+		struct Retired {
+			SharedAllocator::Handle handle; // null if not used
+			uint64_t epoch; // last one in which table could be accessed
+		};
+		Retired retired[max_retired]; // protected by resizing
+
+		Slot slots[max_users];
+	};
+	static_assert(std::atomic<uint64_t>::is_always_lock_free, "atomics must be lock-free to be shared between processes");
+
+	SharedHashMapInternal(SharedAllocator alloc): alloc(std::move(alloc)) {}
+	~SharedHashMapInternal() {
+		if (slot != -1) {
+			h->slots[slot].pid_ns = 0;
+			h->slots[slot].pid = 0;
+		}
+	}
+
+	void create(size_t value_size, size_t capacity) {
+		const auto handle = alloc.allocate(sizeof(Header));
+		h = new(alloc.get(handle)) Header();
+		h->value_size = value_size;
+		h->bucket_size = (sizeof(Bucket) + value_size + 7) / 8 * 8;
+		h->epoch = 0;
+		h->count = 0;
+		h->resizing = 0;
+		for (auto& r : h->retired) {
+			r.handle = SharedAllocator::null;
+		}
+		for (auto& s : h->slots) {
+			s.pid = 0;
+			s.pid_ns = 0;
+			s.pinned = 0;
+		}
+
+		uint64_t rounded = 8;
+		while (rounded < capacity) {
+			rounded *= 2;
+		}
+		h->tables[0] = allocate_table(rounded);
+
+		h->magic = magic;
+		alloc.set_root(handle);
+		take_slot();
+	}
+	void attach() {
+		const auto handle = alloc.root();
+		h = handle ? alloc.get<Header>(handle) : nullptr;
+		if (!h || h->magic != magic) {
+			throw std::runtime_error("SharedHashMap::attach() segment has no map");
+		}
+		take_slot();
+	}
+
+	bool find(SharedHashMap::Key key, void *value) {
+		const uint64_t hash = hash_key(key);
+		Pin pin(*this);
+		if (pin.epoch & 1) {
+			Table& old = *pin.current;
+			auto& home = bucket(old, hash & (old.capacity - 1));
+			if (!(home.home.load(std::memory_order_acquire) & HomeMoved)) {
+				if (lookup(old, key, hash, value)) {
+					return true;
+				}
+				// key could be inserted into new table while we were looking
+				if (!(home.home.load(std::memory_order_acquire) & HomeMoved)) {
+					return false;
+				}
+			}
+			return lookup(*pin.next, key, hash, value);
+		}
+		return lookup(*pin.current, key, hash, value);
+	}
+
+	// Calls function(table, hash) with home bucket of the key locked in table where it must be updated
+	template <typename Function>
+	void modify(SharedHashMap::Key key, bool inserting, Function&& function) {
+		const uint64_t hash = hash_key(key);
+		Table* full = nullptr; // which had no free bucket
+		bool too_full = false;
+		while (true) {
+			if (full) {
+				if (!wait_resize(full)) {
+					throw std::bad_alloc();
+				}
+				full = nullptr;
+			}
+
+			Pin pin(*this);
+			Table* table = pin.current;
+			if (pin.epoch & 1) {
+				Table& old = *table;
+				table = pin.next;
+				try {
+					move_home(old, hash & (old.capacity - 1), *table, pin.epoch);
+					// wraps around, so buckets claimed by stalled process are moved by others
+					for (int i = 0; i < move_chunk && old.moved.load(std::memory_order_relaxed) != old.capacity; i++) {
+						move_home(old, old.move_next.fetch_add(1) % old.capacity, *table, pin.epoch);
+					}
+				}
+				catch (TableFull&) {
+					full = table;
+					continue;
+				}
+			}
+
+			auto& home = bucket(*table, hash & (table->capacity - 1));
+			HomeLock lock(*this, home);
+			if (home.home.load(std::memory_order_relaxed) & HomeMoved) {
+				continue; // resize started after pinning
+			}
+			try {
+				function(*table, hash);
+			}
+			catch (TableFull&) {
+				full = table;
+				continue;
+			}
+			too_full = inserting && !pin.next && table->used.load(std::memory_order_relaxed) * 4 > table->capacity * 3;
+			break;
+		}
+
+		if (too_full) {
+			start_resize();
+		}
+	}
+
+	// Finds bucket with key or claims free one for it. Home bucket must be locked.
+	// Returns locked bucket, or null if key isn't found and not inserting. Throws TableFull
+	Bucket* acquire_bucket(Table& table, SharedHashMap::Key key, uint64_t hash, bool inserting, bool& found) {
+		const uint64_t mask = table.capacity - 1;
+		uint64_t free_index = table.capacity;
+		uint64_t i = 0;
+		for (; i < table.capacity; i++) {
+			auto& b = bucket(table, (hash + i) & mask);
+			SharedHashMap::Key bucket_key;
+			const State state = read_bucket(b, bucket_key, nullptr);
+			if (state == Full && bucket_key == key) {
+				lock_bucket(b); // can't change since home is locked
+				found = true;
+				return &b;
+			}
+			if (state == Deleted && free_index == table.capacity) {
+				free_index = i;
+			}
+			if (state == Empty) {
+				break;
+			}
+		}
+		found = false;
+		if (!inserting) {
+			return nullptr;
+		}
+
+		// buckets of other homes may be claimed concurrently
+		for (i = std::min(free_index, i); i < table.capacity; i++) {
+			auto& b = bucket(table, (hash + i) & mask);
+			lock_bucket(b);
+			if (b.state != Full) {
+				if (b.state == Empty) {
+					table.used.fetch_add(1, std::memory_order_relaxed);
+				}
+				b.state = Full;
+				b.key = key;
+				std::memset(value_of(b), 0, h->value_size);
+				return &b;
+			}
+			unlock_bucket(b);
+		}
+		throw TableFull();
+	}
+	void unlock_bucket(Bucket& b) {
+		b.version.fetch_add(1, std::memory_order_release);
+	}
+
+	uint8_t* value_of(Bucket& b) {
+		return reinterpret_cast<uint8_t*>(&b + 1);
+	}
+	uint64_t value_size() const {
+		return h->value_size;
+	}
+	uint64_t size() const {
+		return h->count.load(std::memory_order_relaxed);
+	}
+	uint64_t capacity() {
+		Pin pin(*this);
+		return (pin.next ? pin.next : pin.current)->capacity;
+	}
+	void count(int64_t change) {
+		h->count.fetch_add(change, std::memory_order_relaxed);
+	}
+
+private:
+	SharedAllocator alloc;
+	Header* h = nullptr;
+	int slot = -1;
+	std::vector<uint8_t> moved_value; // buffer
+
+	struct TableFull {};
+
+	struct Pin {
+		SharedHashMapInternal& p;
+		uint64_t epoch;
+		Table* current; // old one if resize is in progress
+		Table* next = nullptr; // new one if resize is in progress
+
+		Pin(SharedHashMapInternal& p): p(p) {
+			auto& pinned = p.h->slots[p.slot].pinned;
+			epoch = p.h->epoch.load();
+			while (true) {
+				pinned.store(epoch + 1); // seq_cst, must be visible before epoch is checked again
+				// handles are changed only before epoch
+				current = &p.table(p.h->tables[epoch / 2 % 2].load());
+				next = epoch & 1 ? &p.table(p.h->tables[(epoch / 2 + 1) % 2].load()) : nullptr;
+				const uint64_t actual = p.h->epoch.load();
+				if (actual == epoch) {
+					break;
+				}
+				epoch = actual;
+			}
+		}
+		~Pin() {
+			p.h->slots[p.slot].pinned.store(0, std::memory_order_release);
+		}
+	};
+	struct HomeLock {
+		Bucket& home;
+
+		HomeLock(SharedHashMapInternal&, Bucket& home): home(home) {
+			int spins = 0;
+			uint32_t flags = home.home.load(std::memory_order_relaxed);
+			while (true) {
+				if (flags & HomeLocked) {
+					backoff(spins);
+					flags = home.home.load(std::memory_order_relaxed);
+				}
+				else if (home.home.compare_exchange_weak(flags, flags | HomeLocked, std::memory_order_acquire)) {
+					break;
+				}
+			}
+		}
+		~HomeLock() {
+			home.home.fetch_and(~uint32_t(HomeLocked), std::memory_order_release);
+		}
+	};
+
+	static void backoff(int& spins) {
+		if (++spins > 64) {
+			std::this_thread::yield();
+		}
+	}
+	static uint64_t hash_key(SharedHashMap::Key key) {
+		// splitmix64 finalizer
+		key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9;
+		key = (key ^ (key >> 27)) * 0x94d049bb133111eb;
+		return key ^ (key >> 31);
+	}
+
+	Table& table(SharedAllocator::Handle handle) {
+		return *alloc.get<Table>(handle);
+	}
+	Bucket& bucket(Table& table, uint64_t index) {
+		return *reinterpret_cast<Bucket*>(reinterpret_cast<uint8_t*>(&table) + table_header_size + index * h->bucket_size);
+	}
+
+	void lock_bucket(Bucket& b) {
+		int spins = 0;
+		uint32_t version = b.version.load(std::memory_order_relaxed);
+		while (true) {
+			if (version & 1) {
+				backoff(spins);
+				version = b.version.load(std::memory_order_relaxed);
+			}
+			else if (b.version.compare_exchange_weak(version, version + 1, std::memory_order_acquire)) {
+				break;
+			}
+		}
+		std::atomic_thread_fence(std::memory_order_release); // version must be visible before data changes
+	}
+	// Copies state, key and value consistently. Value is copied only if it's not null,
+	// bucket is full and key is the wanted one (if specified)
+	State read_bucket(Bucket& b, SharedHashMap::Key& key, void *value, const SharedHashMap::Key *wanted = nullptr) {
+		int spins = 0;
+		while (true) {
+			const uint32_t version = b.version.load(std::memory_order_acquire);
+			if (version & 1) {
+				backoff(spins);
+				continue;
+			}
+			const State state = static_cast<State>(b.state);
+			key = b.key;
+			if (value && state == Full && (!wanted || key == *wanted)) {
+				std::memcpy(value, value_of(b), h->value_size);
+			}
+			std::atomic_thread_fence(std::memory_order_acquire); // data reads can't be moved after version check
+			if (b.version.load(std::memory_order_relaxed) == version) {
+				return state;
+			}
+		}
+	}
+	bool lookup(Table& table, SharedHashMap::Key key, uint64_t hash, void *value) {
+		const uint64_t mask = table.capacity - 1;
+		for (uint64_t i = 0; i < table.capacity; i++) {
+			auto& b = bucket(table, (hash + i) & mask);
+			SharedHashMap::Key bucket_key;
+			const State state = read_bucket(b, bucket_key, value, &key);
+			if (state == Full && bucket_key == key) {
+				return true;
+			}
+			if (state == Empty) {
+				return false;
+			}
+		}
+		return false;
+	}
+
+	SharedAllocator::Handle allocate_table(uint64_t capacity) {
+		const size_t size = table_header_size + capacity * h->bucket_size;
+		const auto handle = alloc.allocate(size);
+		std::memset(alloc.get(handle), 0, size);
+		auto t = new(alloc.get(handle)) Table();
+		t->capacity = capacity;
+		t->used = 0;
+		t->move_next = 0;
+		t->moved = 0;
+		return handle;
+	}
+	enum class ResizeResult {
+		Started,
+		Busy, // by another process, or not needed
+		Failed // no space for new table
+	};
+	// Starts resize if current table is too full
+	ResizeResult start_resize() {
+		uint32_t expected = 0;
+		if (!h->resizing.compare_exchange_strong(expected, 1)) {
+			return ResizeResult::Busy;
+		}
+		const uint64_t epoch = h->epoch.load(); // handles can't change now
+		Table& table = this->table(h->tables[epoch / 2 % 2].load());
+		if (table.used.load(std::memory_order_relaxed) * 4 <= table.capacity * 3 || !free_retired()) {
+			h->resizing = 0;
+			return ResizeResult::Busy;
+		}
+
+		// if most of used buckets are deleted, size stays the same
+		uint64_t capacity = table.capacity;
+		while (h->count.load(std::memory_order_relaxed) * 2 > capacity) {
+			capacity *= 2;
+		}
+		try {
+			h->tables[(epoch / 2 + 1) % 2] = allocate_table(capacity);
+		}
+		catch (std::bad_alloc&) {
+			h->resizing = 0; // current table is still usable
+			return ResizeResult::Failed;
+		}
+		h->epoch.store(epoch + 1);
+		return ResizeResult::Started;
+	}
+	// Waits until updates go to another table than full one; returns false if it can't be resized
+	bool wait_resize(Table* full) {
+		int spins = 0;
+		while (true) {
+			const uint64_t epoch = h->epoch.load();
+			if ((epoch & 1) || &table(h->tables[epoch / 2 % 2].load()) != full) {
+				return true;
+			}
+			switch (start_resize()) {
+			case ResizeResult::Started: return true;
+			case ResizeResult::Failed: return false;
+			case ResizeResult::Busy: backoff(spins); break;
+			}
+		}
+	}
+	// Moves keys of home bucket to new table, finishes resize if it was the last one
+	void move_home(Table& old, uint64_t index, Table& table, uint64_t epoch) {
+		auto& home = bucket(old, index);
+		if (home.home.load(std::memory_order_acquire) & HomeMoved) {
+			return;
+		}
+		HomeLock lock(*this, home);
+		if (home.home.load(std::memory_order_relaxed) & HomeMoved) {
+			return;
+		}
+
+		moved_value.resize(h->value_size);
+		const uint64_t mask = old.capacity - 1;
+		for (uint64_t i = 0; i < old.capacity; i++) {
+			SharedHashMap::Key key;
+			const State state = read_bucket(bucket(old, (index + i) & mask), key, moved_value.data());
+			if (state == Empty) {
+				break;
+			}
+			const uint64_t hash = hash_key(key);
+			if (state != Full || (hash & mask) != index) {
+				continue;
+			}
+
+			HomeLock new_lock(*this, bucket(table, hash & (table.capacity - 1)));
+			bool found;
+			auto b = acquire_bucket(table, key, hash, true, found);
+			std::memcpy(value_of(*b), moved_value.data(), h->value_size);
+			unlock_bucket(*b);
+		}
+
+		home.home.fetch_or(HomeMoved, std::memory_order_release);
+		if (old.moved.fetch_add(1) + 1 == old.capacity) {
+			finish_resize(epoch);
+		}
+	}
+	// Makes new table current and retires old one; it will be freed later if it's pinned (by this process too)
+	void finish_resize(uint64_t epoch) {
+		for (auto& r : h->retired) {
+			if (!r.handle) {
+				r = {h->tables[epoch / 2 % 2].load(), epoch};
+				break;
+			}
+		}
+		h->epoch.store(epoch + 1); // seq_cst, must be visible before slots are checked
+		free_retired();
+		h->resizing.store(0, std::memory_order_release);
+	}
+	// Frees retired tables which can't be accessed anymore; returns false if no place is left
+	// for another one. Resizing must be set
+	bool free_retired() {
+		uint64_t oldest_pinned = ~uint64_t(0);
+		for (auto& s : h->slots) {
+			const uint64_t pinned = s.pinned.load();
+			if (pinned && pinned - 1 < oldest_pinned) {
+				const int32_t pid = s.pid.load();
+				if (pid && is_process_alive(pid, s.pid_ns.load())) { // otherwise crashed while pinned
+					oldest_pinned = pinned - 1;
+				}
+			}
+		}
+		bool has_free = false;
+		for (auto& r : h->retired) {
+			if (r.handle && r.epoch < oldest_pinned) {
+				alloc.deallocate(r.handle);
+				r.handle = SharedAllocator::null;
+			}
+			has_free |= !r.handle;
+		}
+		return has_free;
+	}
+
+	void take_slot() {
+		const int32_t pid = getpid();
+		for (int i = 0; i < max_users; i++) {
+			auto& s = h->slots[i];
+			int32_t expected = s.pid.load();
+			if (expected && is_process_alive(expected, s.pid_ns.load())) {
+				continue;
+			}
+			if (expected) {
+				// crashed; slot is freed first, so its namespace is never seen with our pid
+				s.pid_ns = 0;
+				s.pid.compare_exchange_strong(expected, 0);
+				expected = 0;
+			}
+			if (s.pid.compare_exchange_strong(expected, pid)) {
+				s.pid_ns = pid_namespace();
+				s.pinned = 0;
+				slot = i;
+				return;
+			}
+		}
+		throw std::runtime_error("SharedHashMap::attach() all slots are taken");
+	}
+};
+
+
+SharedHashMap SharedHashMap::create(SharedMemory& shm, size_t value_size, size_t capacity) {
+	auto p = std::make_unique<SharedHashMapInternal>(SharedAllocator::create(shm));
+	p->create(value_size, capacity);
+	return SharedHashMap(std::move(p));
+}
+SharedHashMap SharedHashMap::attach(SharedMemory& shm) {
+	auto p = std::make_unique<SharedHashMapInternal>(SharedAllocator::attach(shm));
+	p->attach();
+	return SharedHashMap(std::move(p));
+}
+bool SharedHashMap::find(Key key, void *value) {
+	return p->find(key, value);
+}
+bool SharedHashMap::insert(Key key, const void *value) {
+	bool inserted = false;
+	p->modify(key, true, [&](auto& table, uint64_t hash) {
+		bool found;
+		auto b = p->acquire_bucket(table, key, hash, true, found);
+		std::memcpy(p->value_of(*b), value, p->value_size());
+		p->unlock_bucket(*b);
+		if (!found) {
+			p->count(1);
+		}
+		inserted = !found;
+	});
+	return inserted;
+}
+void SharedHashMap::update(Key key, const std::function<void(uint8_t *value, bool inserted)>& function) {
+	p->modify(key, true, [&](auto& table, uint64_t hash) {
+		bool found;
+		auto b = p->acquire_bucket(table, key, hash, true, found);
+		if (!found) {
+			p->count(1);
+		}
+		struct Unlock {
+			SharedHashMapInternal& p;
+			SharedHashMapInternal::Bucket& b;
+			~Unlock() { p.unlock_bucket(b); }
+		} unlock{*p, *b};
+		function(p->value_of(*b), !found);
+	});
+}
+bool SharedHashMap::erase(Key key) {
+	bool erased = false;
+	p->modify(key, false, [&](auto& table, uint64_t hash) {
+		bool found;
+		if (auto b = p->acquire_bucket(table, key, hash, false, found)) {
+			b->state = SharedHashMapInternal::Deleted;
+			p->unlock_bucket(*b);
+			p->count(-1);
+			erased = true;
+		}
+	});
+	return erased;
+}
+size_t SharedHashMap::size() const noexcept {
+	return p->size();
+}
+size_t SharedHashMap::capacity() const noexcept {
+	return p->capacity();
+}
+size_t SharedHashMap::value_size() const noexcept {
+	return p->value_size();
+}
+SharedHashMap::~SharedHashMap() noexcept = default;
+SharedHashMap::SharedHashMap(SharedHashMap&&) noexcept = default;
+SharedHashMap::SharedHashMap(std::unique_ptr<SharedHashMapInternal> p): p(std::move(p)) {}
+
+} // namespace ipclib
@@ -1,7 +1,26 @@
 #include "ipclib/SharedMemory.h"
+#include "Futex.h"
+#include "Process.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <boost/interprocess/file_mapping.hpp>
 #include <boost/interprocess/mapped_region.hpp>
 #include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/interprocess/sync/interprocess_condition.hpp>
+#include <boost/interprocess/sync/interprocess_mutex.hpp>
 #include <boost/interprocess/sync/interprocess_sharable_mutex.hpp>
 #include <boost/interprocess/sync/interprocess_upgradable_mutex.hpp>
 #include <boost/interprocess/sync/scoped_lock.hpp>
@@ -12,74 +31,869 @@ using namespace boost::interprocess;
 namespace ipclib
 {
 
+// Two-level page table, so next snapshot shares unmodified chunks instead of copying pointer
+// to each page. Chunks and pages are never changed after snapshot is returned
+struct SharedMemorySnapshotData {
+	using Page = std::array<uint8_t, SharedMemorySnapshot::page_size>;
+	static constexpr size_t chunk_pages = 512; // 2 MB
+	using Chunk = std::array<std::shared_ptr<const Page>, chunk_pages>;
+	uint64_t version;
+	size_t size;
+	size_t page_count;
+	std::vector<std::shared_ptr<Chunk>> chunks;
+	
+	const Page& page(size_t index) const {
+		return *(*chunks[index / chunk_pages])[index % chunk_pages];
+	}
+};
+
+// ranges passed to lock without copying them into vector
+struct SharedMemoryRangeList {
+	const SharedMemoryRange *first, *last;
+	const SharedMemoryRange *begin() const { return first; }
+	const SharedMemoryRange *end() const { return last; }
+};
+
 class SharedMemoryInternal {
 public:
+    // modified byte range, logged by write lock
+    struct DirtyRange {
+        uint64_t version; // which write lock release it belongs to
+        uint64_t offset;
+        uint64_t length;
+    };
+    static constexpr int dirty_log_size = 1024;
+    static constexpr int dirty_marks = 16; // per write lock; more marks are merged into one
+    static constexpr int chunk_slots = 1024;
+    static constexpr int chunk_shift = 21; // 2 MB, same as chunk of snapshot
+
+    // process which has segment mapped; separate cache line, as it's written by read locks
+    struct alignas(64) Mapper {
+        std::atomic<int32_t> pid{0}; // 0 if slot is free
+        std::atomic<uint64_t> pid_ns{0}; // set after pid is taken, cleared before it's freed
+        std::atomic<uint32_t> readers{0}; // read locks held without mutex
+        std::atomic<uint64_t> generation{0}; // of current mapping
+    };
+    static constexpr int max_mappers = 64;
+    static constexpr int bias_inhibit_multiplier = 9; // from BRAVO paper
+    enum BiasState : uint32_t {
+        BiasOff,
+        BiasOn,
+        BiasRevoking, // biased readers may still hold lock, set if writer gave up waiting for them
+    };
+
+    // range locks: blocks of data are assigned to stripes cyclically
+    static constexpr int stripe_count = 64; // bits in mask
+    static constexpr int stripe_block_shift = 16;
+
     struct Sync {
         interprocess_upgradable_mutex mut;
+        alignas(64) std::atomic<uint64_t> seq{0}; // odd while writer holds lock
+        std::atomic<uint32_t> changed{0}; // futex, incremented with seq on release
+        alignas(64) std::atomic<uint32_t> change_waiters{0};
+
+        // Reader bias (BRAVO): while it's set, read locks only increment counter in mapper slot.
+        // Writer clears it after locking mutex and waits for all counters to become zero;
+        // then readers use mutex until bias is restored by one of them, which happens
+        // only after several times as much time as revocation took.
+        alignas(64) std::atomic<uint32_t> read_bias{BiasOn}; // BiasState
+        std::atomic<int64_t> bias_inhibit_until{0}; // steady_clock, ns
+
+        // Range writers hold mut sharable and their stripes exclusively.
+        // They increment seq by 2 on release and keep seqlock readers away with counter
+        std::atomic<uint32_t> range_writers{0}; // changed under range_mut
+        // Whole-region readers using mutex and range writers exclude each other with counters
+        // under range_mut; waiting range writers keep new readers away. Biased readers are excluded
+        // by range writers revoking bias, which isn't restored while any of them is active
+        interprocess_mutex range_mut;
+        interprocess_condition range_done; // range_writers became zero
+        interprocess_condition readers_done; // region_readers became zero
+        uint32_t region_readers = 0;
+        uint32_t range_writers_waiting = 0;
+        interprocess_mutex log_mut; // for range writers and readers of dirty log
+        interprocess_upgradable_mutex stripes[stripe_count];
+
+        // ring, protected by mut (and log_mut if mut is sharable)
+        uint64_t dirty_count = 0; // ranges ever logged
+        DirtyRange dirty_log[dirty_log_size];
+        // version of last write to each chunk (chunk number modulo chunk_slots), so snapshot
+        // can find modified chunks when ranges were already overwritten in ring
+        uint64_t chunk_versions[chunk_slots] = {};
+
+        // Shm is only downsized after all mappers have remapped to smaller size,
+        // so no process can access truncated pages. Protected by mut
+        std::atomic<uint64_t> generation{1}; // incremented by resize
+        uint64_t size = 0; // of data
+        uint64_t shm_size = 0; // of shm object, can be larger than needed until shrink is done
+        Mapper mappers[max_mappers];
+        // processes which got no mapper slot and so can't acknowledge; shm isn't shrunk while any
+        // of them is open (or until reboot if one has crashed)
+        std::atomic<uint32_t> unregistered{0};
+
+        // file-backed mode
+        uint64_t file_magic = 0; // file_magic_value if header was initialized by create_file()
+        uint64_t file_sync_size = 0; // sync_size of process which created file, layout may differ between builds
+        uint64_t checkpoint_version = 0; // everything up to this version is flushed to file
+        interprocess_mutex checkpoint_mut;
+
+        NumaPolicy numa; // applied by every process after remapping
     };
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "atomics must be lock-free to be shared between processes");
     static constexpr int sync_size = sizeof(Sync);
+    static constexpr uint64_t file_magic_value = 0x656c69666d687370; // "pshmfile"
 
     template <typename CreateType>
-    void create(const std::string& name) {
+    void create(const std::string& name, const NumaPolicy& numa) {
         shm = shared_memory_object(CreateType{}, name.c_str(), read_write);
-        resize(0);
-        new(&get_sync()) Sync();
+        truncate(sync_size);
+        header = map(sync_size);
+        numa_bind(header.get_address(), header.get_size(), numa); // before header is touched
+        init_sync(0).numa = numa;
+        set_mapping(map(sync_size), 1);
     }
     void open(const std::string& name) {
         shm = shared_memory_object(open_only, name.c_str(), read_write);
-        update_mapping();
+        attach();
+    }
+    // Data of existing file is kept, but header is reinitialized - locks may be left taken by dead processes
+    void create_file(const std::string& path) {
+        open_file_descriptor(path, O_CREAT);
+        struct stat st;
+        if (fstat(fd, &st)) {
+            throw std::system_error(errno, std::generic_category(), "SharedMemory::create_file() fstat failed");
+        }
+        uint64_t size = 0;
+        if (st.st_size) {
+            if (uint64_t(st.st_size) < sync_size) {
+                throw std::runtime_error("SharedMemory::create_file() file is not empty and too small");
+            }
+            header = map(sync_size);
+            auto& sync = get_sync();
+            if (sync.file_magic != file_magic_value || sync.file_sync_size != sync_size || sync_size + sync.size > uint64_t(st.st_size)) {
+                throw std::runtime_error("SharedMemory::create_file() file is not empty and has no valid header");
+            }
+            size = sync.size;
+        }
+        else {
+            truncate(sync_size);
+            header = map(sync_size);
+        }
+        auto& sync = init_sync(size);
+        sync.shm_size = std::max<uint64_t>(st.st_size, sync_size);
+        sync.file_magic = file_magic_value;
+        sync.file_sync_size = sync_size;
+        set_mapping(map(sync_size + size), sync.generation.load());
+        // header is flushed now, so file stays valid if process dies before first checkpoint
+        msync(header.get_address(), sync_size, MS_SYNC);
+    }
+    void open_file(const std::string& path) {
+        open_file_descriptor(path, 0);
+        struct stat st;
+        if (fstat(fd, &st) || uint64_t(st.st_size) < sync_size) {
+            throw std::runtime_error("SharedMemory::open_file() file is too small");
+        }
+        attach();
+        if (get_sync().file_magic != file_magic_value || get_sync().file_sync_size != sync_size) {
+            throw std::runtime_error("SharedMemory::open_file() file has no valid header");
+        }
+    }
+    ~SharedMemoryInternal() {
+        if (header.get_address()) {
+            if (mapper != -1) {
+                get_sync().mappers[mapper].pid_ns = 0;
+                get_sync().mappers[mapper].pid = 0;
+            }
+            else if (unregistered) {
+                get_sync().unregistered.fetch_sub(1);
+            }
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+
+    // Flushes dirty ranges of file mapping; returns number of bytes flushed
+    size_t checkpoint() {
+        if (fd == -1) {
+            return 0;
+        }
+        sharable_lock<interprocess_upgradable_mutex> lock(get_sync().mut);
+        const auto mapping = update_mapping();
+        auto& sync = get_sync();
+        scoped_lock<interprocess_mutex> checkpoint_lock(sync.checkpoint_mut);
+
+        // same as SharedMemoryMirror::refresh(): range writers which haven't logged yet will have version above current
+        std::vector<DirtyRange> ranges;
+        scoped_lock<interprocess_mutex> log_lock(sync.log_mut);
+        const uint64_t current = sync.seq.load(std::memory_order_relaxed) / 2;
+        if (current == sync.checkpoint_version) {
+            return 0;
+        }
+        if (!get_dirty(sync.checkpoint_version, ranges)) {
+            ranges.assign(1, {current, 0, mapping->size()});
+        }
+        log_lock.unlock();
+
+        // msync requires page-aligned address; header pages are flushed too, as size may have changed
+        const size_t page = mapped_region::get_page_size();
+        auto base = static_cast<uint8_t*>(mapping->region.get_address());
+        std::sort(ranges.begin(), ranges.end(), [](auto& a, auto& b) {return a.offset < b.offset;});
+        size_t flushed = 0;
+        size_t flushed_end = 0; // from region start
+        auto flush = [&](size_t begin, size_t end) {
+            begin = std::max(begin / page * page, flushed_end);
+            end = std::min((end + page - 1) / page * page, mapping->region.get_size());
+            if (begin < end) {
+                if (msync(base + begin, end - begin, MS_SYNC)) {
+                    throw std::system_error(errno, std::generic_category(), "SharedMemory::checkpoint() msync failed");
+                }
+                flushed += end - begin;
+                flushed_end = end;
+            }
+        };
+        flush(0, sync_size);
+        for (auto& range : ranges) {
+            flush(sync_size + range.offset, sync_size + range.offset + range.length);
+        }
+        sync.checkpoint_version = current;
+        return flushed;
     }
 
+	// collects ranges logged after version; returns false if some of them were already overwritten.
+	// Mutex must be locked
+	bool get_dirty(uint64_t version, std::vector<DirtyRange>& ranges) {
+		auto& sync = get_sync();
+		const uint64_t end = sync.dirty_count;
+		const uint64_t begin = end > dirty_log_size ? end - dirty_log_size : 0;
+		if (begin && sync.dirty_log[begin % dirty_log_size].version > version) {
+			return false;
+		}
+		for (uint64_t i = end; i != begin; i--) {
+			auto& range = sync.dirty_log[(i - 1) % dirty_log_size];
+			if (range.version <= version) {
+				break;
+			}
+			ranges.push_back(range);
+		}
+		return true;
+	}
+
+	// Ranges of chunks modified after version, for when get_dirty() fails. Mutex must be locked
+	void get_dirty_chunks(uint64_t version, uint64_t size, std::vector<DirtyRange>& ranges) {
+		auto& sync = get_sync();
+		for (uint64_t offset = 0; offset < size; offset += uint64_t(1) << chunk_shift) {
+			const uint64_t chunk_version = sync.chunk_versions[(offset >> chunk_shift) % chunk_slots];
+			if (chunk_version > version) {
+				ranges.push_back({chunk_version, offset, uint64_t(1) << chunk_shift});
+			}
+		}
+	}
+	
 	Sync& get_sync() {
-		return *static_cast<Sync*>(region.get_address());
+		return *static_cast<Sync*>(header.get_address());
 	}
-	uint8_t* get_data() {
-		return static_cast<uint8_t*>(region.get_address()) + sync_size;
+	// Mapping of whole segment, including header
+	struct Mapping {
+		mapped_region region;
+		uint64_t generation;
+		uint8_t* data() const {
+			return static_cast<uint8_t*>(region.get_address()) + sync_size;
+		}
+		size_t size() const {
+			return region.get_size() - sync_size;
+		}
+	};
+	// Keeps current mapping from being unmapped without holding any lock
+	class Pin {
+	public:
+		explicit Pin(SharedMemoryInternal& p): p(p), count(p.pins[pin_slot()].count) {
+			count.fetch_add(1); // seq_cst, pairs with update_mapping()
+			mapping = p.current.load();
+		}
+		~Pin() {
+			count.fetch_sub(1, std::memory_order_release);
+			if (p.reclaim_pending.load(std::memory_order_relaxed)) {
+				std::lock_guard<std::mutex> guard(p.remap_mut);
+				p.reclaim();
+			}
+		}
+		Pin(const Pin&) = delete;
+		const Mapping* mapping;
+	private:
+		SharedMemoryInternal& p;
+		std::atomic<uint32_t>& count;
+	};
+	
+	// Current mapping without any locking; only valid while lock or Pin is held
+	const Mapping* mapping() const {
+		return current.load(std::memory_order_acquire);
 	}
-	size_t get_size() {
-		return region.get_size() - sync_size;
+	size_t mapped_size() const {
+		return current_size.load(std::memory_order_acquire);
 	}
-    void resize(size_t size) {
-		shm.truncate(size + sync_size);
-		update_mapping();
+	// Pointer may be kept without lock, so mapping is never unmapped after this is called
+	uint8_t* exposed_data() {
+		if (!data_exposed.load(std::memory_order_acquire)) {
+			data_exposed.store(true); // seq_cst, pairs with reclaim()
+		}
+		return current.load()->data();
+	}
+	std::vector<size_t> numa_pages() {
+		Pin pin(*this);
+		return ipclib::numa_pages(pin.mapping->region.get_address(), pin.mapping->region.get_size());
+	}
+	// Mutex must be locked exclusively; returns new mapping
+    const Mapping* resize(size_t size) {
+		auto& sync = get_sync();
+		if (size + sync_size > sync.shm_size) {
+			truncate(size + sync_size);
+			sync.shm_size = size + sync_size;
+		}
+		sync.size = size;
+		sync.generation++;
+		auto remapped = update_mapping();
+		shrink_if_possible();
+		return remapped;
     }
-	void update_mapping() {
-		offset_t size = 0;
-		if (!shm.get_size(size)) { // shouldn't happen
-			throw std::runtime_error("SharedMemoryInternal::update_mapping() shm.get_size failed");
+	uint64_t lock_stripes(SharedMemoryRangeList ranges, bool exclusive) {
+		uint64_t mask = 0;
+		for (auto& range : ranges) {
+			if (!range.length) {
+				continue;
+			}
+			const uint64_t first = range.offset >> stripe_block_shift;
+			const uint64_t last = (range.offset + range.length - 1) >> stripe_block_shift;
+			if (last - first >= stripe_count - 1) {
+				mask = ~uint64_t(0);
+				break;
+			}
+			for (uint64_t block = first; block <= last; block++) {
+				mask |= uint64_t(1) << (block % stripe_count);
+			}
+		}
+		// always in ascending order, so lockers can't deadlock
+		for (int i = 0; i < stripe_count; i++) {
+			if (mask & (uint64_t(1) << i)) {
+				if (exclusive) get_sync().stripes[i].lock();
+				else get_sync().stripes[i].lock_sharable();
+			}
 		}
-		region = mapped_region(shm, read_write, 0, size);
+		return mask;
+	}
+	void unlock_stripes(uint64_t mask, bool exclusive) {
+		for (int i = 0; i < stripe_count; i++) {
+			if (mask & (uint64_t(1) << i)) {
+				if (exclusive) get_sync().stripes[i].unlock();
+				else get_sync().stripes[i].unlock_sharable();
+			}
+		}
+	}
+	
+	bool is_resized() {
+		return get_sync().generation.load(std::memory_order_acquire) != generation.load(std::memory_order_acquire);
 	}
 	
+	// Returns true if read lock is taken without mutex
+	bool try_lock_biased() {
+		auto& sync = get_sync();
+		if (mapper == -1 || sync.read_bias.load(std::memory_order_relaxed) != BiasOn) {
+			return false;
+		}
+		auto& readers = sync.mappers[mapper].readers;
+		readers.fetch_add(1); // seq_cst, pairs with revoke_bias()
+		if (sync.read_bias.load() == BiasOn && !is_resized()) {
+			return true;
+		}
+		readers.fetch_sub(1, std::memory_order_release);
+		return false;
+	}
+	void unlock_biased() {
+		get_sync().mappers[mapper].readers.fetch_sub(1, std::memory_order_release);
+	}
+	// range_mut must be locked and there must be no range writers
+	void restore_bias() {
+		auto& sync = get_sync();
+		if (sync.read_bias.load(std::memory_order_relaxed) == BiasOff && now_ns() >= sync.bias_inhibit_until.load(std::memory_order_relaxed)) {
+			sync.read_bias.store(BiasOn, std::memory_order_relaxed);
+		}
+	}
+	// Waits until all biased readers are gone; if wait is false, returns false instead.
+	// Mutex must be locked exclusively, or sharable with range_mut locked
+	bool revoke_bias(bool wait = true) {
+		auto& sync = get_sync();
+		const uint32_t bias = sync.read_bias.load(std::memory_order_relaxed);
+		if (bias == BiasOff) {
+			return true;
+		}
+		if (bias == BiasOn) {
+			sync.read_bias.store(BiasRevoking); // seq_cst
+		}
+		const int64_t start = now_ns();
+		for (auto& m : sync.mappers) {
+			for (int spins = 0; m.readers.load(); spins++) {
+				if (!wait) {
+					return false;
+				}
+				if (spins >= 100) {
+					const int32_t pid = m.pid.load();
+					if (!pid || !is_process_alive(pid, m.pid_ns.load())) {
+						m.readers.store(0); // crashed while holding lock
+						break;
+					}
+					// reader may be preempted, yield() doesn't always let it run
+					std::this_thread::sleep_for(std::chrono::microseconds(spins < 200 ? 0 : 50));
+				}
+			}
+		}
+		std::atomic_thread_fence(std::memory_order_acquire); // reads of biased readers happen before our writes
+		sync.read_bias.store(BiasOff, std::memory_order_relaxed);
+		const int64_t now = now_ns();
+		sync.bias_inhibit_until.store(now + (now - start) * bias_inhibit_multiplier, std::memory_order_relaxed);
+		return true;
+	}
+	// Whole-region read lock waits for range writers, as they hold mutex sharable too.
+	// Mutex must be locked sharable
+	void begin_region_read() {
+		auto& sync = get_sync();
+		scoped_lock<interprocess_mutex> guard(sync.range_mut);
+		while (sync.range_writers.load(std::memory_order_relaxed) || sync.range_writers_waiting) {
+			sync.range_done.wait(guard);
+		}
+		sync.region_readers++;
+		restore_bias();
+	}
+	bool try_begin_region_read() {
+		auto& sync = get_sync();
+		scoped_lock<interprocess_mutex> guard(sync.range_mut);
+		if (sync.range_writers.load(std::memory_order_relaxed) || sync.range_writers_waiting) {
+			return false;
+		}
+		sync.region_readers++;
+		restore_bias();
+		return true;
+	}
+	void end_region_read() {
+		auto& sync = get_sync();
+		scoped_lock<interprocess_mutex> guard(sync.range_mut);
+		if (!--sync.region_readers) {
+			sync.readers_done.notify_all();
+		}
+	}
+	// Waits for whole-region readers, both using mutex and biased. Mutex must be locked sharable
+	void begin_range_write() {
+		auto& sync = get_sync();
+		scoped_lock<interprocess_mutex> guard(sync.range_mut);
+		sync.range_writers_waiting++;
+		while (sync.region_readers) {
+			sync.readers_done.wait(guard);
+		}
+		sync.range_writers_waiting--;
+		sync.range_writers.fetch_add(1); // seq_cst, also keeps seqlock readers away
+		revoke_bias();
+	}
+	void end_range_write() {
+		auto& sync = get_sync();
+		scoped_lock<interprocess_mutex> guard(sync.range_mut);
+		if (sync.range_writers.fetch_sub(1, std::memory_order_release) == 1) {
+			sync.range_done.notify_all();
+		}
+	}
+	// Remaps if segment was resized by another process; returns current mapping.
+	// Mutex must be locked, may be sharable - then other threads of this process may remap at the same time.
+	// Locks never hold older mapping than current one: resize excludes all of them, and they
+	// remap before using it. So only pinned readers can hold old mapping when it's replaced
+	const Mapping* update_mapping() {
+		auto& sync = get_sync();
+		const uint64_t latest = sync.generation.load(std::memory_order_acquire);
+		if (latest == generation.load(std::memory_order_acquire) && !reclaim_pending.load(std::memory_order_relaxed)) {
+			return current.load(std::memory_order_relaxed);
+		}
+		std::lock_guard<std::mutex> guard(remap_mut);
+		if (latest != generation.load(std::memory_order_relaxed)) {
+			set_mapping(map(sync_size + sync.size), latest);
+			if (sync.numa.mode != NumaPolicy::Default) {
+				numa_bind(owned->region.get_address(), owned->region.get_size(), sync.numa);
+			}
+		}
+		reclaim();
+		return owned.get();
+	}
+	// Unmaps replaced mappings once no Pin holds them, and only then acknowledges generation
+	// of current one, so shm isn't shrunk while this process may access truncated pages.
+	// remap_mut must be locked
+	void reclaim() {
+		if (!retired.empty()) {
+			for (auto& pin : pins) {
+				if (pin.count.load()) { // seq_cst, pairs with Pin
+					return;
+				}
+			}
+			if (data_exposed.load()) { // seq_cst, pairs with exposed_data()
+				std::move(retired.begin(), retired.end(), std::back_inserter(exposed));
+			}
+			retired.clear();
+		}
+		reclaim_pending.store(false, std::memory_order_relaxed);
+		if (mapper != -1) {
+			get_sync().mappers[mapper].generation.store(owned->generation, std::memory_order_release);
+		}
+	}
+	// Truncates shm if all mappers have acknowledged reduced size. Mutex must be locked exclusively
+	void shrink_if_possible() {
+		auto& sync = get_sync();
+		const uint64_t needed = sync_size + sync.size;
+		if (sync.shm_size <= needed || sync.unregistered.load()) {
+			return;
+		}
+		for (auto& m : sync.mappers) {
+			const int32_t pid = m.pid.load();
+			if (pid && m.generation.load(std::memory_order_acquire) != sync.generation) {
+				if (is_process_alive(pid, m.pid_ns.load())) {
+					return;
+				}
+				m.pid_ns.store(0);
+				int32_t expected = pid;
+				m.pid.compare_exchange_strong(expected, 0); // crashed without unregistering
+			}
+		}
+		truncate(needed);
+		sync.shm_size = needed;
+	}
+	
+	std::shared_ptr<const SharedMemorySnapshotData> last_snapshot; // chunks are shared with next one
+	
 private:
 	shared_memory_object shm;
-    mapped_region region;
+	file_mapping file; // used instead of shm in file-backed mode
+	int fd = -1; // of file, for truncating
+	mapped_region header; // sync only, never remapped - so mutexes don't move while they are locked
+	
+	// Replaced mappings are kept until no Pin may use them - pins are counted per slot picked
+	// by thread, so unlocked readers of different threads don't write the same cache line
+	struct alignas(64) PinSlot {
+		std::atomic<uint32_t> count{0};
+	};
+	static constexpr int pin_slots = 16;
+	PinSlot pins[pin_slots];
+	std::atomic<const Mapping*> current{nullptr};
+	std::atomic<size_t> current_size{0}; // of data in current mapping
+	std::atomic<bool> reclaim_pending{false}; // retired isn't empty
+	std::atomic<bool> data_exposed{false}; // by SharedMemory::data(), then mappings are only unmapped on close
+	std::mutex remap_mut; // serializes update_mapping() of threads holding sharable lock; protects fields below
+	std::unique_ptr<Mapping> owned; // current one
+	std::vector<std::unique_ptr<Mapping>> retired;
+	std::vector<std::unique_ptr<Mapping>> exposed;
+	std::atomic<uint64_t> generation{0}; // of current mapping
+	int mapper = -1; // slot; if all are taken, shm isn't shrunk until this process closes it
+	bool unregistered = false; // counted in Sync::unregistered
+	
+	static int pin_slot() {
+		static thread_local const int slot = std::hash<std::thread::id>{}(std::this_thread::get_id()) % pin_slots;
+		return slot;
+	}
+	// remap_mut must be locked, if other threads may use this object
+	void set_mapping(mapped_region region, uint64_t mapping_generation) {
+		auto remapped = std::unique_ptr<Mapping>(new Mapping{std::move(region), mapping_generation});
+		current_size.store(remapped->size(), std::memory_order_release);
+		current.store(remapped.get()); // seq_cst, pairs with Pin
+		if (owned) {
+			retired.push_back(std::move(owned));
+			reclaim_pending.store(true, std::memory_order_relaxed);
+		}
+		owned = std::move(remapped);
+		generation.store(mapping_generation, std::memory_order_release);
+	}
+	
+	void truncate(uint64_t size) {
+		if (fd == -1) {
+			shm.truncate(size);
+		}
+		else if (ftruncate(fd, size)) {
+			throw std::system_error(errno, std::generic_category(), "SharedMemory ftruncate failed");
+		}
+	}
+	mapped_region map(uint64_t size) {
+		if (fd == -1) {
+			return mapped_region(shm, read_write, 0, size);
+		}
+		return mapped_region(file, read_write, 0, size); // MAP_SHARED
+	}
+	void open_file_descriptor(const std::string& path, int flags) {
+		fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC | flags, 0644);
+		if (fd == -1) {
+			throw std::system_error(errno, std::generic_category(), "SharedMemory failed to open " + path);
+		}
+		file = file_mapping(path.c_str(), read_write);
+	}
+	// Header must be mapped
+	Sync& init_sync(uint64_t size) {
+		auto& sync = *new(&get_sync()) Sync();
+		sync.size = size;
+		sync.shm_size = sync_size + size;
+		register_mapper();
+		generation = sync.generation.load();
+		sync.mappers[mapper].generation = sync.generation.load();
+		return sync;
+	}
+	void attach() {
+		header = map(sync_size);
+		register_mapper();
+		sharable_lock<interprocess_upgradable_mutex> lock(get_sync().mut);
+		update_mapping();
+	}
+	
+	void register_mapper() {
+		auto& sync = get_sync();
+		const int32_t pid = getpid();
+		for (int i = 0; i < max_mappers; i++) {
+			int32_t expected = 0;
+			if (sync.mappers[i].pid.compare_exchange_strong(expected, pid)) {
+				sync.mappers[i].readers.store(0); // left by crashed process
+				sync.mappers[i].pid_ns.store(pid_namespace());
+				mapper = i;
+				return;
+			}
+		}
+		sync.unregistered.fetch_add(1);
+		unregistered = true;
+	}
+	static int64_t now_ns() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
 };
 
 class SharedMemoryInternalRead {
 public:
 	SharedMemoryInternal& p;
-	sharable_lock<interprocess_upgradable_mutex> lock;
+	sharable_lock<interprocess_upgradable_mutex> lock; // not locked if biased
+	bool biased = false;
+	bool region = false; // counted in region_readers
+	const SharedMemoryInternal::Mapping* mapping = nullptr;
 	
-	SharedMemoryInternalRead(SharedMemoryInternal& p): p(p), lock(p.get_sync().mut) {}
+	uint64_t stripes = 0; // locked sharable
+	
+	// Doesn't exclude range writers, as they hold mutex sharable too
+	struct RegionOnly {};
+	SharedMemoryInternalRead(SharedMemoryInternal& p, RegionOnly): p(p), biased(p.try_lock_biased()) {
+		if (biased) {
+			mapping = p.mapping();
+		}
+		else {
+			lock = sharable_lock<interprocess_upgradable_mutex>(p.get_sync().mut);
+			mapping = p.update_mapping();
+		}
+	}
+	// Biased lock already excludes range writers, as they revoke bias
+	SharedMemoryInternalRead(SharedMemoryInternal& p): SharedMemoryInternalRead(p, RegionOnly{}) {
+		if (!biased) {
+			p.begin_region_read();
+			region = true;
+		}
+	}
+	SharedMemoryInternalRead(SharedMemoryInternal& p, SharedMemoryRangeList ranges): SharedMemoryInternalRead(p, RegionOnly{}) {
+		stripes = p.lock_stripes(ranges, false);
+	}
+	SharedMemoryInternalRead(SharedMemoryInternal& p, try_to_lock_type): p(p), biased(p.try_lock_biased()) {
+		if (biased) {
+			mapping = p.mapping();
+		}
+		else {
+			lock = sharable_lock<interprocess_upgradable_mutex>(p.get_sync().mut, try_to_lock);
+			if (!lock) {
+				return;
+			}
+			if (!p.try_begin_region_read()) {
+				lock.unlock();
+				return;
+			}
+			region = true;
+			mapping = p.update_mapping();
+		}
+	}
+	bool is_locked() const {
+		return biased || lock;
+	}
+	const uint8_t* data() const {
+		return mapping->data();
+	}
+	size_t size() const {
+		return mapping->size();
+	}
+	SharedMemoryInternalRead(SharedMemoryInternalRead&& other) noexcept:
+		p(other.p), lock(std::move(other.lock)), biased(other.biased), region(other.region), mapping(other.mapping), stripes(other.stripes)
+	{
+		other.biased = false;
+		other.region = false;
+		other.stripes = 0;
+	}
+	~SharedMemoryInternalRead() {
+		p.unlock_stripes(stripes, false);
+		if (region) {
+			p.end_region_read();
+		}
+		if (biased) {
+			p.unlock_biased();
+		}
+	}
 };
 
 class SharedMemoryInternalWrite {
 public:
 	SharedMemoryInternal& p;
-	scoped_lock<interprocess_upgradable_mutex> lock;
+	scoped_lock<interprocess_upgradable_mutex> lock; // of whole region
+	sharable_lock<interprocess_upgradable_mutex> shared; // for range lock
+	const SharedMemoryInternal::Mapping* mapping = nullptr;
+	uint64_t stripes = 0; // locked exclusively
 	
-	SharedMemoryInternalWrite(SharedMemoryInternal& p): p(p), lock(p.get_sync().mut) {}
+	// marked ranges, sorted by offset and not overlapping
+	struct Mark {
+		size_t offset, end;
+	};
+	Mark marks[SharedMemoryInternal::dirty_marks];
+	int mark_count = 0;
+	bool default_marks = false; // locked ranges, replaced by first mark_dirty()
+	
+	SharedMemoryInternalWrite(SharedMemoryInternal& p): p(p), lock(p.get_sync().mut) {
+		mapping = p.update_mapping();
+		p.revoke_bias();
+		begin();
+	}
+	// Doesn't wait for readers either
+	SharedMemoryInternalWrite(SharedMemoryInternal& p, try_to_lock_type): p(p), lock(p.get_sync().mut, try_to_lock) {
+		if (lock) {
+			mapping = p.update_mapping();
+			if (!p.revoke_bias(false)) {
+				lock.unlock();
+				return;
+			}
+			begin();
+		}
+	}
+	bool is_locked() const {
+		return lock || shared;
+	}
+	uint8_t* data() const {
+		return mapping->data();
+	}
+	size_t size() const {
+		return mapping->size();
+	}
+	SharedMemoryInternalWrite(SharedMemoryInternal& p, SharedMemoryRangeList ranges): p(p), shared(p.get_sync().mut) {
+		mapping = p.update_mapping();
+		p.begin_range_write();
+		stripes = p.lock_stripes(ranges, true);
+		std::atomic_thread_fence(std::memory_order_release); // counter must be visible before data changes
+		for (auto& range : ranges) {
+			mark_dirty(range.offset, range.length);
+		}
+		default_marks = true;
+	}
+	SharedMemoryInternalWrite(SharedMemoryInternalWrite&& other) noexcept:
+		p(other.p), lock(std::move(other.lock)), shared(std::move(other.shared)), mapping(other.mapping), stripes(other.stripes),
+		mark_count(other.mark_count), default_marks(other.default_marks)
+	{
+		std::copy(other.marks, other.marks + mark_count, marks);
+		other.stripes = 0;
+	}
+	~SharedMemoryInternalWrite() {
+		if (!lock && !shared) {
+			return; // moved from
+		}
+		auto& sync = p.get_sync();
+		if (lock) {
+			log_dirty();
+			sync.seq.fetch_add(1, std::memory_order_release);
+		}
+		else {
+			{
+				scoped_lock<interprocess_mutex> log_lock(sync.log_mut);
+				log_dirty();
+				sync.seq.fetch_add(2, std::memory_order_release);
+			}
+			p.unlock_stripes(stripes, true);
+			p.end_range_write();
+		}
+		sync.changed.fetch_add(1); // seq_cst, pairs with change_waiters
+		if (sync.change_waiters.load()) {
+			futex_wake(sync.changed);
+		}
+	}
+	
+	void begin() {
+		p.shrink_if_possible();
+		p.get_sync().seq.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release); // seq must be visible before data changes
+	}
+	void mark_dirty(size_t offset, size_t length) {
+		if (default_marks) {
+			default_marks = false;
+			mark_count = 0;
+		}
+		size_t end = offset + std::min(length, size() - std::min(offset, size()));
+		if (offset >= end) {
+			return;
+		}
+		// merge with all overlapping or adjacent marks
+		int first = 0;
+		while (first < mark_count && marks[first].end < offset) {
+			first++;
+		}
+		int last = first;
+		while (last < mark_count && marks[last].offset <= end) {
+			offset = std::min(offset, marks[last].offset);
+			end = std::max(end, marks[last].end);
+			last++;
+		}
+		if (first == last && mark_count == SharedMemoryInternal::dirty_marks) {
+			// no space, merge with the closest neighbour
+			if (first == mark_count || (first && offset - marks[first - 1].end < marks[first].offset - end)) {
+				first--;
+				offset = marks[first].offset;
+			}
+			else {
+				end = marks[first].end;
+			}
+			last = first + 1;
+		}
+		if (first == last) {
+			// new mark is inserted, so following ones move right; ranges overlap
+			std::move_backward(marks + first, marks + mark_count, marks + mark_count + 1);
+		}
+		else {
+			std::move(marks + last, marks + mark_count, marks + first + 1);
+		}
+		mark_count -= last - first - 1;
+		marks[first] = {offset, end};
+	}
+	void log_dirty() {
+		auto& sync = p.get_sync();
+		const uint64_t version = sync.seq.load(std::memory_order_relaxed) / 2 + 1;
+		if (!mark_count && !default_marks) {
+			mark_count = 1;
+			marks[0] = {0, size()};
+		}
+		for (int i = 0; i < mark_count; i++) {
+			sync.dirty_log[sync.dirty_count % SharedMemoryInternal::dirty_log_size] = {version, marks[i].offset, marks[i].end - marks[i].offset};
+			sync.dirty_count++;
+			if (marks[i].offset < marks[i].end) {
+				const uint64_t first = marks[i].offset >> SharedMemoryInternal::chunk_shift;
+				const uint64_t last = (marks[i].end - 1) >> SharedMemoryInternal::chunk_shift;
+				for (uint64_t c = first; c <= last && c - first < SharedMemoryInternal::chunk_slots; c++) {
+					sync.chunk_versions[c % SharedMemoryInternal::chunk_slots] = version;
+				}
+			}
+		}
+	}
 };
 
 
-static std::unique_ptr<SharedMemoryInternal> create_shared_memory(const std::string& name, bool allow_existing) {
+static std::unique_ptr<SharedMemoryInternal> create_shared_memory(const std::string& name, bool allow_existing, const NumaPolicy& numa) {
     auto p = std::make_unique<SharedMemoryInternal>();
     if (allow_existing) {
-        p->create<open_or_create_t>(name);
+        p->create<open_or_create_t>(name, numa);
     }
     else {
-        p->create<create_only_t>(name);
+        p->create<create_only_t>(name, numa);
     }
     return p;
 }
@@ -88,37 +902,117 @@ static std::unique_ptr<SharedMemoryInternal> open_shared_memory(const std::strin
     p->open(name);
     return p;
 }
+SharedMemory SharedMemory::create_file(const std::string& path) {
+    auto p = std::make_unique<SharedMemoryInternal>();
+    p->create_file(path);
+    return SharedMemory(std::move(p));
+}
+SharedMemory SharedMemory::open_file(const std::string& path) {
+    auto p = std::make_unique<SharedMemoryInternal>();
+    p->open_file(path);
+    return SharedMemory(std::move(p));
+}
 void SharedMemory::remove(const std::string& name) noexcept {
     shared_memory_object::remove(name.c_str());
 }
 
 
+// Lock objects are constructed in place, inside fixed-size buffer of public class
+template <typename Internal, size_t size, size_t align, typename... Args>
+static Internal *construct_lock(unsigned char *storage, Args&&... args) {
+	static_assert(sizeof(Internal) <= size, "lock storage is too small, increase it (this changes ABI)");
+	static_assert(alignof(Internal) <= align, "lock storage is not aligned enough");
+	return new(storage) Internal(std::forward<Args>(args)...);
+}
+
+
 const uint8_t *SharedMemoryReadLock::data() const noexcept {
-    return p->p.get_data();
+    return p->data();
 }
 size_t SharedMemoryReadLock::size() const noexcept {
-    return p->p.get_size();
+    return p->size();
+}
+SharedMemoryReadLock::SharedMemoryReadLock(SharedMemoryInternal& p):
+	p(construct_lock<SharedMemoryInternalRead, storage_size, storage_align>(storage, p)) {}
+SharedMemoryReadLock::SharedMemoryReadLock(SharedMemoryInternal& p, SharedMemoryRange range):
+	p(construct_lock<SharedMemoryInternalRead, storage_size, storage_align>(storage, p, SharedMemoryRangeList{&range, &range + 1})) {}
+SharedMemoryReadLock::SharedMemoryReadLock(SharedMemoryInternal& p, const std::vector<SharedMemoryRange>& ranges):
+	p(construct_lock<SharedMemoryInternalRead, storage_size, storage_align>(storage, p, SharedMemoryRangeList{ranges.data(), ranges.data() + ranges.size()})) {}
+SharedMemoryReadLock::SharedMemoryReadLock(SharedMemoryInternal& p, TryLock):
+	p(construct_lock<SharedMemoryInternalRead, storage_size, storage_align>(storage, p, try_to_lock))
+{
+	if (!this->p->is_locked()) {
+		this->p->~SharedMemoryInternalRead();
+		this->p = nullptr;
+	}
+}
+SharedMemoryReadLock::~SharedMemoryReadLock() noexcept {
+	if (p) {
+		p->~SharedMemoryInternalRead();
+	}
+}
+SharedMemoryReadLock::SharedMemoryReadLock(SharedMemoryReadLock&& other) noexcept {
+	if (other.p) {
+		p = construct_lock<SharedMemoryInternalRead, storage_size, storage_align>(storage, std::move(*other.p));
+		other.p->~SharedMemoryInternalRead();
+		other.p = nullptr;
+	}
+}
+SharedMemoryReadLock& SharedMemoryReadLock::operator=(SharedMemoryReadLock&& other) {
+	if (this != &other) {
+		this->~SharedMemoryReadLock();
+		new(this) SharedMemoryReadLock(std::move(other));
+	}
+	return *this;
 }
-SharedMemoryReadLock::SharedMemoryReadLock(SharedMemoryInternal& p): p(std::make_unique<SharedMemoryInternalRead>(p)) {}
-SharedMemoryReadLock::~SharedMemoryReadLock() noexcept {}
-SharedMemoryReadLock::SharedMemoryReadLock(SharedMemoryReadLock&& other) noexcept = default;
-SharedMemoryReadLock& SharedMemoryReadLock::operator=(SharedMemoryReadLock&& other) = default;
 
 
 uint8_t *SharedMemoryWriteLock::data() const noexcept {
-    return p->p.get_data();
+    return p->data();
 }
 size_t SharedMemoryWriteLock::size() const noexcept {
-    return p->p.get_size();
+    return p->size();
+}
+void SharedMemoryWriteLock::mark_dirty(size_t offset, size_t length) noexcept {
+	p->mark_dirty(offset, length);
+}
+SharedMemoryWriteLock::SharedMemoryWriteLock(SharedMemoryInternal& p):
+	p(construct_lock<SharedMemoryInternalWrite, storage_size, storage_align>(storage, p)) {}
+SharedMemoryWriteLock::SharedMemoryWriteLock(SharedMemoryInternal& p, SharedMemoryRange range):
+	p(construct_lock<SharedMemoryInternalWrite, storage_size, storage_align>(storage, p, SharedMemoryRangeList{&range, &range + 1})) {}
+SharedMemoryWriteLock::SharedMemoryWriteLock(SharedMemoryInternal& p, const std::vector<SharedMemoryRange>& ranges):
+	p(construct_lock<SharedMemoryInternalWrite, storage_size, storage_align>(storage, p, SharedMemoryRangeList{ranges.data(), ranges.data() + ranges.size()})) {}
+SharedMemoryWriteLock::SharedMemoryWriteLock(SharedMemoryInternal& p, TryLock):
+	p(construct_lock<SharedMemoryInternalWrite, storage_size, storage_align>(storage, p, try_to_lock))
+{
+	if (!this->p->is_locked()) {
+		this->p->~SharedMemoryInternalWrite();
+		this->p = nullptr;
+	}
+}
+SharedMemoryWriteLock::~SharedMemoryWriteLock() noexcept {
+	if (p) {
+		p->~SharedMemoryInternalWrite();
+	}
+}
+SharedMemoryWriteLock::SharedMemoryWriteLock(SharedMemoryWriteLock&& other) noexcept {
+	if (other.p) {
+		p = construct_lock<SharedMemoryInternalWrite, storage_size, storage_align>(storage, std::move(*other.p));
+		other.p->~SharedMemoryInternalWrite();
+		other.p = nullptr;
+	}
+}
+SharedMemoryWriteLock& SharedMemoryWriteLock::operator=(SharedMemoryWriteLock&& other) {
+	if (this != &other) {
+		this->~SharedMemoryWriteLock();
+		new(this) SharedMemoryWriteLock(std::move(other));
+	}
+	return *this;
 }
-SharedMemoryWriteLock::SharedMemoryWriteLock(SharedMemoryInternal& p): p(std::make_unique<SharedMemoryInternalWrite>(p)) {}
-SharedMemoryWriteLock::~SharedMemoryWriteLock() noexcept {}
-SharedMemoryWriteLock::SharedMemoryWriteLock(SharedMemoryWriteLock&& other) noexcept = default;
-SharedMemoryWriteLock& SharedMemoryWriteLock::operator=(SharedMemoryWriteLock&& other) = default;
 
 
-SharedMemory SharedMemory::create(const std::string& name, bool allow_existing) {
-    return SharedMemory(create_shared_memory(name, allow_existing));
+SharedMemory SharedMemory::create(const std::string& name, bool allow_existing, const NumaPolicy& numa) {
+    return SharedMemory(create_shared_memory(name, allow_existing, numa));
 }
 SharedMemory SharedMemory::open(const std::string& name) {
     return SharedMemory(open_shared_memory(name));
@@ -126,14 +1020,24 @@ SharedMemory SharedMemory::open(const std::string& name) {
 SharedMemory::~SharedMemory() noexcept
 {}
 size_t SharedMemory::size() const noexcept {
-    return p->get_size();
+    return p->mapped_size();
 }
 void SharedMemory::resize(size_t new_size) {
-    p->resize(new_size);
+	SharedMemoryInternalWrite write(*p);
+	write.mapping = p->resize(new_size);
 }
 size_t SharedMemory::update_size() {
-	p->update_mapping();
-	return p->get_size();
+	SharedMemoryInternalRead read(*p, SharedMemoryInternalRead::RegionOnly{});
+	return read.size();
+}
+uint8_t *SharedMemory::data() noexcept {
+	return p->exposed_data();
+}
+std::vector<size_t> SharedMemory::numa_pages() const {
+	return p->numa_pages();
+}
+size_t SharedMemory::checkpoint() {
+	return p->checkpoint();
 }
 SharedMemoryReadLock SharedMemory::read_lock() {
     return SharedMemoryReadLock(*p);
@@ -141,7 +1045,268 @@ SharedMemoryReadLock SharedMemory::read_lock() {
 SharedMemoryWriteLock SharedMemory::write_lock() {
     return SharedMemoryWriteLock(*p);
 }
+std::optional<SharedMemoryReadLock> SharedMemory::try_read_lock() {
+	SharedMemoryReadLock lock(*p, SharedMemoryReadLock::TryLock{});
+	if (!lock.p) {
+		return {};
+	}
+	return lock;
+}
+std::optional<SharedMemoryWriteLock> SharedMemory::try_write_lock() {
+	SharedMemoryWriteLock lock(*p, SharedMemoryWriteLock::TryLock{});
+	if (!lock.p) {
+		return {};
+	}
+	return lock;
+}
+SharedMemoryReadLock SharedMemory::read_lock(size_t offset, size_t length) {
+	return SharedMemoryReadLock(*p, SharedMemoryRange{offset, length});
+}
+SharedMemoryWriteLock SharedMemory::write_lock(size_t offset, size_t length) {
+	return SharedMemoryWriteLock(*p, SharedMemoryRange{offset, length});
+}
+SharedMemoryReadLock SharedMemory::read_lock(const std::vector<SharedMemoryRange>& ranges) {
+	return SharedMemoryReadLock(*p, ranges);
+}
+SharedMemoryWriteLock SharedMemory::write_lock(const std::vector<SharedMemoryRange>& ranges) {
+	return SharedMemoryWriteLock(*p, ranges);
+}
+bool SharedMemory::try_read(const std::function<void(const uint8_t *data, size_t size)>& reader) {
+	if (p->is_resized()) {
+		update_size();
+	}
+	SharedMemoryInternal::Pin pin(*p); // mapping is kept while reading, even if other thread remaps
+	auto& seq = p->get_sync().seq;
+	auto& range_writers = p->get_sync().range_writers;
+	const uint64_t begin = seq.load(std::memory_order_acquire);
+	if ((begin & 1) || range_writers.load(std::memory_order_acquire)) {
+		return false;
+	}
+	reader(pin.mapping->data(), pin.mapping->size());
+	std::atomic_thread_fence(std::memory_order_acquire); // data reads can't be moved after seq check
+	return seq.load(std::memory_order_relaxed) == begin && !range_writers.load(std::memory_order_relaxed);
+}
+void SharedMemory::read_consistent(const std::function<void(const uint8_t *data, size_t size)>& reader) {
+	for (int i = 0; !try_read(reader); i++) {
+		if (i >= 100) {
+			std::this_thread::yield(); // writer holds lock for long
+		}
+	}
+}
+uint64_t SharedMemory::version() const noexcept {
+	return p->get_sync().seq.load(std::memory_order_acquire) / 2;
+}
+uint64_t SharedMemory::wait_for_change(uint64_t last_version, std::chrono::milliseconds timeout) {
+	auto& sync = p->get_sync();
+	const bool infinite = timeout == std::chrono::milliseconds::max();
+	const auto deadline = infinite ? std::chrono::steady_clock::time_point::max() : std::chrono::steady_clock::now() + timeout;
+	
+	sync.change_waiters.fetch_add(1);
+	struct Leave {
+		std::atomic<uint32_t>& waiters;
+		~Leave() { waiters.fetch_sub(1); }
+	} leave{sync.change_waiters};
+	
+	while (true) {
+		const uint32_t changed = sync.changed.load();
+		const uint64_t current = version();
+		if (current != last_version) {
+			return current;
+		}
+		
+		std::chrono::nanoseconds left = std::chrono::nanoseconds::max();
+		if (!infinite) {
+			left = deadline - std::chrono::steady_clock::now();
+			if (left.count() <= 0) {
+				return current;
+			}
+		}
+		futex_wait(sync.changed, changed, left);
+	}
+}
+SharedMemorySnapshot SharedMemory::snapshot() {
+	using Data = SharedMemorySnapshotData;
+	constexpr size_t page_size = SharedMemorySnapshot::page_size;
+	constexpr int max_unlocked_attempts = 4;
+	static_assert(Data::chunk_pages * page_size == size_t(1) << SharedMemoryInternal::chunk_shift, "chunk sizes must match");
+	auto& sync = p->get_sync();
+	auto& last = p->last_snapshot;
+	
+	// Pages are copied without lock and validated like try_read(). Pages written meanwhile
+	// are found in dirty log and copied again; last attempt is done under read lock,
+	// so writers can't starve snapshot
+	std::shared_ptr<Data> data; // pages are up to date at data->version, except ones written after it
+	std::vector<bool> cloned; // chunk isn't shared with last snapshot
+	std::vector<SharedMemoryInternal::DirtyRange> ranges;
+	for (int attempt = 0; ; attempt++) {
+		std::optional<SharedMemoryInternalRead> read;
+		if (attempt >= max_unlocked_attempts) {
+			read.emplace(*p);
+		}
+		else if (p->is_resized()) {
+			update_size();
+		}
+		SharedMemoryInternal::Pin pin(*p); // same as mapping of read lock, if it's taken
+		const uint64_t begin = sync.seq.load(std::memory_order_acquire);
+		if (!read && ((begin & 1) || sync.range_writers.load(std::memory_order_acquire) ||
+			pin.mapping->generation != sync.generation.load(std::memory_order_acquire)))
+		{
+			std::this_thread::yield(); // writer is active or has just resized
+			continue;
+		}
+		const uint8_t* src = pin.mapping->data();
+		const size_t size = pin.mapping->size();
+		const uint64_t current = begin / 2;
+		
+		ranges.clear();
+		scoped_lock<interprocess_mutex> log_lock(sync.log_mut);
+		if (!data && last && last->version == current && last->size == size) {
+			return SharedMemorySnapshot(last);
+		}
+		const Data* from = data ? data.get() : last.get();
+		const bool incremental = from && from->size == size;
+		if (incremental && !p->get_dirty(from->version, ranges)) {
+			p->get_dirty_chunks(from->version, size, ranges);
+		}
+		log_lock.unlock();
+		if (!data) {
+			data = std::make_shared<Data>();
+			if (incremental) {
+				data->chunks = last->chunks;
+				cloned.assign(data->chunks.size(), false);
+			}
+		}
+		
+		auto copy_page = [&](size_t index) {
+			auto page = std::make_shared<Data::Page>();
+			const size_t offset = index * page_size;
+			std::memcpy(page->data(), src + offset, std::min(page_size, size - offset));
+			return page;
+		};
+		data->version = current;
+		data->size = size;
+		data->page_count = (size + page_size - 1) / page_size;
+		if (incremental) {
+			// same pages are often modified by several writes
+			std::sort(ranges.begin(), ranges.end(), [](auto& a, auto& b) {return a.offset < b.offset;});
+			size_t next_page = 0; // pages before it are already copied
+			for (auto& range : ranges) {
+				const size_t end = std::min<size_t>(range.offset + range.length, size);
+				if (range.offset >= end) {
+					continue;
+				}
+				const size_t last_page = (end - 1) / page_size;
+				for (size_t i = std::max<size_t>(range.offset / page_size, next_page); i <= last_page; i++) {
+					const size_t c = i / Data::chunk_pages;
+					if (!cloned[c]) {
+						data->chunks[c] = std::make_shared<Data::Chunk>(*data->chunks[c]);
+						cloned[c] = true;
+					}
+					(*data->chunks[c])[i % Data::chunk_pages] = copy_page(i);
+				}
+				next_page = std::max(next_page, last_page + 1);
+			}
+		}
+		else {
+			data->chunks.resize((data->page_count + Data::chunk_pages - 1) / Data::chunk_pages);
+			for (size_t c = 0; c < data->chunks.size(); c++) {
+				data->chunks[c] = std::make_shared<Data::Chunk>();
+				for (size_t i = c * Data::chunk_pages; i < std::min(data->page_count, (c + 1) * Data::chunk_pages); i++) {
+					(*data->chunks[c])[i % Data::chunk_pages] = copy_page(i);
+				}
+			}
+			cloned.assign(data->chunks.size(), true);
+		}
+		
+		std::atomic_thread_fence(std::memory_order_acquire); // data reads can't be moved after seq check
+		if (read || (sync.seq.load(std::memory_order_relaxed) == begin && !sync.range_writers.load(std::memory_order_relaxed))) {
+			break;
+		}
+	}
+	last = data;
+	return SharedMemorySnapshot(std::move(data));
+}
 SharedMemory::SharedMemory(std::unique_ptr<SharedMemoryInternal> p): p(std::move(p)) {}
 SharedMemory::SharedMemory(SharedMemory&&) noexcept = default;
 
+
+
+size_t SharedMemoryMirror::refresh() {
+	auto lock = shm.read_lock();
+	auto& p = *shm.p;
+	
+	// read lock excludes range writers, so all their ranges are already logged
+	std::vector<SharedMemoryInternal::DirtyRange> ranges;
+	scoped_lock<interprocess_mutex> log_lock(p.get_sync().log_mut);
+	const uint64_t current = p.get_sync().seq.load(std::memory_order_relaxed) / 2;
+	if (valid && current == copy_version) {
+		return 0;
+	}
+	const bool log_complete = valid && p.get_dirty(copy_version, ranges);
+	log_lock.unlock();
+	
+	if (!log_complete || copy.size() != lock.size()) {
+		copy.assign(lock.data(), lock.data() + lock.size());
+		copy_version = current;
+		valid = true;
+		return copy.size();
+	}
+	
+	// same bytes are often modified by several writes
+	std::sort(ranges.begin(), ranges.end(), [](auto& a, auto& b) {return a.offset < b.offset;});
+	size_t copied = 0;
+	size_t copied_end = 0;
+	for (auto& range : ranges) {
+		const size_t offset = std::min<size_t>(std::max<size_t>(range.offset, copied_end), copy.size());
+		const size_t end = std::min<size_t>(range.offset + range.length, copy.size());
+		if (offset < end) {
+			std::memcpy(copy.data() + offset, lock.data() + offset, end - offset);
+			copied += end - offset;
+			copied_end = end;
+		}
+	}
+	copy_version = current;
+	return copied;
+}
+const uint8_t *SharedMemoryMirror::data() const noexcept {
+	return copy.data();
+}
+size_t SharedMemoryMirror::size() const noexcept {
+	return copy.size();
+}
+uint64_t SharedMemoryMirror::version() const noexcept {
+	return copy_version;
+}
+SharedMemoryMirror::SharedMemoryMirror(SharedMemory& shm): shm(shm) {}
+
+
+
+size_t SharedMemorySnapshot::size() const noexcept {
+	return p->size;
+}
+uint64_t SharedMemorySnapshot::version() const noexcept {
+	return p->version;
+}
+void SharedMemorySnapshot::read(size_t offset, size_t length, void *out) const {
+	if (offset > p->size || length > p->size - offset) {
+		throw std::out_of_range("SharedMemorySnapshot::read() range is outside of data");
+	}
+	auto dst = static_cast<uint8_t*>(out);
+	while (length) {
+		const size_t in_page = offset % page_size;
+		const size_t n = std::min(length, page_size - in_page);
+		std::memcpy(dst, p->page(offset / page_size).data() + in_page, n);
+		dst += n;
+		offset += n;
+		length -= n;
+	}
+}
+const uint8_t *SharedMemorySnapshot::page(size_t index) const noexcept {
+	return p->page(index).data();
+}
+size_t SharedMemorySnapshot::page_count() const noexcept {
+	return p->page_count;
+}
+SharedMemorySnapshot::SharedMemorySnapshot(std::shared_ptr<const SharedMemorySnapshotData> p): p(std::move(p)) {}
+
 } // namespace ipclib
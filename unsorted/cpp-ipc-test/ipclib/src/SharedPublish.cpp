@@ -0,0 +1,300 @@
+#include "ipclib/SharedPublish.h"
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/interprocess/sync/interprocess_mutex.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
+
+using namespace boost::interprocess;
+
+namespace ipclib
+{
+
+/*
+
+	Header shm object contains only Sync; each buffer is separate shm object
+	named <name>_<generation>, so it can be resized by replacing it.
+	
+	Reader pins version by storing current value in its slot and checking
+	that current value hasn't changed meanwhile. Writer, holding mutex, marks
+	current buffer and buffers of all pinned values as used and writes into other one.
+	Both use seq_cst, so if reader's check succeeded, writer's scan after
+	next publish is guaranteed to see the pin.
+
+*/
+
+class PublishInternal {
+public:
+    static constexpr int max_readers = 62;
+    static constexpr int max_buffers = max_readers + 2; // each reader may pin different one
+    static constexpr int index_bits = 8;
+    static constexpr uint64_t index_mask = (1 << index_bits) - 1;
+
+    // modified only by writer, only while buffer is neither current nor pinned
+    struct Buffer {
+        uint64_t generation = 0; // 0 if shm object doesn't exist
+        size_t capacity = 0;
+        size_t size = 0;
+    };
+    struct Slot {
+        alignas(64) std::atomic<uint64_t> pinned{0}; // value of current, 0 if none
+        bool used = false; // protected by mutex
+    };
+    struct Sync {
+        interprocess_mutex mut; // for writers and slot registration
+        int buffers_kept = 0;
+        uint64_t generation_counter = 0;
+        alignas(64) std::atomic<uint64_t> current{0}; // (version << index_bits) | buffer index
+        Buffer buffers[max_buffers];
+        Slot slots[max_readers];
+    };
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "atomics must be lock-free to be shared between processes");
+
+    void create(const std::string& name, bool allow_existing, const PublishOptions& options) {
+        this->name = name;
+        try {
+            shm = shared_memory_object(create_only, name.c_str(), read_write);
+        }
+        catch (interprocess_exception&) {
+            if (!allow_existing) {
+                throw;
+            }
+            open(name, true); // keep published data
+            return;
+        }
+        shm.truncate(sizeof(Sync));
+        region = mapped_region(shm, read_write);
+        new(&sync()) Sync();
+        sync().buffers_kept = std::max(2, std::min(options.buffers, max_buffers));
+        cache.resize(max_buffers);
+        is_writer = true;
+    }
+    void open(const std::string& name, bool is_writer) {
+        this->name = name;
+        this->is_writer = is_writer;
+        shm = shared_memory_object(open_only, name.c_str(), read_write);
+        region = mapped_region(shm, read_write);
+        cache.resize(max_buffers);
+        if (is_writer) {
+            return;
+        }
+
+        scoped_lock<interprocess_mutex> lock(sync().mut);
+        for (int i = 0; i < max_readers; i++) {
+            if (!sync().slots[i].used) {
+                sync().slots[i].used = true;
+                slot = i;
+                return;
+            }
+        }
+        throw std::runtime_error("PublishReader::open() all reader slots are taken");
+    }
+    ~PublishInternal() {
+        if (slot != -1) {
+            scoped_lock<interprocess_mutex> lock(sync().mut);
+            sync().slots[slot].pinned = 0;
+            sync().slots[slot].used = false;
+        }
+    }
+    static void remove(const std::string& name) {
+        try {
+            shared_memory_object shm(open_only, name.c_str(), read_write);
+            mapped_region region(shm, read_write);
+            auto& sync = *static_cast<Sync*>(region.get_address());
+            scoped_lock<interprocess_mutex> lock(sync.mut);
+            for (auto& b : sync.buffers) {
+                if (b.generation) {
+                    shared_memory_object::remove(buffer_name(name, b.generation).c_str());
+                }
+            }
+        }
+        catch (interprocess_exception&) {
+            // doesn't exist
+        }
+        shared_memory_object::remove(name.c_str());
+    }
+
+    Sync& sync() {
+        return *static_cast<Sync*>(region.get_address());
+    }
+
+    uint64_t publish(size_t size, const std::function<void(uint8_t *data)>& writer) {
+        scoped_lock<interprocess_mutex> lock(sync().mut);
+        const uint64_t current = sync().current.load();
+
+        bool used[max_buffers];
+        mark_used(used);
+
+        // prefer buffer which is big enough, then any existing one
+        int index = -1;
+        for (int pass = 0; pass < 3 && index == -1; pass++) {
+            for (int i = 0; i < max_buffers; i++) {
+                auto& b = sync().buffers[i];
+                if (!used[i] && (pass == 2 || (b.generation && (pass == 1 || b.capacity >= size)))) {
+                    index = i;
+                    break;
+                }
+            }
+        }
+
+        auto& b = sync().buffers[index];
+        if (!b.generation || b.capacity < size) {
+            release_buffer(index);
+            const size_t capacity = std::max<size_t>(4096, size + size / 4); // some room for growth
+            const uint64_t generation = ++sync().generation_counter;
+            shared_memory_object buffer(create_only, buffer_name(name, generation).c_str(), read_write);
+            buffer.truncate(capacity);
+            b.generation = generation;
+            b.capacity = capacity;
+        }
+        writer(map(index));
+        b.size = size;
+
+        const uint64_t version = (current >> index_bits) + 1;
+        sync().current.store((version << index_bits) | index);
+
+        reclaim();
+        return version;
+    }
+
+    uint64_t read(const std::function<void(const uint8_t *data, size_t size)>& reader) {
+        auto& pinned = sync().slots[slot].pinned;
+        uint64_t value;
+        do {
+            value = sync().current.load();
+            if (!value) {
+                return 0;
+            }
+            pinned.store(value);
+        }
+        while (sync().current.load() != value);
+
+        struct Unpin { // reader may throw
+            std::atomic<uint64_t>& pinned;
+            ~Unpin() { pinned.store(0, std::memory_order_release); }
+        } unpin{pinned};
+
+        if (value != last_read) {
+            drop_replaced();
+            last_read = value;
+        }
+        const int index = value & index_mask;
+        reader(map(index), sync().buffers[index].size);
+        return value >> index_bits;
+    }
+    uint64_t version() {
+        return sync().current.load(std::memory_order_relaxed) >> index_bits;
+    }
+
+private:
+    std::string name;
+    bool is_writer = false;
+    int slot = -1; // of reader
+    shared_memory_object shm;
+    mapped_region region;
+
+    struct Mapping {
+        uint64_t generation = 0;
+        mapped_region region;
+    };
+    std::vector<Mapping> cache; // mapped buffers, by index
+    uint64_t last_read = 0; // value of current, cache is checked when it changes
+
+    static std::string buffer_name(const std::string& name, uint64_t generation) {
+        return name + "_" + std::to_string(generation);
+    }
+
+    void mark_used(bool (&used)[max_buffers]) {
+        std::fill(used, used + max_buffers, false);
+        if (auto current = sync().current.load()) {
+            used[current & index_mask] = true;
+        }
+        for (auto& s : sync().slots) {
+            if (auto value = s.pinned.load()) {
+                used[value & index_mask] = true;
+            }
+        }
+    }
+
+    uint8_t* map(int index) {
+        auto& m = cache[index];
+        const uint64_t generation = sync().buffers[index].generation;
+        if (m.generation != generation) {
+            const auto mode = is_writer ? read_write : read_only;
+            shared_memory_object buffer(open_only, buffer_name(name, generation).c_str(), mode);
+            m.region = mapped_region(buffer, mode);
+            m.generation = generation;
+        }
+        return static_cast<uint8_t*>(m.region.get_address());
+    }
+    // Unmaps buffers which writer has removed or replaced, so idle reader doesn't keep them allocated.
+    // Generation of buffer which isn't pinned may be changed meanwhile - then it's dropped next time
+    void drop_replaced() {
+        for (int i = 0; i < max_buffers; i++) {
+            if (cache[i].generation && cache[i].generation != sync().buffers[i].generation) {
+                cache[i] = Mapping();
+            }
+        }
+    }
+    void release_buffer(int index) {
+        auto& b = sync().buffers[index];
+        if (b.generation) {
+            shared_memory_object::remove(buffer_name(name, b.generation).c_str());
+            b = Buffer();
+        }
+        cache[index] = Mapping();
+    }
+    // removes buffers which aren't used, above the number which is kept
+    void reclaim() {
+        bool used[max_buffers];
+        mark_used(used);
+        int existing = 0;
+        for (auto& b : sync().buffers) {
+            existing += b.generation ? 1 : 0;
+        }
+        for (int i = 0; i < max_buffers && existing > sync().buffers_kept; i++) {
+            if (!used[i] && sync().buffers[i].generation) {
+                release_buffer(i);
+                existing--;
+            }
+        }
+        drop_replaced(); // other writer may have replaced them
+    }
+};
+
+
+uint64_t PublishWriter::publish(size_t size, const std::function<void(uint8_t *data)>& writer) {
+    return p->publish(size, writer);
+}
+PublishWriter PublishWriter::create(const std::string& name, bool allow_existing, const PublishOptions& options) {
+    auto p = std::make_unique<PublishInternal>();
+    p->create(name, allow_existing, options);
+    return PublishWriter(std::move(p));
+}
+void PublishWriter::remove(const std::string& name) noexcept {
+    PublishInternal::remove(name);
+}
+PublishWriter::~PublishWriter() noexcept = default;
+PublishWriter::PublishWriter(PublishWriter&&) noexcept = default;
+PublishWriter::PublishWriter(std::unique_ptr<PublishInternal> p): p(std::move(p)) {}
+
+
+uint64_t PublishReader::read(const std::function<void(const uint8_t *data, size_t size)>& reader) {
+    return p->read(reader);
+}
+uint64_t PublishReader::version() const noexcept {
+    return p->version();
+}
+PublishReader PublishReader::open(const std::string& name) {
+    auto p = std::make_unique<PublishInternal>();
+    p->open(name, false);
+    return PublishReader(std::move(p));
+}
+PublishReader::~PublishReader() noexcept = default;
+PublishReader::PublishReader(PublishReader&&) noexcept = default;
+PublishReader::PublishReader(std::unique_ptr<PublishInternal> p): p(std::move(p)) {}
+
+} // namespace ipclib
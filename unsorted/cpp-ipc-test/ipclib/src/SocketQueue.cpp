@@ -0,0 +1,537 @@
+#include "SocketQueue.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace ipclib
+{
+
+#ifdef __linux__
+
+namespace
+{
+
+constexpr uint64_t hello_timeout = 1000 * 1000 * 1000; // nanoseconds; peer sends hello right after connecting
+constexpr int memfd_seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE; // so mapped message can't change under consumer
+
+uint64_t now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+[[noreturn]] void throw_errno(const char *what) {
+	throw std::system_error(errno, std::generic_category(), what);
+}
+
+sockaddr_un make_address(const std::string& path) {
+	sockaddr_un addr{};
+	if (path.size() >= sizeof(addr.sun_path)) {
+		throw std::invalid_argument("Queue::create() socket path is too long");
+	}
+	addr.sun_family = AF_UNIX;
+	std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+	return addr;
+}
+
+// closes descriptor at the end of scope, unless it's taken
+struct FdGuard {
+	int fd;
+	~FdGuard() {
+		if (fd != -1) {
+			close(fd);
+		}
+	}
+};
+struct MapGuard {
+	void *mem;
+	size_t size;
+	~MapGuard() {
+		munmap(mem, size);
+	}
+};
+
+} // namespace
+
+
+SocketQueue::SocketQueue(const std::string& path, bool is_producer, bool is_creator, bool allow_existing, const QueueOptions& options):
+	is_producer(is_producer)
+{
+	if (!is_producer) {
+		cancel_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (cancel_fd == -1) {
+			throw_errno("Queue::create() eventfd() failed");
+		}
+	}
+	try {
+		if (!is_creator || !listen(path, allow_existing)) {
+			connect(path);
+		}
+	}
+	catch (...) {
+		if (cancel_fd != -1) {
+			close(cancel_fd);
+		}
+		throw;
+	}
+	if (is_listener) {
+		ttl = options.ttl.count();
+	}
+}
+SocketQueue::~SocketQueue() noexcept {
+	for (int i = next_slot; i < received; i++) {
+		if (slots[i].fd != -1) {
+			close(slots[i].fd);
+		}
+	}
+	for (int fd : peers) {
+		close(fd);
+	}
+	for (auto& h : handshakes) {
+		close(h.fd);
+	}
+	if (listen_fd != -1) {
+		close(listen_fd);
+		unlink(path.c_str());
+	}
+	if (cancel_fd != -1) {
+		close(cancel_fd);
+	}
+}
+
+// returns false if allow_existing is set and another process already listens
+bool SocketQueue::listen(const std::string& path, bool allow_existing) {
+	const auto addr = make_address(path);
+	FdGuard fd{socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)};
+	if (fd.fd == -1) {
+		throw_errno("Queue::create() socket() failed");
+	}
+	if (bind(fd.fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr))) {
+		if (errno != EADDRINUSE || !allow_existing) {
+			throw_errno("Queue::create() socket bind() failed");
+		}
+		// socket file may be left by crashed process
+		FdGuard probe{socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)};
+		if (probe.fd == -1) {
+			throw_errno("Queue::create() socket() failed");
+		}
+		if (!::connect(probe.fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) || errno != ECONNREFUSED) {
+			return false;
+		}
+		unlink(path.c_str());
+		if (bind(fd.fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr))) {
+			throw_errno("Queue::create() socket bind() failed");
+		}
+	}
+	if (::listen(fd.fd, SOMAXCONN)) {
+		throw_errno("Queue::create() socket listen() failed");
+	}
+	listen_fd = std::exchange(fd.fd, -1);
+	is_listener = true;
+	this->path = path;
+	return true;
+}
+void SocketQueue::connect(const std::string& path) {
+	const auto addr = make_address(path);
+	FdGuard fd{socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)};
+	if (fd.fd == -1) {
+		throw_errno("Queue::open() socket() failed");
+	}
+	if (::connect(fd.fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr))) {
+		throw_errno("Queue::open() socket connect() failed");
+	}
+	const Frame hello{hello_magic, is_producer, 0};
+	if (send(fd.fd, &hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello)) {
+		throw_errno("Queue::open() socket send() failed");
+	}
+	peers.push_back(std::exchange(fd.fd, -1));
+}
+// accepts one pending connection, returns false if there is none. It becomes peer in check_handshakes()
+bool SocketQueue::accept_peer() {
+	const int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+	if (fd == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED) {
+			return false;
+		}
+		throw_errno("Queue socket accept() failed");
+	}
+	handshakes.push_back({fd, now() + hello_timeout});
+	return true;
+}
+// accepts all pending connections and takes hello from those which have sent it, without blocking.
+// Peer of the same kind, peer which has sent something else and one which is silent for too long are dropped
+void SocketQueue::check_handshakes() {
+	while (accept_peer()) {}
+	uint64_t time = 0;
+	for (size_t i = 0; i < handshakes.size();) {
+		const int fd = handshakes[i].fd;
+		Frame hello{};
+		const ssize_t n = recv(fd, &hello, sizeof(hello), MSG_DONTWAIT);
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+			if (!time) {
+				time = now();
+			}
+			if (time < handshakes[i].deadline) {
+				i++;
+				continue;
+			}
+		}
+		if (n == sizeof(hello) && hello.size == hello_magic && hello.timestamp == uint64_t(!is_producer)) {
+			peers.push_back(fd);
+		}
+		else {
+			close(fd);
+		}
+		handshakes.erase(handshakes.begin() + i);
+	}
+}
+void SocketQueue::drop_peer(size_t index) {
+	close(peers[index]);
+	peers.erase(peers.begin() + index);
+}
+
+
+void SocketQueue::write(const std::function<void(void *mem)>& writer, size_t size, uint64_t expires) {
+	const uint64_t timestamp = now();
+	if (!expires && ttl) {
+		expires = timestamp + ttl;
+	}
+	const Frame frame{size, timestamp, expires};
+
+	Pending msg;
+	FdGuard memfd{-1};
+	if (size <= max_inline) {
+		static thread_local std::vector<uint8_t> buffer;
+		if (buffer.size() < sizeof(Frame) + size) {
+			buffer.resize(sizeof(Frame) + size);
+		}
+		std::memcpy(buffer.data(), &frame, sizeof(frame));
+		writer(buffer.data() + sizeof(Frame));
+		msg.data = buffer.data();
+		msg.size = sizeof(Frame) + size;
+	}
+	else {
+		memfd.fd = memfd_create("ipclib_queue", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+		if (memfd.fd == -1) {
+			throw_errno("Queue::write() memfd_create() failed");
+		}
+		if (ftruncate(memfd.fd, size)) {
+			throw_errno("Queue::write() ftruncate() failed");
+		}
+		void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd.fd, 0);
+		if (mem == MAP_FAILED) {
+			throw_errno("Queue::write() mmap() failed");
+		}
+		{
+			MapGuard map{mem, size};
+			writer(mem);
+		}
+		// sealing for writes fails while writable mapping exists
+		if (fcntl(memfd.fd, F_ADD_SEALS, memfd_seals)) {
+			throw_errno("Queue::write() sealing memfd failed");
+		}
+		msg.data = &frame;
+		msg.size = sizeof(frame);
+		msg.fd = memfd.fd;
+	}
+
+	// group send
+	std::unique_lock<std::mutex> lock(send_mut);
+	pending.push_back(&msg);
+	while (!msg.done) {
+		if (sending) {
+			sent.wait(lock);
+			continue;
+		}
+		sending = true;
+		const size_t count = std::min<size_t>(pending.size(), max_send_batch);
+		std::vector<Pending*> batch(pending.begin(), pending.begin() + count);
+		pending.erase(pending.begin(), pending.begin() + count);
+		lock.unlock();
+
+		std::exception_ptr error;
+		try {
+			send_batch(batch);
+		}
+		catch (...) {
+			error = std::current_exception();
+		}
+
+		lock.lock();
+		for (auto m : batch) {
+			m->done = true;
+			m->error = error;
+		}
+		sending = false;
+		sent.notify_all();
+	}
+	if (msg.error) {
+		std::rethrow_exception(msg.error);
+	}
+}
+// returns index of consumer to send next batch to; listening producer waits until there is one
+size_t SocketQueue::pick_consumer() {
+	if (is_listener) {
+		if (peers.empty() || ++batches == accept_interval) {
+			batches = 0;
+			check_handshakes();
+		}
+		std::vector<pollfd> fds;
+		while (peers.empty()) {
+			fds.assign(1, {listen_fd, POLLIN, 0});
+			for (auto& h : handshakes) {
+				fds.push_back({h.fd, POLLIN, 0});
+			}
+			if (poll(fds.data(), fds.size(), -1) == -1 && errno != EINTR) {
+				throw_errno("Queue::write() poll() failed");
+			}
+			check_handshakes();
+		}
+	}
+	else if (peers.empty()) {
+		throw std::system_error(EPIPE, std::generic_category(), "Queue::write() consumer is gone");
+	}
+	next_peer = (next_peer + 1) % peers.size();
+	return next_peer;
+}
+void SocketQueue::send_batch(const std::vector<Pending*>& batch) {
+	union Control {
+		char buf[CMSG_SPACE(sizeof(int))];
+		cmsghdr align;
+	};
+	const size_t count = batch.size();
+	mmsghdr msgs[max_send_batch] = {};
+	iovec iov[max_send_batch];
+	Control control[max_send_batch];
+	for (size_t i = 0; i < count; i++) {
+		iov[i] = {const_cast<void*>(batch[i]->data), batch[i]->size};
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		if (batch[i]->fd != -1) {
+			msgs[i].msg_hdr.msg_control = control[i].buf;
+			msgs[i].msg_hdr.msg_controllen = sizeof(control[i].buf);
+			cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+			std::memcpy(CMSG_DATA(cmsg), &batch[i]->fd, sizeof(int));
+		}
+	}
+
+	for (size_t first = 0; first < count;) {
+		const size_t peer = pick_consumer();
+		const int sent_count = sendmmsg(peers[peer], msgs + first, count - first, MSG_NOSIGNAL);
+		if (sent_count == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EPIPE || errno == ECONNRESET) {
+				drop_peer(peer); // opening producer throws on next pick
+				continue;
+			}
+			throw_errno("Queue::write() sendmmsg() failed");
+		}
+		first += sent_count;
+	}
+}
+
+
+QueueConsumer::ReadRet SocketQueue::read(const std::function<void(const void *mem, size_t size)>& reader) {
+	std::vector<pollfd> fds;
+	while (true) {
+		if (next_slot < received) {
+			if (deliver(slots[next_slot++], reader)) {
+				return ReadRet::ReadOk;
+			}
+			continue;
+		}
+		if (std::exchange(no_producers, false) || (!is_listener && peers.empty())) {
+			return ReadRet::ReadNoProducersLeft;
+		}
+
+		fds.clear();
+		fds.push_back({cancel_fd, POLLIN, 0});
+		if (is_listener) {
+			fds.push_back({listen_fd, POLLIN, 0});
+		}
+		const size_t first_peer = fds.size();
+		for (int fd : peers) {
+			fds.push_back({fd, POLLIN, 0});
+		}
+		const size_t first_handshake = fds.size();
+		for (auto& h : handshakes) {
+			fds.push_back({h.fd, POLLIN, 0});
+		}
+		if (poll(fds.data(), fds.size(), -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw_errno("Queue::read() poll() failed");
+		}
+
+		if (fds[0].revents) {
+			uint64_t value;
+			(void)!::read(cancel_fd, &value, sizeof(value));
+			if (auto ret = ReadRet(cancel.exchange(ReadRet::ReadOk))) {
+				return ret;
+			}
+		}
+
+		// take batch from one peer, in turn; closed ones are dropped after that
+		const size_t count = first_handshake - first_peer;
+		std::vector<int> closed;
+		for (size_t n = 0; n < count && next_slot == received; n++) {
+			const size_t i = (next_peer + n) % count;
+			if (fds[first_peer + i].revents) {
+				if (!receive(peers[i])) {
+					closed.push_back(peers[i]);
+				}
+				next_peer = i + 1;
+			}
+		}
+		for (int fd : closed) {
+			drop_peer(std::find(peers.begin(), peers.end(), fd) - peers.begin());
+		}
+		if (!closed.empty() && peers.empty() && is_listener) {
+			no_producers = true; // returned after messages which are already received
+		}
+
+		if (is_listener && (fds[1].revents || std::any_of(fds.begin() + first_handshake, fds.end(), [](auto& p) { return p.revents; }))) {
+			check_handshakes();
+		}
+	}
+}
+// receives batch of datagrams into slots; returns false if peer has closed connection
+bool SocketQueue::receive(int fd) {
+	static_assert(sizeof(Slot::control) >= CMSG_SPACE(sizeof(int)), "control buffer is too small");
+	if (slots.empty()) {
+		slots.resize(max_receive_batch);
+		for (auto& slot : slots) {
+			slot.data.resize(sizeof(Frame) + max_inline);
+		}
+	}
+
+	mmsghdr msgs[max_receive_batch] = {};
+	iovec iov[max_receive_batch];
+	for (int i = 0; i < max_receive_batch; i++) {
+		iov[i] = {slots[i].data.data(), slots[i].data.size()};
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_control = slots[i].control;
+		msgs[i].msg_hdr.msg_controllen = sizeof(slots[i].control);
+	}
+	const int count = recvmmsg(fd, msgs, max_receive_batch, MSG_DONTWAIT | MSG_CMSG_CLOEXEC, nullptr);
+	if (count == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return true;
+		}
+		if (errno == ECONNRESET) {
+			return false;
+		}
+		throw_errno("Queue::read() recvmmsg() failed");
+	}
+
+	next_slot = 0;
+	received = 0;
+	for (int i = 0; i < count; i++) {
+		if (!msgs[i].msg_len) {
+			return false; // end of stream; frames are never empty
+		}
+		Slot& slot = slots[i];
+		slot.fd = -1;
+		for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+				std::memcpy(&slot.fd, CMSG_DATA(cmsg), sizeof(int));
+			}
+		}
+		slot.length = msgs[i].msg_hdr.msg_flags & (MSG_TRUNC | MSG_CTRUNC) ? 0 : msgs[i].msg_len;
+		received = i + 1;
+	}
+	return true;
+}
+// calls reader with message of slot; returns false if it's expired
+bool SocketQueue::deliver(Slot& slot, const std::function<void(const void *mem, size_t size)>& reader) {
+	FdGuard memfd{std::exchange(slot.fd, -1)};
+	Frame frame;
+	if (slot.length < sizeof(Frame)) {
+		throw std::runtime_error("Queue::read() malformed message");
+	}
+	std::memcpy(&frame, slot.data.data(), sizeof(frame));
+
+	if (frame.expires || ttl) {
+		const uint64_t time = now();
+		if ((frame.expires && frame.expires <= time) || (ttl && frame.timestamp + ttl <= time)) {
+			expired += 1;
+			return false;
+		}
+	}
+
+	if (memfd.fd == -1) {
+		if (slot.length != sizeof(Frame) + frame.size) {
+			throw std::runtime_error("Queue::read() malformed message");
+		}
+		reader(slot.data.data() + sizeof(Frame), frame.size);
+		return true;
+	}
+	// unsealed memfd could be truncated or modified by sender while reader uses it
+	struct stat st;
+	const int seals = fcntl(memfd.fd, F_GET_SEALS);
+	if (slot.length != sizeof(Frame) || seals == -1 || (seals & memfd_seals) != memfd_seals
+		|| fstat(memfd.fd, &st) || uint64_t(st.st_size) < frame.size) {
+		throw std::runtime_error("Queue::read() malformed message");
+	}
+	void *mem = mmap(nullptr, frame.size, PROT_READ, MAP_SHARED, memfd.fd, 0);
+	if (mem == MAP_FAILED) {
+		throw_errno("Queue::read() mmap() failed");
+	}
+	MapGuard map{mem, frame.size};
+	reader(mem, frame.size);
+	return true;
+}
+void SocketQueue::cancel_read(ReadRet reason) {
+	int none = ReadRet::ReadOk;
+	cancel.compare_exchange_strong(none, reason); // if not, previous one wasn't consumed yet
+	const uint64_t one = 1;
+	(void)!::write(cancel_fd, &one, sizeof(one));
+}
+QueueStats SocketQueue::stats() {
+	QueueStats stats{};
+	stats.expired = expired;
+	return stats;
+}
+
+#else
+
+SocketQueue::SocketQueue(const std::string&, bool is_producer, bool, bool, const QueueOptions&): is_producer(is_producer) {
+	throw std::runtime_error("Queue socket transport is supported only on Linux");
+}
+SocketQueue::~SocketQueue() noexcept {
+}
+void SocketQueue::write(const std::function<void(void *mem)>&, size_t, uint64_t) {
+}
+QueueConsumer::ReadRet SocketQueue::read(const std::function<void(const void *mem, size_t size)>&) {
+	return ReadRet::ReadDestroyed;
+}
+void SocketQueue::cancel_read(ReadRet) {
+}
+QueueStats SocketQueue::stats() {
+	return {};
+}
+
+#endif
+
+} // namespace ipclib
@@ -0,0 +1,127 @@
+// Queue transport over Unix domain socket, for processes which can't share memory
+
+#pragma once
+
+#include "ipclib/Queue.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace ipclib
+{
+
+/*
+
+	Socket is SOCK_SEQPACKET, so each message is one datagram:
+	   Frame object
+	   bytes, only if message isn't bigger than max_inline
+	Bigger message is written by producer directly into memfd, which is passed with
+	SCM_RIGHTS instead of bytes; consumer maps it, so message isn't copied at all.
+	Producer seals memfd against writes and resizing before sending, consumer rejects unsealed one.
+
+	Side which created queue listens on socket path and owns it. Side which opened queue
+	connects and sends hello frame with its kind; listener accepts only peers of the other kind.
+	Listener never waits for hello: accepted connection is polled with others until it arrives.
+
+	Producer used by several threads sends messages in batches with one sendmmsg: writers
+	add their messages to pending list, first one sends it all while others wait (group send).
+	Listening producer sends batches to its consumers in turn.
+	Consumer receives up to max_receive_batch datagrams at once with recvmmsg into its buffers
+	and returns them one by one; it polls all its peers, listening socket and eventfd of cancel.
+
+*/
+
+class SocketQueue {
+public:
+	using ReadRet = QueueConsumer::ReadRet;
+
+	static constexpr size_t max_inline = 64 * 1024; // bigger messages are passed in memfd
+	static constexpr int max_send_batch = 64; // messages per sendmmsg
+	static constexpr int max_receive_batch = 16; // per recvmmsg; each takes max_inline buffer
+	static constexpr int accept_interval = 64; // listening producer looks for new consumers once in that many batches
+
+	/// Path is socket name without prefix. Creating side listens, opening side connects
+	SocketQueue(const std::string& path, bool is_producer, bool is_creator, bool allow_existing, const QueueOptions& options);
+	~SocketQueue() noexcept;
+
+	void write(const std::function<void(void *mem)>& writer, size_t size, uint64_t expires);
+	ReadRet read(const std::function<void(const void *mem, size_t size)>& reader);
+	void cancel_read(ReadRet reason);
+	QueueStats stats();
+
+	SocketQueue(const SocketQueue&) = delete;
+
+private:
+	struct Frame {
+		uint64_t size; // byte size of message; hello_magic in hello
+		uint64_t timestamp; // steady clock, nanoseconds; 1 if hello is from producer
+		uint64_t expires; // same; 0 if never
+	};
+	static constexpr uint64_t hello_magic = 0x6575657571637069; // "ipcqueue"
+
+	// message waiting for group send
+	struct Pending {
+		const void *data; // frame and inline bytes
+		size_t size;
+		int fd = -1; // memfd or -1
+		bool done = false;
+		std::exception_ptr error;
+	};
+
+	// accepted connection without hello yet
+	struct Handshake {
+		int fd;
+		uint64_t deadline; // steady clock, nanoseconds; dropped after it
+	};
+
+	// received datagram
+	struct Slot {
+		std::vector<uint8_t> data;
+		size_t length = 0; // 0 if datagram is truncated
+		int fd = -1; // passed memfd
+		alignas(8) char control[32]; // for one descriptor
+	};
+
+	const bool is_producer;
+	bool is_listener = false;
+	std::string path; // unlinked on destruction if listening
+	uint64_t ttl = 0; // nanoseconds, 0 if none
+
+	int listen_fd = -1;
+	std::vector<int> peers;
+	size_t next_peer = 0; // round-robin position
+	std::vector<Handshake> handshakes;
+
+	// producer
+	std::mutex send_mut;
+	std::condition_variable sent;
+	std::vector<Pending*> pending;
+	bool sending = false;
+	int batches = 0; // since last accept
+
+	// consumer
+	int cancel_fd = -1; // eventfd
+	std::atomic<int> cancel{QueueConsumer::ReadOk};
+	bool no_producers = false; // last producer disconnected since previous ReadNoProducersLeft
+	std::vector<Slot> slots;
+	int received = 0; // datagrams in slots
+	int next_slot = 0;
+	std::atomic<uint64_t> expired{0};
+
+	bool listen(const std::string& path, bool allow_existing);
+	void connect(const std::string& path);
+	bool accept_peer();
+	void check_handshakes();
+	size_t pick_consumer();
+	void drop_peer(size_t index);
+	void send_batch(const std::vector<Pending*>& batch);
+	bool receive(int fd);
+	bool deliver(Slot& slot, const std::function<void(const void *mem, size_t size)>& reader);
+};
+
+} // namespace ipclib
@@ -1,8 +1,15 @@
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
 #include <thread>
+#include <vector>
 
+#include "ipclib/Affinity.h"
 #include "ipclib/AsioQueue.h"
+#include "ipclib/AsioSharedMemory.h"
+#include "ipclib/Journal.h"
+#include "ipclib/QueueArena.h"
+#include "ipclib/SharedHashMap.h"
 #include "ipclib/SharedMemory.h"
 
 void sleep(int ms) {
@@ -29,9 +36,71 @@ void test_SharedMemory(bool is_writer) {
 		
 		sleep(2000);
 		printf("1. shm size is %d\n", int(shm.size()));
-		shm.write_lock().data()[65535] = 42;
-		shm.update_size();
-		printf("2. shm size is %d\n", int(shm.size()));
+		auto lock = shm.write_lock(); // remaps after resize
+		lock.data()[lock.size() - 1] = 42;
+		printf("2. shm size is %d\n", int(lock.size()));
+	}
+}
+
+void test_SharedMemoryMirror(bool is_writer) {
+	if (!is_writer) {
+		return;
+	}
+	auto shm = ipclib::SharedMemory::create("test");
+	shm.resize(4096);
+	ipclib::SharedMemoryMirror mirror(shm);
+	mirror.refresh();
+	
+	// descending order, so each mark is inserted in front of the previous ones
+	const int count = 8;
+	{	auto lock = shm.write_lock();
+		for (int i = count - 1; i >= 0; i--) {
+			lock.data()[i * 256] = uint8_t(i + 1);
+			lock.mark_dirty(i * 256, 1);
+		}
+	}
+	size_t copied = mirror.refresh();
+	int correct = 0;
+	for (int i = 0; i < count; i++) {
+		correct += mirror.data()[i * 256] == i + 1;
+	}
+	printf("Mirror copied %d bytes, %d of %d ranges correct\n", int(copied), correct, count);
+}
+
+void test_SharedHashMap(bool is_writer) {
+	const int count = 100000;
+	
+	if (is_writer) {
+		auto shm = ipclib::SharedMemory::create("test");
+		shm.resize(64 * 1024 * 1024);
+		auto map = ipclib::SharedHashMap::create(shm, sizeof(uint64_t));
+		
+		for (uint64_t i = 0; i < count; i++) {
+			map.insert(i, &i);
+		}
+		printf("Inserted %d, capacity %d\n", int(map.size()), int(map.capacity()));
+		
+		sleep(10000); // start readers meanwhile; keeps updating existing keys
+		for (uint64_t i = 0; i < count; i++) {
+			map.update(i, [&](uint8_t *value, bool) { std::memcpy(value, &i, sizeof(i)); });
+		}
+	}
+	else {
+		auto shm = ipclib::SharedMemory::open("test");
+		auto map = ipclib::SharedHashMap::attach(shm);
+		
+		auto t0 = std::chrono::steady_clock::now();
+		int found = 0;
+		for (int n = 0; n < 10; n++) {
+			for (uint64_t i = 0; i < count; i++) {
+				uint64_t value;
+				if (map.find(i, &value) && value == i) {
+					found++;
+				}
+			}
+		}
+		auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+		printf("Found %d of %d in %d ms (%.1f M finds/s)\n", found, count * 10, int(ms), count * 10 / 1000. / std::max(1, int(ms)));
 	}
 }
 
@@ -89,6 +158,170 @@ void test_AsioQueue(bool is_writer) {
 	}).join();
 }
 
+void test_AsioSharedMemory(bool is_writer) {
+	if (is_writer) {
+		auto shm = ipclib::SharedMemory::create("test");
+		shm.resize(4096);
+		
+		auto lock = shm.write_lock();
+		printf("Holding write lock\n");
+		sleep(5000);
+		lock.data()[0] = 42;
+	}
+	else {
+		asio::io_context io;
+		ipclib::AsioSharedMemory shm(io, ipclib::SharedMemory::open("test"));
+		
+		// shows that io_context isn't blocked while waiting
+		asio::steady_timer timer(io);
+		std::function<void()> tick = [&]{
+			timer.expires_after(std::chrono::milliseconds(500));
+			timer.async_wait([&](auto err) {
+				if (!err) {
+					printf("tick\n");
+					tick();
+				}
+			});
+		};
+		tick();
+		
+		shm.async_read_lock([&](auto err, auto lock) {
+			if (err) {
+				printf("LOCK error: %s\n", err.message().c_str());
+			}
+			else {
+				printf("read %d\n", lock->data()[0]);
+			}
+			timer.cancel();
+		});
+		io.run();
+	}
+}
+
+void test_QueueArena(bool is_writer) {
+	const int count = 2000;
+	
+	if (is_writer) {
+		auto shm = ipclib::SharedMemory::create("test");
+		shm.resize(64 * 1024 * 1024);
+		auto arena = ipclib::QueueArena::create(shm);
+		
+		std::vector<ipclib::ArenaQueueProducer> queues;
+		for (int i = 0; i < count; i++) {
+			queues.push_back(ipclib::ArenaQueueProducer::create(arena, "queue" + std::to_string(i), 4096));
+		}
+		sleep(10000); // start reader meanwhile
+		for (int i = 0; i < count; i++) {
+			queues[i].write_message([&](void *mem) { std::memcpy(mem, &i, sizeof(i)); }, sizeof(i));
+		}
+	}
+	else {
+		auto shm = ipclib::SharedMemory::open("test");
+		auto arena = ipclib::QueueArena::attach(shm);
+		
+		auto t0 = std::chrono::steady_clock::now();
+		std::vector<ipclib::ArenaQueueConsumer> queues;
+		for (int i = 0; i < count; i++) {
+			queues.push_back(ipclib::ArenaQueueConsumer::open(arena, "queue" + std::to_string(i)));
+		}
+		auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count();
+		printf("Opened %d queues in %d us\n", count, int(us));
+		
+		int correct = 0;
+		for (int i = 0; i < count; i++) {
+			queues[i].read_message([&](const void *mem, size_t) { correct += *static_cast<const int*>(mem) == i; });
+		}
+		printf("Received %d of %d\n", correct, count);
+	}
+}
+
+void test_Journal(bool is_writer) {
+	if (is_writer) {
+		ipclib::JournalOptions options;
+		options.sync_writes = true;
+		auto journal = ipclib::JournalProducer::open("test_journal", options);
+		for (int i = 0; i < 10; i++) {
+			auto seq = journal.write_message([&](void *mem) { std::memcpy(mem, &i, sizeof(i)); }, sizeof(i));
+			printf("written %d\n", int(seq));
+			sleep(1000);
+		}
+	}
+	else {
+		// restart reader to see it continue from committed message
+		auto journal = ipclib::JournalConsumer::open("test_journal", "reader");
+		printf("starting at %d\n", int(journal.position()));
+		while (journal.read_message([](uint64_t seq, const void *mem, size_t) {
+			printf("read %d: %d\n", int(seq), *static_cast<const int*>(mem));
+		}) == ipclib::QueueConsumer::ReadOk) {
+			journal.commit();
+		}
+	}
+}
+
+// round-trip latency of sleeping and busy-polling consumers; needs at least 2 CPUs
+void test_QueueLatency(bool is_writer) {
+	const int count = 100000;
+	
+	if (is_writer) {
+		auto ping = ipclib::QueueProducer::create("test_ping", true);
+		auto pong = ipclib::QueueConsumer::create("test_pong", true);
+		ipclib::pin_this_thread({0});
+		sleep(10000); // start reader meanwhile
+		
+		for (bool busy_poll : {false, true}) {
+			pong.set_busy_poll(busy_poll);
+			std::vector<int64_t> times;
+			for (int i = 0; i < count; i++) {
+				auto t0 = std::chrono::steady_clock::now();
+				ping.write_message([&](void *mem) { *static_cast<bool*>(mem) = busy_poll; }, 1);
+				pong.read_message([](const void*, size_t) {});
+				times.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count());
+			}
+			std::sort(times.begin(), times.end());
+			printf("%s: round trip median %d ns, 99%% %d ns\n", busy_poll ? "busy poll" : "sleeping",
+			       int(times[count / 2]), int(times[count * 99 / 100]));
+		}
+	}
+	else {
+		auto ping = ipclib::QueueConsumer::open("test_ping");
+		auto pong = ipclib::QueueProducer::open("test_pong");
+		ipclib::pin_this_thread({1});
+		
+		bool busy_poll = false;
+		while (ping.read_message([&](const void *mem, size_t) { busy_poll = *static_cast<const bool*>(mem); }) == ipclib::QueueConsumer::ReadOk) {
+			ping.set_busy_poll(busy_poll); // for the next one
+			pong.write_message([](void*) {}, 1);
+		}
+	}
+}
+
+void test_SocketQueue(bool is_writer) {
+	const char *name = "unix:/tmp/ipclib_test.sock"; // same code as for shm, only name differs
+	const size_t sizes[] = {16, 1024, 1024 * 1024, 16 * 1024 * 1024}; // bigger ones are passed in memfd
+	
+	if (is_writer) {
+		ipclib::remove_queue(name);
+		auto q = ipclib::QueueProducer::create(name); // blocks in write until reader connects
+		for (size_t size : sizes) {
+			q.write_message([&](void *mem) { std::memset(mem, int(size % 255), size); }, size);
+		}
+	}
+	else {
+		auto q = ipclib::QueueConsumer::open(name);
+		while (true) {
+			auto t0 = std::chrono::steady_clock::now();
+			auto ret = q.read_message([&](const void *mem, size_t size) {
+				auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count();
+				printf("Received %d bytes in %d us, %s\n", int(size), int(us), static_cast<const uint8_t*>(mem)[size - 1] == size % 255 ? "correct" : "CORRUPTED");
+			});
+			if (ret) {
+				printf("Read returned %d\n", int(ret));
+				break;
+			}
+		}
+	}
+}
+
 int main(int argc, char *argv[]) {
     (void) argv;
 
@@ -101,6 +334,13 @@ int main(int argc, char *argv[]) {
 	
     try {
         //test_SharedMemory(is_writer);
+		//test_SharedMemoryMirror(is_writer);
+		//test_SharedHashMap(is_writer);
+		//test_AsioSharedMemory(is_writer);
+		//test_QueueArena(is_writer);
+		//test_Journal(is_writer);
+		//test_QueueLatency(is_writer);
+		//test_SocketQueue(is_writer);
 		test_AsioQueue(is_writer);
 		
 		printf("%s FINISHED\n", is_writer ? "WRITER" : "READER");